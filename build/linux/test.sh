@@ -15,4 +15,8 @@ head -c 100000 /dev/urandom > data
 wait
 cmp data test/data
 
+# behavior tests
+qmake tests/tests.pro -o tests/Makefile
+make -C tests check
+
 set +xue
@@ -1,6 +1,9 @@
 # Comment this to only compile the command line interface
 CONFIG += localshare_gui
 
+# Uncomment this to add static tracepoints (USDT) for bpftrace/perf/systemtap (requires sys/sdt.h)
+#CONFIG += localshare_usdt
+
 ### Compilation ###
 
 TEMPLATE = app
@@ -16,11 +19,20 @@ HEADERS += \
 	src/portability.h \
 	\
 	src/core_discovery.h \
+	src/core_eventlog.h \
+	src/core_filter.h \
 	src/core_localshare.h \
+	src/core_md5.h \
 	src/core_payload.h \
+	src/core_probe.h \
+	src/core_profile.h \
+	src/core_pull.h \
+	src/core_scheduler.h \
 	src/core_server.h \
 	src/core_settings.h \
+	src/core_trace.h \
 	src/core_transfer.h \
+	src/core_watchdog.h \
 	\
 	src/cli_indicator.h \
 	src/cli_main.h \
@@ -30,6 +42,9 @@ SOURCES += \
 	src/cli_main.cpp \
 	src/main.cpp
 
+localshare_usdt {
+	DEFINES += LOCALSHARE_HAS_USDT
+}
 
 ### DNS service discovery library ###
 
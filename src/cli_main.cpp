@@ -16,6 +16,7 @@
  */
 #include <QCommandLineParser>
 #include <QCoreApplication>
+#include <QElapsedTimer>
 #include <QTextStream>
 #include <QTimer>
 #include <QtGlobal>
@@ -26,7 +27,9 @@
 #include "cli_transfer.h"
 #include "cli_misc.h"
 #include "compatibility.h"
+#include "core_eventlog.h"
 #include "core_transfer.h"
+#include "core_watchdog.h"
 #include "portability.h"
 
 namespace Cli {
@@ -35,6 +38,10 @@ namespace {
 	enum Verbosity { VerboseLevel = 2, NormalLevel = 1, QuietLevel = 0 } verbosity{NormalLevel};
 	bool last_output_was_progress{false};
 
+	// Startup timing report (--timing)
+	QElapsedTimer startup_timer;
+	bool show_timing{false};
+
 	void print (FILE * stream, const QString & msg, Verbosity min_level) {
 		if (verbosity >= min_level)
 			QTextStream (stream) << msg;
@@ -47,6 +54,29 @@ namespace {
 		}
 	}
 
+	// Event log file: written at exit if set (--event-log), else only on failure or crash
+	QString event_log_path;
+	void dump_event_log (void) {
+		auto path = event_log_path.isEmpty () ? EventLog::default_path () : event_log_path;
+		if (EventLog::Log::instance ().dump_to (path))
+			qDebug ("Event log written to %s", qUtf8Printable (path));
+		else
+			qWarning ("Unable to write event log to %s", qUtf8Printable (path));
+	}
+
+	// Event loop, with a report of its stalls in verbose mode
+	int run (QCoreApplication & app) {
+		auto & monitor = Watchdog::Monitor::instance ();
+		if (verbosity >= VerboseLevel)
+			monitor.start_dispatch_probe ();
+		auto code = app.exec ();
+		insert_newline_if_needed ();
+		print (stdout, monitor.report (), VerboseLevel);
+		if (!event_log_path.isEmpty () || code != EXIT_SUCCESS)
+			dump_event_log ();
+		return code;
+	}
+
 	// Handler that suppress output from debug/warnings.
 	QtMessageHandler old_handler{nullptr};
 	void suppress_output_handler (QtMsgType type, const QMessageLogContext & context,
@@ -89,10 +119,20 @@ void exit_error (void) {
 	QCoreApplication::exit (EXIT_FAILURE);
 }
 
+void timing_mark (const char * step) {
+	if (show_timing) {
+		insert_newline_if_needed ();
+		QTextStream (stderr) << QStringLiteral ("Timing: %1ms %2\n")
+		                            .arg (startup_timer.nsecsElapsed () / 1e6, 0, 'f', 1)
+		                            .arg (step);
+	}
+}
+
 /* Entry point.
  * Parses command line arguments and start appropriate mode.
  */
 int start (int & argc, char **& argv) {
+	startup_timer.start ();
 	QCoreApplication app (argc, argv);
 	Const::setup (app);
 
@@ -102,15 +142,19 @@ int start (int & argc, char **& argv) {
 	    tr ("Small file sharing application for the local network.\n"
 	        "\n"
 	        "No options: use graphical mode.\n"
-	        "Command line mode is enabled when you specify either Upload, Download, or List mode.\n"
-	        "The three CLI modes are exclusive.\n"
+	        "Command line mode is enabled when you specify either Upload, Download, Seed, Pull, "
+	        "or List mode.\n"
+	        "The CLI modes are exclusive.\n"
 	        "Returns 0 if the transfer completed correctly, 1 otherwise.\n"
 	        "\n"
 	        "Usage example:\n"
 	        "$ %1 -u <file> -p <destination_username>   # Upload\n"
+	        "$ %1 -u <file> -p <peer1> -p <peer2>   # Upload to several peers at once\n"
 	        "$ %1 -d   # Download from anyone\n"
 	        "$ %1 -d -p <peer>   # Download from <peer> only\n"
 	        "$ %1 -d -n <username>   # Download as destination <username>\n"
+	        "$ %1 --seed <file> -n <username>   # Serve <file> to pullers as <username>\n"
+	        "$ %1 --pull -p <seed1> -p <seed2>   # Download from several seeds at once\n"
 	        "$ %1 -l   # List connected peers")
 	        .arg (Const::app_name));
 	auto help_opt = parser.addHelpOption ();
@@ -124,16 +168,29 @@ int start (int & argc, char **& argv) {
 	parser.addOption (download_opt);
 	QCommandLineOption upload_opt (QStringList () << "u"
 	                                              << "upload",
-	                               tr ("Uploads a file to <peer>."), tr ("filename"));
+	                               tr ("Uploads a file to <peer> (repeat -p to upload to several "
+	                                   "peers, reading the file once)."),
+	                               tr ("filename"));
 	parser.addOption (upload_opt);
 	QCommandLineOption list_peer_opt (QStringList () << "l"
 	                                                 << "list",
 	                                  tr ("List peers mode"));
 	parser.addOption (list_peer_opt);
+	QCommandLineOption seed_opt (QStringList () << "seed",
+	                             tr ("Serve a file to pullers until interrupted."), tr ("filename"));
+	parser.addOption (seed_opt);
+	QCommandLineOption pull_opt (
+	    QStringList () << "pull",
+	    tr ("Download the payload of seeds <peer> (repeat -p to use several seeds at once)."));
+	parser.addOption (pull_opt);
+	QCommandLineOption probe_opt (
+	    QStringList () << "probe",
+	    tr ("Measure round trip time and throughput to <peer> (a localshare waiting downloads)."));
+	parser.addOption (probe_opt);
 	QCommandLineOption username_opt (QStringList () << "n"
 	                                                << "name",
-	                                 tr ("Local Zeroconf username"), tr ("username"),
-	                                 Settings::Username ().get ());
+	                                 tr ("Local Zeroconf username (default from settings)."),
+	                                 tr ("username"));
 	parser.addOption (username_opt);
 	QCommandLineOption peer_opt (QStringList () << "p"
 	                                            << "peer",
@@ -141,16 +198,17 @@ int start (int & argc, char **& argv) {
 	parser.addOption (peer_opt);
 	QCommandLineOption target_dir_opt (QStringList () << "t"
 	                                                  << "target-dir",
-	                                   tr ("Target directory for downloads."), tr ("path"),
-	                                   Settings::DownloadPath ().get ());
+	                                   tr ("Target directory for downloads (default from settings)."),
+	                                   tr ("path"));
 	parser.addOption (target_dir_opt);
 	QCommandLineOption yes_opt (QStringList () << "y"
 	                                           << "yes",
 	                            tr ("Automatically accept prompts."));
 	parser.addOption (yes_opt);
-	QCommandLineOption verbose_opt (QStringList () << "v"
-	                                               << "verbose",
-	                                tr ("Show more messages."));
+	QCommandLineOption verbose_opt (
+	    QStringList () << "v"
+	                   << "verbose",
+	    tr ("Show more messages, and event loop latency statistics at exit."));
 	parser.addOption (verbose_opt);
 	QCommandLineOption quiet_opt (QStringList () << "q"
 	                                             << "quiet",
@@ -159,6 +217,76 @@ int start (int & argc, char **& argv) {
 	QCommandLineOption hidden_files_opt (QStringList () << "hidden",
 	                                     tr ("Send hidden files when sending directories."));
 	parser.addOption (hidden_files_opt);
+	QCommandLineOption exclude_opt (
+	    QStringList () << "exclude",
+	    tr ("Do not send files matching <pattern> (gitignore syntax, can be repeated)."),
+	    tr ("pattern"));
+	parser.addOption (exclude_opt);
+	QCommandLineOption include_opt (
+	    QStringList () << "include",
+	    tr ("Send files matching <pattern> even if excluded (can be repeated)."), tr ("pattern"));
+	parser.addOption (include_opt);
+	QCommandLineOption pipeline_opt (
+	    QStringList () << "pipeline",
+	    tr ("Start sending a directory while it is still being scanned (for huge trees)."));
+	parser.addOption (pipeline_opt);
+	QCommandLineOption network_only_opt (
+	    QStringList () << "network-only",
+	    tr ("Download through the network even if the peer is on the same host."));
+	parser.addOption (network_only_opt);
+	QCommandLineOption timeout_opt (
+	    QStringList () << "timeout",
+	    tr ("Abort a transfer if the peer does not respond for <seconds> (default from settings)."),
+	    tr ("seconds"));
+	parser.addOption (timeout_opt);
+	QCommandLineOption connect_opt (
+	    QStringList () << "connect",
+	    tr ("Upload or probe <address:port> directly, without discovery (-p is then optional)."),
+	    tr ("address:port"));
+	parser.addOption (connect_opt);
+	QCommandLineOption no_probe_opt (
+	    QStringList () << "no-probe",
+	    tr ("Upload with default parameters, without measuring the link to the peer."));
+	parser.addOption (no_probe_opt);
+	QCommandLineOption port_opt (QStringList () << "port",
+	                             tr ("Listen for downloads on <port> (default: any free port)."),
+	                             tr ("port"));
+	parser.addOption (port_opt);
+	QCommandLineOption profile_opt (
+	    QStringList () << "profile",
+	    tr ("Network profile of sent data: %1 (default: default).")
+	        .arg (Transfer::Profile::names ().join (", ")),
+	    tr ("name"));
+	parser.addOption (profile_opt);
+	QCommandLineOption pace_opt (QStringList () << "pace",
+	                             tr ("Limit the send rate to <rate> Mbit/s, evenly spread in time."),
+	                             tr ("rate"));
+	parser.addOption (pace_opt);
+	QCommandLineOption congestion_opt (
+	    QStringList () << "congestion",
+	    tr ("TCP congestion control algorithm of sent data (Linux, overrides the profile)."),
+	    tr ("algorithm"));
+	parser.addOption (congestion_opt);
+	QCommandLineOption background_opt (
+	    QStringList () << "background",
+	    tr ("Low impact transfer: lowest CPU and disk priority, and the background profile "
+	        "(TCP-LP, DSCP CS1) unless --profile is set."));
+	parser.addOption (background_opt);
+	QCommandLineOption cache_opt (
+	    QStringList () << "cache",
+	    tr ("Page cache use of transfered files: auto (drop if larger than memory), drop or keep "
+	        "(default from settings)."),
+	    tr ("mode"));
+	parser.addOption (cache_opt);
+	QCommandLineOption timing_opt (QStringList () << "timing",
+	                               tr ("Print timings of startup steps to stderr."));
+	parser.addOption (timing_opt);
+	QCommandLineOption event_log_opt (
+	    QStringList () << "event-log",
+	    tr ("Write the event log to <file> at exit (by default, it is only written to the cache "
+	        "directory on failure or crash). Decoded by tools/eventlog."),
+	    tr ("file"));
+	parser.addOption (event_log_opt);
 
 	parser.process (app);
 	if (parser.isSet (version_opt)) {
@@ -172,10 +300,18 @@ int start (int & argc, char **& argv) {
 	if (parser.isSet (quiet_opt))
 		verbosity = QuietLevel;
 	old_handler = qInstallMessageHandler (suppress_output_handler);
+	show_timing = parser.isSet (timing_opt);
+	event_log_path = parser.value (event_log_opt);
+	EventLog::Log::instance ().dump_on_crash (
+	    event_log_path.isEmpty () ? EventLog::default_path () : event_log_path);
+	timing_mark ("options parsed");
 
 	const auto list_mode = parser.isSet (list_peer_opt);
 	const auto download_mode = parser.isSet (download_opt);
 	const auto upload_mode = parser.isSet (upload_opt);
+	const auto seed_mode = parser.isSet (seed_opt);
+	const auto pull_mode = parser.isSet (pull_opt);
+	const auto probe_mode = parser.isSet (probe_opt);
 
 	int nb_mode_requested = 0;
 	if (list_mode)
@@ -184,6 +320,12 @@ int start (int & argc, char **& argv) {
 		nb_mode_requested++;
 	if (upload_mode)
 		nb_mode_requested++;
+	if (seed_mode)
+		nb_mode_requested++;
+	if (pull_mode)
+		nb_mode_requested++;
+	if (probe_mode)
+		nb_mode_requested++;
 	if (nb_mode_requested > 1) {
 		QTextStream (stderr) << tr (
 		    "Error: modes are exclusive, only one must be set (see -h for help).\n");
@@ -197,18 +339,116 @@ int start (int & argc, char **& argv) {
 	if (list_mode) {
 		// List and quit
 		PeerBrowser browser;
-		return app.exec ();
+		timing_mark ("discovery started");
+		return run (app);
+	}
+
+	// Defaults are read from settings only if needed (opening settings is not free)
+	const auto username =
+	    parser.isSet (username_opt) ? parser.value (username_opt) : Settings::Username ().get ();
+	int peer_timeout;
+	if (parser.isSet (timeout_opt)) {
+		bool timeout_ok = false;
+		peer_timeout = parser.value (timeout_opt).toInt (&timeout_ok);
+		if (!timeout_ok || peer_timeout < 2) {
+			QTextStream (stderr) << tr ("Error: timeout must be an integer of at least 2 seconds.\n");
+			return EXIT_FAILURE;
+		}
+	} else {
+		peer_timeout = Settings::PeerTimeout ().get ();
+	}
+	// Filters: settings, then command line (last matching pattern wins)
+	auto make_filter = [&] {
+		Payload::Filter filter;
+		filter.add_patterns (Settings::UploadFilters ().get ());
+		for (auto & pattern : parser.values (exclude_opt))
+			filter.add_exclude (pattern);
+		for (auto & pattern : parser.values (include_opt))
+			filter.add_include (pattern);
+		return filter;
+	};
+	Transfer::Profile profile;
+	const auto profile_name = parser.isSet (profile_opt)
+	                              ? parser.value (profile_opt)
+	                              : parser.isSet (background_opt) ? QStringLiteral ("background")
+	                                                              : QStringLiteral ("default");
+	if (!Transfer::Profile::from_name (profile_name, profile)) {
+		QTextStream (stderr) << tr ("Error: unknown profile \"%1\" (see -h for help).\n")
+		                            .arg (profile_name);
+		return EXIT_FAILURE;
+	}
+	if (parser.isSet (pace_opt)) {
+		bool pace_ok = false;
+		auto mbit = parser.value (pace_opt).toDouble (&pace_ok);
+		if (!pace_ok || mbit <= 0.) {
+			QTextStream (stderr) << tr ("Error: pace must be a positive rate in Mbit/s.\n");
+			return EXIT_FAILURE;
+		}
+		profile.pacing_rate = qint64 (mbit * 1e6 / 8.);
+	}
+	if (parser.isSet (congestion_opt))
+		profile.congestion_control = parser.value (congestion_opt).toLatin1 ();
+
+	auto cache_mode = Payload::Manager::CacheAuto;
+	if (parser.isSet (cache_opt) &&
+	    !Payload::Manager::cache_mode_from_name (parser.value (cache_opt), cache_mode)) {
+		QTextStream (stderr) << tr ("Error: --cache expects one of: %1.\n")
+		                            .arg (Payload::Manager::cache_mode_names ().join (", "));
+		return EXIT_FAILURE;
 	}
+
+	// Before any thread is created, so that they inherit it
+	if (parser.isSet (background_opt) && !set_process_background ())
+		qWarning ("Background priority could only be partially applied");
+
+	// Direct peer (--connect): address:port, with brackets around IPv6 addresses
+	QHostAddress direct_address;
+	quint16 direct_port = 0;
+	if (parser.isSet (connect_opt)) {
+		auto value = parser.value (connect_opt);
+		auto sep = value.lastIndexOf (':');
+		bool port_ok = false;
+		direct_port = value.mid (sep + 1).toUShort (&port_ok);
+		auto host = value.left (sep);
+		if (host.startsWith ('[') && host.endsWith (']'))
+			host = host.mid (1, host.size () - 2);
+		if (sep == -1 || !port_ok || direct_port == 0 || !direct_address.setAddress (host)) {
+			QTextStream (stderr) << tr ("Error: --connect expects an address:port value.\n");
+			return EXIT_FAILURE;
+		}
+	}
+	const auto peer = parser.isSet (peer_opt) ? parser.value (peer_opt) : parser.value (connect_opt);
+
 	if (upload_mode) {
 		// Upload
-		if (!parser.isSet (peer_opt)) {
+		if (direct_address.isNull () && !parser.isSet (peer_opt)) {
 			QTextStream (stderr) << tr ("Error: target peer of upload is not set (see -h for help).\n");
 			return EXIT_FAILURE;
 		}
-		Upload upload (parser.value (upload_opt), parser.value (peer_opt), parser.value (username_opt),
-		               parser.isSet (hidden_files_opt));
+		const auto probe = parser.isSet (no_probe_opt) ? Transfer::Upload::ProbeNever
+		                                               : Transfer::Upload::ProbeIfNeeded;
+		if (parser.values (peer_opt).size () > 1) {
+			if (!direct_address.isNull () || parser.isSet (pipeline_opt)) {
+				QTextStream (stderr) << tr (
+				    "Error: uploads to several peers support neither --connect nor --pipeline.\n");
+				return EXIT_FAILURE;
+			}
+			FanOut fan_out (parser.value (upload_opt), parser.values (peer_opt), username,
+			                parser.isSet (hidden_files_opt), make_filter (), peer_timeout, profile,
+			                probe);
+			if (parser.isSet (cache_opt))
+				fan_out.set_cache_mode (cache_mode);
+			QTimer::singleShot (0, &fan_out, SLOT (start ()));
+			return run (app);
+		}
+		Upload upload (parser.value (upload_opt), peer, username, parser.isSet (hidden_files_opt),
+		               parser.isSet (pipeline_opt), make_filter (), peer_timeout, profile, probe);
+		if (!direct_address.isNull ())
+			upload.set_direct_peer (direct_address, direct_port);
+		if (parser.isSet (cache_opt))
+			upload.set_cache_mode (cache_mode);
 		QTimer::singleShot (0, &upload, SLOT (start ()));
-		return app.exec ();
+		return run (app);
 	}
 	if (download_mode) {
 		// Download
@@ -217,10 +457,51 @@ int start (int & argc, char **& argv) {
 			                            "use -y to bypass it (see -h for help).\n");
 			return EXIT_FAILURE;
 		}
-		Download download (parser.value (username_opt), parser.value (target_dir_opt),
-		                   parser.value (peer_opt), parser.isSet (yes_opt));
+		const auto target_dir = parser.isSet (target_dir_opt) ? parser.value (target_dir_opt)
+		                                                      : Settings::DownloadPath ().get ();
+		quint16 listen_port = 0;
+		if (parser.isSet (port_opt)) {
+			bool port_ok = false;
+			listen_port = parser.value (port_opt).toUShort (&port_ok);
+			if (!port_ok) {
+				QTextStream (stderr) << tr ("Error: --port expects a port number.\n");
+				return EXIT_FAILURE;
+			}
+		}
+		Download download (username, target_dir, parser.value (peer_opt), parser.isSet (yes_opt),
+		                   !parser.isSet (network_only_opt), peer_timeout, listen_port);
+		if (parser.isSet (cache_opt))
+			download.set_cache_mode (cache_mode);
 		QTimer::singleShot (0, &download, SLOT (start ()));
-		return app.exec ();
+		return run (app);
+	}
+	if (seed_mode) {
+		Seed seed (parser.value (seed_opt), username, parser.isSet (hidden_files_opt), make_filter (),
+		           profile);
+		QTimer::singleShot (0, &seed, SLOT (start ()));
+		return run (app);
+	}
+	if (probe_mode) {
+		if (direct_address.isNull () && !parser.isSet (peer_opt)) {
+			QTextStream (stderr) << tr ("Error: peer to probe is not set (see -h for help).\n");
+			return EXIT_FAILURE;
+		}
+		Probe probe (peer, peer_timeout, profile);
+		if (!direct_address.isNull ())
+			probe.set_direct_peer (direct_address, direct_port);
+		QTimer::singleShot (0, &probe, SLOT (start ()));
+		return run (app);
+	}
+	if (pull_mode) {
+		if (!parser.isSet (peer_opt)) {
+			QTextStream (stderr) << tr ("Error: seeds of pull are not set (see -h for help).\n");
+			return EXIT_FAILURE;
+		}
+		const auto target_dir = parser.isSet (target_dir_opt) ? parser.value (target_dir_opt)
+		                                                      : Settings::DownloadPath ().get ();
+		Pull pull (target_dir, parser.values (peer_opt), peer_timeout);
+		QTimer::singleShot (0, &pull, SLOT (start ()));
+		return run (app);
 	}
 	Q_UNREACHABLE ();
 	return EXIT_FAILURE;
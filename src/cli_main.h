@@ -34,6 +34,8 @@ void error_print (const QString & msg);
 void exit_nicely (void);
 void exit_error (void);
 
+void timing_mark (const char * step);
+
 int start (int & argc, char **& argv);
 }
 
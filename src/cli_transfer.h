@@ -21,15 +21,21 @@
 #include <QCoreApplication>
 #include <QHostAddress>
 #include <QHostInfo>
+#include <QSet>
 #include <QTextStream>
 #include <QTime>
 #include <cstdio>
+#include <memory>
 
 #include "cli_indicator.h"
 #include "cli_main.h"
 #include "core_discovery.h"
+#include "core_filter.h"
 #include "core_localshare.h"
 #include "core_payload.h"
+#include "core_probe.h"
+#include "core_profile.h"
+#include "core_pull.h"
 #include "core_server.h"
 #include "core_settings.h"
 #include "core_transfer.h"
@@ -72,7 +78,7 @@ public slots:
 		Q_ASSERT (notifier);
 		auto & p = notifier->payload;
 		file_nb.current = p.get_nb_files_transfered ();
-		auto progress = static_cast<qreal> (p.get_total_transfered_size ()) /
+		auto progress = static_cast<qreal> (notifier->get_transfered_size ()) /
 		                static_cast<qreal> (qMax (p.get_total_size (), qint64 (1)));
 		byte_progress_bar.set_ratio (progress);
 		byte_progress.value = progress;
@@ -109,6 +115,27 @@ void status_changed_helper (Status new_status, const Transfer::Notifier * notifi
 	}
 }
 
+// Report files left out by filters
+inline void print_skipped (const Payload::Manager & payload) {
+	auto & skipped = payload.get_skipped ();
+	if (skipped.nb_files > 0 || skipped.nb_dirs > 0)
+		verbose_print (qApp->translate ("print_skipped",
+		                                "Excluded %1 files (%2) and %3 directories.\n")
+		                   .arg (skipped.nb_files)
+		                   .arg (size_to_string (skipped.size))
+		                   .arg (skipped.nb_dirs));
+}
+
+// Logical and transfered sizes, if hard links are sent once
+inline QString describe_links (const Payload::Manager & payload) {
+	if (payload.get_nb_links () == 0)
+		return QString ();
+	return qApp->translate ("describe_links", "%1 hard links: %2 of files, %3 to transfer.\n")
+	    .arg (payload.get_nb_links ())
+	    .arg (size_to_string (payload.get_logical_size ()),
+	          size_to_string (payload.get_total_size ()));
+}
+
 /* Both upload and download represent an event like but linear flow.
  * These classes are built on the stack before event loop start.
  * To avoid out-of-event-loop problems, defer operations in start().
@@ -118,6 +145,8 @@ void status_changed_helper (Status new_status, const Transfer::Notifier * notifi
  * LocalDnsPeer is required by Browser to filter our own ServiceRecord.
  * However in this case we have no ServiceRecord and want no filtering.
  * A default LocalDnsPeer will make Browser filter on username "", which should be ok.
+ *
+ * With a direct address (--connect), there is no discovery: used for proxies and benchmarks.
  */
 class Upload : public QObject {
 	Q_OBJECT
@@ -125,6 +154,8 @@ class Upload : public QObject {
 private:
 	const QString file_path;
 	const bool send_hidden_files;
+	const bool pipelined;
+	const Payload::Filter filter;
 
 	Discovery::LocalDnsPeer local_peer; // dummy
 	Discovery::Browser * browser{nullptr};
@@ -132,34 +163,67 @@ private:
 
 	bool peer_found{false};
 	quint16 port{0};
+	QHostAddress direct_address; // Null if the peer is discovered
 
 public:
 	Upload (const QString & file_path, const QString & peer_username, const QString & local_username,
-	        bool send_hidden_files)
+	        bool send_hidden_files, bool pipelined, const Payload::Filter & filter, int peer_timeout,
+	        const Transfer::Profile & profile, Transfer::Upload::ProbeMode probe_mode)
 	    : file_path (file_path),
 	      send_hidden_files (send_hidden_files),
-	      upload (peer_username, local_username) {}
+	      pipelined (pipelined),
+	      filter (filter),
+	      upload (peer_username, local_username) {
+		upload.set_peer_timeout (peer_timeout);
+		upload.set_profile (profile);
+		upload.set_probe_mode (probe_mode);
+	}
+
+	void set_direct_peer (const QHostAddress & address, quint16 address_port) {
+		direct_address = address;
+		port = address_port;
+	}
+	void set_cache_mode (Payload::Manager::CacheMode mode) { upload.set_cache_mode (mode); }
 
 public slots:
 	void start (void) {
 		connect (&upload, &Transfer::Upload::failed, this, &Upload::upload_failed);
 		connect (&upload, &Transfer::Upload::status_changed, this, &Upload::upload_status_changed);
+		connect (&upload, &Transfer::Upload::queue_position_changed, [](int position) {
+			normal_print (tr ("Queued by the peer, at position %1.\n").arg (position));
+		});
+
+		if (direct_address.isNull ()) {
+			// Discovery first: peer lookup then runs in background during the payload scan
+			browser = new Discovery::Browser (&local_peer);
+			connect (browser, &Discovery::Browser::added, this, &Upload::peer_discovered);
+			connect (browser, &Discovery::Browser::being_destroyed, this, &Upload::browser_end);
+			timing_mark ("discovery started");
+		}
 
-		if (!upload.set_payload (file_path, send_hidden_files))
+		if (!upload.set_payload (file_path, send_hidden_files, pipelined, filter))
 			return;
 		new ProgressIndicator (upload.get_notifier ());
+		timing_mark ("payload scanned");
 
 		auto & payload = upload.get_payload ();
-		verbose_print (tr ("Upload payload: %1 (%2 files, total size=%3).\n")
-		                   .arg (payload.get_payload_dir_display (),
-		                         QString::number (payload.get_nb_files ()),
-		                         size_to_string (payload.get_total_size ())));
-
-		browser = new Discovery::Browser (&local_peer);
-		connect (browser, &Discovery::Browser::added, this, &Upload::peer_discovered);
-		connect (browser, &Discovery::Browser::being_destroyed, this, &Upload::browser_end);
-
-		verbose_print (tr ("Waiting for username \"%1\"...\n").arg (upload.get_peer_username ()));
+		if (payload.is_manifest_complete ()) {
+			verbose_print (tr ("Upload payload: %1 (%2 files, total size=%3).\n")
+			                   .arg (payload.get_payload_dir_display (),
+			                         QString::number (payload.get_nb_files ()),
+			                         size_to_string (payload.get_total_size ())));
+			verbose_print (describe_links (payload));
+			print_skipped (payload);
+		} else
+			verbose_print (tr ("Upload payload: %1 (scanning while sending).\n")
+			                   .arg (payload.get_payload_dir_display ()));
+		if (direct_address.isNull ()) {
+			verbose_print (tr ("Waiting for username \"%1\"...\n").arg (upload.get_peer_username ()));
+		} else {
+			verbose_print (tr ("Connecting to %1:%2...\n")
+			                   .arg (direct_address.toString (), QString::number (port)));
+			upload.connect (direct_address, port);
+		}
 	}
 
 private slots:
@@ -172,6 +236,7 @@ private slots:
 	void peer_discovered (Discovery::DnsPeer * peer) {
 		if (!peer_found && peer->get_username () == upload.get_peer_username ()) {
 			peer_found = true;
+			timing_mark ("peer found");
 			verbose_print (tr ("Found peer \"%1\" (\"%2\", %3:%4).\n")
 			                   .arg (peer->get_username (), peer->get_service_name (),
 			                         peer->get_hostname (), QString::number (peer->get_port ())));
@@ -187,16 +252,287 @@ private slots:
 		if (address.isNull ()) {
 			error_print (tr ("Failed to resolve address of hostname \"%1\".\n").arg (info.hostName ()));
 		} else {
+			timing_mark ("peer address resolved");
 			verbose_print (
 			    tr ("Connecting to %1:%2...\n").arg (address.toString (), QString::number (port)));
 			upload.connect (address, port);
 		}
 	}
 	void upload_status_changed (Transfer::Upload::Status new_status) const {
+		if (new_status == Transfer::Upload::WaitingForPeerAnswer)
+			timing_mark ("offer sent");
+		if (new_status == Transfer::Upload::Transfering) {
+			verbose_print (tr ("Network: %1.\n").arg (upload.get_profile_info ()));
+			if (upload.get_link_info ().is_valid ())
+				verbose_print (tr ("Link: %1.\n").arg (upload.get_link_info ().describe ()));
+		}
+		if (new_status == Transfer::Upload::Completed && pipelined)
+			print_skipped (upload.get_payload ()); // Only known at the end of the scan
 		status_changed_helper (new_status, upload.get_notifier ());
 	}
 };
 
+/* FanOut: upload one payload to several peers (-p repeated).
+ * The payload is read once for all peers (see Transfer::SharedStream).
+ * Progress is shown per peer as status lines, and the exit code is an error if any upload failed.
+ * See Browser comment in Upload for the dummy LocalDnsPeer.
+ */
+class FanOut : public QObject {
+	Q_OBJECT
+
+private:
+	const QString file_path;
+	const QStringList peer_usernames;
+	const QString local_username;
+	const bool send_hidden_files;
+	const Payload::Filter filter;
+	const int peer_timeout;
+	const Transfer::Profile profile;
+	const Transfer::Upload::ProbeMode probe_mode;
+
+	Discovery::LocalDnsPeer local_peer; // dummy
+	Discovery::Browser * browser{nullptr};
+	std::shared_ptr<Transfer::SharedStream> stream;
+	QHash<QString, Transfer::Upload *> uploads; // By peer username, until found
+	QHash<int, QPair<Transfer::Upload *, quint16>> lookups; // Lookup id -> upload, port
+	int nb_uploads{0};
+	QSet<const Transfer::Upload *> finished;
+	int nb_failed{0};
+	bool cache_mode_set{false};
+	Payload::Manager::CacheMode cache_mode{Payload::Manager::CacheAuto};
+
+public:
+	FanOut (const QString & file_path, const QStringList & peer_usernames,
+	        const QString & local_username, bool send_hidden_files, const Payload::Filter & filter,
+	        int peer_timeout, const Transfer::Profile & profile,
+	        Transfer::Upload::ProbeMode probe_mode)
+	    : file_path (file_path),
+	      peer_usernames (peer_usernames),
+	      local_username (local_username),
+	      send_hidden_files (send_hidden_files),
+	      filter (filter),
+	      peer_timeout (peer_timeout),
+	      profile (profile),
+	      probe_mode (probe_mode) {}
+
+	void set_cache_mode (Payload::Manager::CacheMode mode) {
+		cache_mode = mode;
+		cache_mode_set = true;
+	}
+
+public slots:
+	void start (void) {
+		browser = new Discovery::Browser (&local_peer);
+		connect (browser, &Discovery::Browser::added, this, &FanOut::peer_discovered);
+		connect (browser, &Discovery::Browser::being_destroyed, this, &FanOut::browser_end);
+		timing_mark ("discovery started");
+
+		stream = std::make_shared<Transfer::SharedStream> ();
+		if (cache_mode_set)
+			stream->set_cache_mode (cache_mode);
+		if (!stream->set_payload (file_path, send_hidden_files, filter)) {
+			error_print (tr ("Upload failed: %1\n").arg (stream->get_error ()));
+			return;
+		}
+		timing_mark ("payload scanned");
+		auto & payload = stream->get_payload ();
+		verbose_print (tr ("Upload payload: %1 (%2 files, total size=%3).\n")
+		                   .arg (payload.get_payload_dir_display (),
+		                         QString::number (payload.get_nb_files ()),
+		                         size_to_string (payload.get_total_size ())));
+		verbose_print (describe_links (payload));
+		print_skipped (payload);
+
+		for (auto & username : peer_usernames) {
+			if (uploads.contains (username))
+				continue; // Repeated
+			auto upload = new Transfer::Upload (username, local_username, this);
+			upload->set_peer_timeout (peer_timeout);
+			upload->set_profile (profile);
+			upload->set_probe_mode (probe_mode);
+			if (!upload->set_shared_payload (stream))
+				return;
+			connect (upload, &Transfer::Upload::failed, this, &FanOut::upload_failed);
+			connect (upload, &Transfer::Upload::status_changed, this,
+			         &FanOut::upload_status_changed);
+			connect (upload, &Transfer::Upload::queue_position_changed, [username](int position) {
+				verbose_print (tr ("Queued by \"%1\", at position %2.\n").arg (username).arg (position));
+			});
+			uploads.insert (username, upload);
+			++nb_uploads;
+		}
+		verbose_print (tr ("Waiting for usernames \"%1\"...\n").arg (peer_usernames.join ("\", \"")));
+	}
+
+private slots:
+	void browser_end (const QString & error) {
+		if (!error.isEmpty ())
+			error_print (tr ("Zeroconf browsing failed: %1\n").arg (error));
+	}
+
+	void peer_discovered (Discovery::DnsPeer * peer) {
+		auto upload = uploads.take (peer->get_username ());
+		if (upload != nullptr) {
+			verbose_print (tr ("Found peer \"%1\" (\"%2\", %3:%4).\n")
+			                   .arg (peer->get_username (), peer->get_service_name (),
+			                         peer->get_hostname (), QString::number (peer->get_port ())));
+			auto id = QHostInfo::lookupHost (peer->get_hostname (), this,
+			                                 SLOT (peer_address_found (QHostInfo)));
+			lookups.insert (id, qMakePair (upload, peer->get_port ()));
+			if (uploads.isEmpty ())
+				browser->deleteLater (); // All found
+		}
+		peer->deleteLater (); // Not needed
+	}
+	void peer_address_found (const QHostInfo & info) {
+		auto target = lookups.take (info.lookupId ());
+		auto address = Discovery::get_resolved_address (info);
+		if (address.isNull ()) {
+			normal_print (tr ("Failed to resolve address of hostname \"%1\".\n").arg (info.hostName ()));
+			upload_finished (target.first, false);
+		} else {
+			verbose_print (tr ("Connecting to %1:%2...\n")
+			                   .arg (address.toString (), QString::number (target.second)));
+			target.first->connect (address, target.second);
+		}
+	}
+
+	void upload_failed (void) {
+		auto upload = qobject_cast<Transfer::Upload *> (sender ());
+		Q_ASSERT (upload);
+		normal_print (tr ("Upload to \"%1\" failed: %2\n")
+		                  .arg (upload->get_peer_username (), upload->get_error ()));
+		upload_finished (upload, false);
+	}
+	void upload_status_changed (Transfer::Upload::Status new_status) {
+		auto upload = qobject_cast<Transfer::Upload *> (sender ());
+		Q_ASSERT (upload);
+		auto notifier = upload->get_notifier ();
+		switch (new_status) {
+		case Transfer::Upload::Transfering: {
+			verbose_print (tr ("Transfer to \"%1\" started (%2).\n")
+			                   .arg (upload->get_peer_username (), upload->get_profile_info ()));
+		} break;
+		case Transfer::Upload::Completed: {
+			normal_print (tr ("Transfer to \"%1\" complete (%2 at %3/s in %4).\n")
+			                  .arg (upload->get_peer_username (),
+			                        size_to_string (notifier->payload.get_total_size ()),
+			                        size_to_string (notifier->get_average_rate ()),
+			                        msec_to_string (notifier->get_transfer_time ())));
+			upload_finished (upload, true);
+		} break;
+		case Transfer::Upload::Rejected: {
+			normal_print (tr ("Transfer rejected by \"%1\".\n").arg (upload->get_peer_username ()));
+			upload_finished (upload, false);
+		} break;
+		default:
+			break;
+		}
+	}
+
+private:
+	void upload_finished (const Transfer::Upload * upload, bool success) {
+		if (finished.contains (upload))
+			return; // Failed after an other final status
+		finished.insert (upload);
+		if (!success)
+			++nb_failed;
+		if (finished.size () < nb_uploads)
+			return;
+		if (nb_failed > 0)
+			exit_error ();
+		else
+			exit_nicely ();
+	}
+};
+
+/* Probe: measure the link to a peer (round trip time and throughput), like a small iperf.
+ * The peer must be a localshare waiting for downloads.
+ */
+class Probe : public QObject {
+	Q_OBJECT
+
+private:
+	Discovery::LocalDnsPeer local_peer; // dummy
+	Discovery::Browser * browser{nullptr};
+	Transfer::Prober prober;
+
+	bool peer_found{false};
+	quint16 port{0};
+	QHostAddress direct_address; // Null if the peer is discovered
+
+public:
+	Probe (const QString & peer_username, int peer_timeout, const Transfer::Profile & profile)
+	    : prober (peer_username) {
+		prober.set_peer_timeout (peer_timeout);
+		prober.set_profile (profile);
+	}
+
+	void set_direct_peer (const QHostAddress & address, quint16 address_port) {
+		direct_address = address;
+		port = address_port;
+	}
+
+public slots:
+	void start (void) {
+		connect (&prober, &Transfer::Prober::failed, this, &Probe::prober_failed);
+		connect (&prober, &Transfer::Prober::status_changed, this, &Probe::prober_status_changed);
+		if (direct_address.isNull ()) {
+			browser = new Discovery::Browser (&local_peer);
+			connect (browser, &Discovery::Browser::added, this, &Probe::peer_discovered);
+			connect (browser, &Discovery::Browser::being_destroyed, this, &Probe::browser_end);
+			verbose_print (tr ("Waiting for username \"%1\"...\n").arg (prober.get_peer_username ()));
+		} else {
+			verbose_print (tr ("Connecting to %1:%2...\n")
+			                   .arg (direct_address.toString (), QString::number (port)));
+			prober.connect (direct_address, port);
+		}
+	}
+
+private slots:
+	void browser_end (const QString & error) {
+		if (!error.isEmpty ())
+			error_print (tr ("Zeroconf browsing failed: %1\n").arg (error));
+	}
+	void prober_failed (void) { error_print (tr ("Probe failed: %1\n").arg (prober.get_error ())); }
+
+	void peer_discovered (Discovery::DnsPeer * peer) {
+		if (!peer_found && peer->get_username () == prober.get_peer_username ()) {
+			peer_found = true;
+			port = peer->get_port ();
+			QHostInfo::lookupHost (peer->get_hostname (), this, SLOT (peer_address_found (QHostInfo)));
+			browser->deleteLater ();
+		} else {
+			peer->deleteLater ();
+		}
+	}
+	void peer_address_found (const QHostInfo & info) {
+		auto address = Discovery::get_resolved_address (info);
+		if (address.isNull ()) {
+			error_print (tr ("Failed to resolve address of hostname \"%1\".\n").arg (info.hostName ()));
+		} else {
+			verbose_print (
+			    tr ("Connecting to %1:%2...\n").arg (address.toString (), QString::number (port)));
+			prober.connect (address, port);
+		}
+	}
+	void prober_status_changed (Transfer::Prober::Status new_status) {
+		if (new_status == Transfer::Prober::Probing) {
+			verbose_print (tr ("Network: %1.\n").arg (prober.get_profile_info ()));
+		} else if (new_status == Transfer::Prober::Completed) {
+			auto & info = prober.get_link_info ();
+			normal_print (tr ("Round trip time: %1 ms\nThroughput: %2 Mbit/s (%3/s)\n")
+			                  .arg (double(info.rtt_usec) / 1000., 0, 'f', 2)
+			                  .arg (double(info.rate) * 8. / 1e6, 0, 'f', 1)
+			                  .arg (size_to_string (info.rate)));
+			verbose_print (tr ("Send window: %1, chunk size: %2.\n")
+			                   .arg (size_to_string (info.send_window ()),
+			                         size_to_string (info.chunk_size ())));
+			exit_nicely ();
+		}
+	}
+};
+
 /* Download is currently one shot : receive a download and quit.
  * All other downloads will be rejected:
  * - filtered downloads
@@ -212,6 +548,11 @@ private:
 	const QString target_dir;
 	const QString peer_filter;
 	const bool auto_accept;
+	const bool same_host_copy;
+	const int peer_timeout;
+	const quint16 listen_port; // 0 for any
+	bool cache_mode_set{false};
+	Payload::Manager::CacheMode cache_mode{Payload::Manager::CacheAuto};
 
 	Discovery::LocalDnsPeer local_peer;
 	Transfer::Server * server{nullptr};
@@ -220,28 +561,41 @@ private:
 
 public:
 	Download (const QString & local_username, const QString & target_dir, const QString & peer_filter,
-	          bool auto_accept)
-	    : target_dir (target_dir), peer_filter (peer_filter), auto_accept (auto_accept) {
+	          bool auto_accept, bool same_host_copy, int peer_timeout, quint16 listen_port = 0)
+	    : target_dir (target_dir),
+	      peer_filter (peer_filter),
+	      auto_accept (auto_accept),
+	      same_host_copy (same_host_copy),
+	      peer_timeout (peer_timeout),
+	      listen_port (listen_port) {
 		local_peer.set_requested_username (local_username);
 	}
 
+	void set_cache_mode (Payload::Manager::CacheMode mode) {
+		cache_mode = mode;
+		cache_mode_set = true;
+	}
+
 public slots:
 	void start (void) {
-		server = new Transfer::Server (this);
+		server = new Transfer::Server (this, listen_port);
 		connect (server, &Transfer::Server::download_ready, this, &Download::new_download);
 
 		local_peer.set_port (server->port ());
 
 		connect (&local_peer, &Discovery::LocalDnsPeer::service_name_changed, [this] {
-			if (!local_peer.get_service_name ().isEmpty ())
+			if (!local_peer.get_service_name ().isEmpty ()) {
+				timing_mark ("registered");
 				verbose_print (tr ("Registered as \"%1\" (\"%2\", port %3).\n")
 				                   .arg (local_peer.get_username (), local_peer.get_service_name (),
 				                         QString::number (local_peer.get_port ())));
+			}
 		});
 
 		service_record = new Discovery::ServiceRecord (&local_peer);
 		connect (service_record, &Discovery::ServiceRecord::being_destroyed, this,
 		         &Download::service_record_end);
+		timing_mark ("discovery started");
 	}
 
 private slots:
@@ -256,6 +610,7 @@ private slots:
 	void new_download (Transfer::Download * new_download) {
 		Q_ASSERT (new_download->get_status () == Transfer::Download::WaitingForUserChoice);
 		new_download->setParent (this);
+		timing_mark ("offer received");
 
 		if (select_download (new_download)) {
 			download = new_download;
@@ -265,6 +620,10 @@ private slots:
 			         &Download::download_status_changed);
 			new ProgressIndicator (download->get_notifier ());
 			download->set_target_dir (target_dir);
+			download->set_same_host_copy (same_host_copy);
+			download->set_peer_timeout (peer_timeout);
+			if (cache_mode_set)
+				download->set_cache_mode (cache_mode);
 
 			// Prompt user
 			if (auto_accept || prompt_user ()) {
@@ -318,6 +677,9 @@ private:
 		                        payload.get_payload_dir_display (),
 		                        QString::number (payload.get_nb_files ()),
 		                        size_to_string (payload.get_total_size ())));
+		normal_print (describe_links (payload));
+		if (!payload.is_manifest_complete ())
+			normal_print (tr ("The peer is still listing files, more may follow.\n"));
 		normal_print (tr ("Accept ? y(es)/n(o)/i(nspect files) "));
 		QString line = QTextStream (stdin).readLine ().trimmed ().toLower ();
 		if (line.startsWith ('i')) {
@@ -328,6 +690,171 @@ private:
 		return line.startsWith ('y');
 	}
 };
+/* Seed: serve a payload to pullers until interrupted.
+ * Registered like a download server, so pullers find it by username.
+ */
+class Seed : public QObject {
+	Q_OBJECT
+
+private:
+	const QString file_path;
+	const bool send_hidden_files;
+	const Payload::Filter filter;
+	const Transfer::Profile profile;
+
+	Discovery::LocalDnsPeer local_peer;
+	Transfer::SeedServer * server{nullptr};
+	Discovery::ServiceRecord * service_record{nullptr};
+
+public:
+	Seed (const QString & file_path, const QString & local_username, bool send_hidden_files,
+	      const Payload::Filter & filter, const Transfer::Profile & profile)
+	    : file_path (file_path),
+	      send_hidden_files (send_hidden_files),
+	      filter (filter),
+	      profile (profile) {
+		local_peer.set_requested_username (local_username);
+	}
+
+public slots:
+	void start (void) {
+		server = new Transfer::SeedServer (local_peer.get_requested_username (), this);
+		connect (server, &Transfer::SeedServer::failed,
+		         [](const QString & error) { error_print (tr ("Seed failed: %1\n").arg (error)); });
+		connect (server, &Transfer::SeedServer::ready, this, &Seed::server_ready);
+		connect (server, &Transfer::SeedServer::seed_status_changed, this, &Seed::seed_changed);
+		server->set_profile (profile);
+		verbose_print (tr ("Hashing payload...\n"));
+		server->set_payload (file_path, send_hidden_files, filter);
+	}
+
+private slots:
+	void server_ready (void) {
+		auto & payload = server->get_payload ();
+		timing_mark ("payload hashed");
+		verbose_print (tr ("Seeding payload: %1 (%2 files, total size=%3).\n")
+		                   .arg (payload.get_payload_dir_display (),
+		                         QString::number (payload.get_nb_files ()),
+		                         size_to_string (payload.get_total_size ())));
+		verbose_print (describe_links (payload));
+		print_skipped (payload);
+
+		local_peer.set_port (server->port ());
+		connect (&local_peer, &Discovery::LocalDnsPeer::service_name_changed, [this] {
+			if (!local_peer.get_service_name ().isEmpty ()) {
+				timing_mark ("registered");
+				normal_print (tr ("Seeding as \"%1\" (\"%2\", port %3).\n")
+				                  .arg (local_peer.get_username (), local_peer.get_service_name (),
+				                        QString::number (local_peer.get_port ())));
+			}
+		});
+		service_record = new Discovery::ServiceRecord (&local_peer);
+		connect (service_record, &Discovery::ServiceRecord::being_destroyed, this,
+		         &Seed::service_record_end);
+	}
+	void service_record_end (const QString & error) {
+		if (!error.isEmpty ())
+			error_print (tr ("Zeroconf registration failed: %1\n").arg (error));
+	}
+	void seed_changed (Transfer::Seed::Status new_status, const QString & peer) {
+		if (new_status == Transfer::Seed::Serving)
+			verbose_print (tr ("Serving %1.\n").arg (peer));
+		else if (new_status == Transfer::Seed::Completed)
+			verbose_print (tr ("Done serving %1.\n").arg (peer));
+	}
+};
+
+/* Pull: download one payload from all seeds with the given usernames.
+ * Seeds are added as they are discovered.
+ * See Browser comment in Upload for the dummy LocalDnsPeer.
+ */
+class Pull : public QObject {
+	Q_OBJECT
+
+private:
+	const QStringList peer_usernames;
+
+	Discovery::LocalDnsPeer local_peer; // dummy
+	Discovery::Browser * browser{nullptr};
+	Transfer::Pull pull;
+
+	QHash<int, QPair<QString, quint16>> lookups; // Lookup id -> peer username, port
+	bool progress_shown{false};
+
+public:
+	Pull (const QString & target_dir, const QStringList & peer_usernames, int peer_timeout)
+	    : peer_usernames (peer_usernames), pull (target_dir) {
+		pull.set_peer_timeout (peer_timeout);
+	}
+
+public slots:
+	void start (void) {
+		connect (&pull, &Transfer::Pull::failed, this, &Pull::pull_failed);
+		connect (&pull, &Transfer::Pull::status_changed, this, &Pull::pull_status_changed);
+
+		browser = new Discovery::Browser (&local_peer);
+		connect (browser, &Discovery::Browser::added, this, &Pull::peer_discovered);
+		connect (browser, &Discovery::Browser::being_destroyed, this, &Pull::browser_end);
+		timing_mark ("discovery started");
+		verbose_print (tr ("Waiting for seeds \"%1\"...\n").arg (peer_usernames.join ("\", \"")));
+	}
+
+private slots:
+	void browser_end (const QString & error) {
+		if (!error.isEmpty ())
+			error_print (tr ("Zeroconf browsing failed: %1\n").arg (error));
+	}
+	void pull_failed (void) { error_print (tr ("Pull failed: %1\n").arg (pull.get_error ())); }
+
+	void peer_discovered (Discovery::DnsPeer * peer) {
+		if (peer_usernames.contains (peer->get_username ())) {
+			verbose_print (tr ("Found seed \"%1\" (\"%2\", %3:%4).\n")
+			                   .arg (peer->get_username (), peer->get_service_name (),
+			                         peer->get_hostname (), QString::number (peer->get_port ())));
+			auto id = QHostInfo::lookupHost (peer->get_hostname (), this,
+			                                 SLOT (peer_address_found (QHostInfo)));
+			lookups.insert (id, qMakePair (peer->get_username (), peer->get_port ()));
+		}
+		peer->deleteLater (); // Not needed
+	}
+	void peer_address_found (const QHostInfo & info) {
+		auto peer = lookups.take (info.lookupId ());
+		auto address = Discovery::get_resolved_address (info);
+		if (address.isNull ()) {
+			qWarning ("Failed to resolve address of hostname \"%s\"", qUtf8Printable (info.hostName ()));
+		} else {
+			verbose_print (tr ("Pulling from %1:%2...\n")
+			                   .arg (address.toString (), QString::number (peer.second)));
+			pull.add_source (peer.first, address, peer.second);
+		}
+	}
+	void pull_status_changed (Transfer::Pull::Status new_status) {
+		switch (new_status) {
+		case Transfer::Pull::Transfering: {
+			if (!progress_shown) {
+				// Also entered again when files are retried
+				progress_shown = true;
+				auto & payload = pull.get_payload ();
+				verbose_print (tr ("Pull payload: %1 (%2 files, total size=%3).\n")
+				                   .arg (payload.get_payload_dir_display (),
+				                         QString::number (payload.get_nb_files ()),
+				                         size_to_string (payload.get_total_size ())));
+				verbose_print (describe_links (payload));
+				new ProgressIndicator (pull.get_notifier ());
+			}
+		} break;
+		case Transfer::Pull::Verifying: {
+			verbose_print (tr ("Verifying checksums...\n"));
+		} break;
+		case Transfer::Pull::Completed: {
+			browser->deleteLater ();
+			status_changed_helper (new_status, pull.get_notifier ());
+		} break;
+		default:
+			break;
+		}
+	}
+};
 }
 
-#endif
+#endif
\ No newline at end of file
@@ -30,6 +30,8 @@
 
 #include "compatibility.h"
 #include "core_localshare.h"
+#include "core_trace.h"
+#include "core_watchdog.h"
 
 namespace Discovery {
 /* Service name vs Username.
@@ -115,17 +117,12 @@ signals:
 	void service_name_changed (void);
 
 public:
-	LocalDnsPeer (QObject * parent = nullptr) : QObject (parent) {
-		// Suffix is hostname, or a random number stringified if not available
-		suffix = QHostInfo::localHostName ();
-		if (suffix.isEmpty ()) {
-			qsrand (QTime::currentTime ().msec ());
-			suffix.setNum (qrand ());
-		}
-	}
+	LocalDnsPeer (QObject * parent = nullptr) : QObject (parent) {}
 
 	QString get_requested_username (void) { return requested_username; }
-	QString get_requested_service_name (void) { return service_name_of (requested_username, suffix); }
+	QString get_requested_service_name (void) {
+		return service_name_of (requested_username, get_suffix ());
+	}
 	void set_requested_username (const QString & new_username) {
 		if (requested_username != new_username) {
 			requested_username = new_username;
@@ -152,6 +149,20 @@ public:
 		}
 	}
 	quint16 get_port (void) const { return port; }
+
+private:
+	const QString & get_suffix (void) {
+		// Suffix is hostname, or a random number stringified if not available.
+		// Computed on first use: the hostname lookup is slow, and unused in upload mode.
+		if (suffix.isEmpty ()) {
+			suffix = QHostInfo::localHostName ();
+			if (suffix.isEmpty ()) {
+				qsrand (QTime::currentTime ().msec ());
+				suffix.setNum (qrand ());
+			}
+		}
+		return suffix;
+	}
 };
 
 /* Helper class to manage a DNSServiceRef.
@@ -267,6 +278,7 @@ protected:
 
 private slots:
 	void has_pending_data (void) {
+		Watchdog::Scope watch (Watchdog::Discovery);
 		auto err = DNSServiceProcessResult (ref);
 		if (has_error (err))
 			failure (err);
@@ -357,6 +369,7 @@ private:
 	                                         uint16_t port, uint16_t /* txt len */,
 	                                         const unsigned char * /* txt record */, void * context) {
 		auto c = static_cast<Resolver *> (context);
+		LOCALSHARE_TRACE (resolver_done, qFromBigEndian (port), error_code);
 		if (has_error (error_code)) {
 			c->failure (error_code);
 			return;
@@ -411,6 +424,8 @@ private:
 	                                        const char * service_name, const char * regtype,
 	                                        const char * domain, void * context) {
 		auto c = static_cast<Browser *> (context);
+		LOCALSHARE_TRACE (browser_event, (flags & kDNSServiceFlagsAdd) != 0,
+		                  (flags & kDNSServiceFlagsMoreComing) != 0);
 		if (has_error (error_code)) {
 			c->failure (error_code);
 			return;
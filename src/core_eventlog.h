@@ -0,0 +1,250 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_EVENTLOG_H
+#define CORE_EVENTLOG_H
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QString>
+#include <atomic>
+
+#include "core_localshare.h"
+#include "portability.h"
+
+/* Structured event log, always on.
+ *
+ * Events are fixed size binary records (time, transfer id, type, two integers), appended to a
+ * ring owned by the recording thread: no lock, no allocation, no formatting.
+ * The last Const::event_log_ring_size events of each thread are kept.
+ * Rings are written to a file on crash (Unix, from the signal handler) or on request (dump),
+ * and formatted later by format (), which the tools/eventlog decoder uses.
+ *
+ * A ring has a single writer. A dump from another thread while it records may copy the record
+ * being written in a torn state, which is acceptable for a diagnostic.
+ * The file uses the native byte order and layout: it is decoded on the same kind of machine.
+ */
+namespace EventLog {
+
+// Meaning of a and b in comments. Append new types at the end (values are in dumped files).
+enum Type : quint16 {
+	UploadStatus,     // new status, old status (Transfer::Upload::Status)
+	DownloadStatus,   // new status, old status (Transfer::Download::Status)
+	TransferFailed,   // failure mode (Transfer::Base::FailureMode)
+	ProtocolError,    // frame code, frame size (of the frame being dispatched)
+	ChunkSent,        // bytes, file index
+	ChunksReceived,   // bytes, file index
+	FileOpened,       // file index, size
+	FileClosed,       // file index, position
+	ChecksumChecked,  // file index, match
+	LoopStall,        // watchdog probe (Watchdog::Probe), duration in usec
+	NbTypes
+};
+struct TypeInfo {
+	const char * name;
+	const char * a;
+	const char * b;
+};
+inline TypeInfo type_info (quint16 type) {
+	static const TypeInfo infos[NbTypes] = {
+	    {"upload_status", "status", "old"},    {"download_status", "status", "old"},
+	    {"transfer_failed", "mode", nullptr},  {"protocol_error", "code", "size"},
+	    {"chunk_sent", "bytes", "file"},       {"chunks_received", "bytes", "file"},
+	    {"file_opened", "file", "size"},       {"file_closed", "file", "position"},
+	    {"checksum_checked", "file", "match"}, {"loop_stall", "probe", "usec"}};
+	if (type < NbTypes)
+		return infos[type];
+	return {"unknown", "a", "b"};
+}
+
+struct Record {
+	qint64 time_nsec; // Since the log start
+	quint32 transfer; // Transfer::Base::get_transfer_id (), 0 if none
+	quint16 type;
+	quint16 thread; // Index of the ring
+	qint64 a;
+	qint64 b;
+};
+static_assert (sizeof (Record) == 32, "Record layout is part of the file format");
+
+// File format: FileHeader, then for each ring a RingHeader followed by its records (oldest first)
+struct FileHeader {
+	char magic[8];
+	quint32 version;
+	quint32 record_size;
+	qint64 start_msecs; // Wall clock time of the log start, in msecs since epoch
+	quint32 nb_rings;
+	quint32 reserved;
+};
+struct RingHeader {
+	quint32 thread;
+	quint32 nb_records;
+};
+constexpr char file_magic[8] = {'L', 'S', 'E', 'V', 'L', 'O', 'G', '\0'};
+constexpr quint32 file_version = 1;
+
+class Ring {
+public:
+	Record records[Const::event_log_ring_size];
+	std::atomic<quint64> nb_written{0}; // Published with release, after the record
+	const quint16 thread;
+	Ring * next{nullptr}; // Rings are never freed, and form a list for dumps
+
+	explicit Ring (quint16 thread) : thread (thread) {}
+
+	void append (const Record & record) {
+		auto n = nb_written.load (std::memory_order_relaxed);
+		records[n % Const::event_log_ring_size] = record;
+		nb_written.store (n + 1, std::memory_order_release);
+	}
+};
+
+class Log {
+private:
+	std::atomic<Ring *> rings{nullptr};
+	std::atomic<int> nb_rings{0};
+	QElapsedTimer clock;
+	qint64 start_msecs;
+	char crash_path[4096]{}; // Encoded before, as the crash handler cannot allocate
+
+public:
+	static Log & instance (void) {
+		static Log log;
+		return log;
+	}
+
+	void record (Type type, quint32 transfer, qint64 a, qint64 b) {
+		auto & ring = local_ring ();
+		ring.append (Record{clock.nsecsElapsed (), transfer, type, ring.thread, a, b});
+	}
+
+	/* Writes the rings with write (const char * data, qint64 size) -> bool.
+	 * Only reads memory that exists already: callable from a crash handler.
+	 */
+	template <typename Sink> bool dump (Sink write) const {
+		FileHeader header;
+		for (int i = 0; i < 8; ++i)
+			header.magic[i] = file_magic[i];
+		header.version = file_version;
+		header.record_size = sizeof (Record);
+		header.start_msecs = start_msecs;
+		header.nb_rings = 0;
+		header.reserved = 0;
+		for (auto ring = rings.load (); ring != nullptr; ring = ring->next)
+			++header.nb_rings;
+		if (!write (reinterpret_cast<const char *> (&header), sizeof (header)))
+			return false;
+
+		const quint64 size = Const::event_log_ring_size;
+		// Rings created since are ignored, as their number is in the header
+		auto nb_rings_left = header.nb_rings;
+		for (auto ring = rings.load (); ring != nullptr && nb_rings_left > 0; ring = ring->next) {
+			--nb_rings_left;
+			auto end = ring->nb_written.load (std::memory_order_acquire);
+			auto count = qMin (end, size);
+			RingHeader ring_header{ring->thread, quint32 (count)};
+			if (!write (reinterpret_cast<const char *> (&ring_header), sizeof (ring_header)))
+				return false;
+			// Oldest records are at end % size if the ring has wrapped
+			auto first = (end - count) % size;
+			auto first_part = qMin (count, size - first);
+			auto data = reinterpret_cast<const char *> (ring->records);
+			if (!write (data + first * sizeof (Record), qint64 (first_part * sizeof (Record))) ||
+			    !write (data, qint64 ((count - first_part) * sizeof (Record))))
+				return false;
+		}
+		return true;
+	}
+	bool dump_to (const QString & path) const {
+		QDir ().mkpath (QFileInfo (path).path ());
+		QFile file (path);
+		if (!file.open (QIODevice::WriteOnly | QIODevice::Truncate))
+			return false;
+		return dump ([&file](const char * data, qint64 size) {
+			return file.write (data, size) == size;
+		});
+	}
+
+	// Dump the log to path on crash
+	void dump_on_crash (const QString & path) {
+		auto encoded = QFile::encodeName (path);
+		if (encoded.size () >= int(sizeof (crash_path)))
+			return;
+		qstrcpy (crash_path, encoded.constData ());
+		set_crash_handler ([] {
+			auto & log = Log::instance ();
+			raw_make_parent_dirs (log.crash_path);
+			auto fd = raw_create_file (log.crash_path);
+			if (fd < 0)
+				return;
+			log.dump ([fd](const char * data, qint64 size) { return raw_write (fd, data, size); });
+			raw_close (fd);
+		});
+	}
+
+private:
+	Log () : start_msecs (QDateTime::currentMSecsSinceEpoch ()) { clock.start (); }
+
+	Ring & local_ring (void) {
+		thread_local Ring * ring = new_ring ();
+		return *ring;
+	}
+	Ring * new_ring (void) {
+		auto ring = new Ring (quint16 (nb_rings.fetch_add (1)));
+		auto head = rings.load ();
+		do
+			ring->next = head;
+		while (!rings.compare_exchange_weak (head, ring));
+		return ring;
+	}
+};
+
+inline void record (Type type, quint32 transfer, qint64 a = 0, qint64 b = 0) {
+	Log::instance ().record (type, transfer, a, b);
+}
+
+// Default dump location, in the cache directory (created by the dump, not at startup)
+inline QString default_path (void) {
+	return QStandardPaths::writableLocation (QStandardPaths::CacheLocation) +
+	       QStringLiteral ("/events.bin");
+}
+
+// One line of text for a record (start_msecs from the FileHeader)
+inline QString format (const Record & r, qint64 start_msecs) {
+	auto info = type_info (r.type);
+	auto usec = start_msecs * 1000 + r.time_nsec / 1000;
+	auto time = QDateTime::fromMSecsSinceEpoch (usec / 1000);
+	auto text = QStringLiteral ("%1.%2 thread=%3 transfer=%4 %5")
+	                .arg (time.toString (QStringLiteral ("yyyy-MM-dd hh:mm:ss")))
+	                .arg (usec % 1000000, 6, 10, QChar ('0'))
+	                .arg (r.thread)
+	                .arg (r.transfer)
+	                .arg (info.name);
+	if (info.a != nullptr)
+		text += QStringLiteral (" %1=%2").arg (info.a).arg (r.a);
+	if (info.b != nullptr)
+		text += QStringLiteral (" %1=%2").arg (info.b).arg (r.b);
+	return text;
+}
+}
+
+#endif
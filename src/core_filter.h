@@ -0,0 +1,259 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_FILTER_H
+#define CORE_FILTER_H
+
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <QStringList>
+#include <QTextStream>
+#include <memory>
+#include <vector>
+
+#include "core_localshare.h"
+
+namespace Payload {
+
+/* Include/exclude rules for directory payloads, with gitignore syntax:
+ * - blank lines and lines starting with '#' are ignored,
+ * - '!' negates the pattern (include what was excluded by a previous rule),
+ * - a trailing '/' only matches directories,
+ * - a pattern without '/' (except trailing) matches names at any depth,
+ * - other patterns are relative to the directory of their rule file (or the payload root),
+ * - '*' and '?' do not match '/', '**' matches any number of directories.
+ * The last matching rule wins. Global rules (settings, command line) are tested last.
+ */
+class Filter {
+private:
+	struct Rule {
+		QString base; // Directory of the rule file, relative to the payload root ("" for root)
+		QRegularExpression regex;
+		bool include;
+		bool dir_only;
+		bool match_name; // Only match the file name
+	};
+
+	std::vector<Rule> file_rules;   // From ignore files of directories being scanned
+	std::vector<Rule> global_rules; // Settings and command line
+
+public:
+	void add_pattern (const QString & pattern) { parse_pattern (global_rules, pattern, QString ()); }
+	void add_patterns (const QStringList & patterns) {
+		for (auto & p : patterns)
+			add_pattern (p);
+	}
+	void add_exclude (const QString & pattern) { add_pattern (pattern); }
+	void add_include (const QString & pattern) { add_pattern ('!' + pattern); }
+	bool is_empty (void) const { return file_rules.empty () && global_rules.empty (); }
+
+	// Rule files: scoped to their directory, removed when leaving it
+	std::size_t nb_file_rules (void) const { return file_rules.size (); }
+	void remove_file_rules_after (std::size_t n) { file_rules.resize (n); }
+	void load_rule_file (const QDir & dir, const QString & relative_dir) {
+		QFile file (dir.filePath (Const::ignore_file_name));
+		if (!file.open (QIODevice::ReadOnly | QIODevice::Text))
+			return; // Missing or unreadable: no rules
+		QTextStream stream (&file);
+		while (!stream.atEnd ())
+			parse_pattern (file_rules, stream.readLine (), relative_dir);
+	}
+
+	bool is_excluded (const QString & relative_path, bool is_dir) const {
+		bool excluded = false;
+		auto test = [&](const Rule & rule) {
+			if (rule.dir_only && !is_dir)
+				return;
+			QString path = relative_path;
+			if (!rule.base.isEmpty ()) {
+				if (!path.startsWith (rule.base + '/'))
+					return;
+				path = path.mid (rule.base.size () + 1);
+			}
+			if (rule.match_name)
+				path = path.mid (path.lastIndexOf ('/') + 1);
+			if (rule.regex.match (path).hasMatch ())
+				excluded = !rule.include;
+		};
+		for (auto & rule : file_rules)
+			test (rule);
+		for (auto & rule : global_rules)
+			test (rule);
+		return excluded;
+	}
+
+private:
+	static void parse_pattern (std::vector<Rule> & rules, QString pattern, const QString & base) {
+		// Trailing spaces are ignored (unless escaped, which is rare enough to not care)
+		while (pattern.endsWith (' '))
+			pattern.chop (1);
+		if (pattern.isEmpty () || pattern.startsWith ('#'))
+			return;
+		Rule rule;
+		rule.base = base;
+		rule.include = pattern.startsWith ('!');
+		if (rule.include)
+			pattern.remove (0, 1);
+		rule.dir_only = pattern.endsWith ('/');
+		if (rule.dir_only)
+			pattern.chop (1);
+		rule.match_name = !pattern.contains ('/');
+		if (pattern.startsWith ('/'))
+			pattern.remove (0, 1);
+		if (pattern.isEmpty ())
+			return;
+		rule.regex.setPattern ('^' + glob_to_regex (pattern) + '$');
+		if (!rule.regex.isValid ())
+			return; // Malformed bracket expression
+		rule.regex.optimize ();
+		rules.push_back (rule);
+	}
+
+	static QString glob_to_regex (const QString & glob) {
+		QString regex;
+		for (int i = 0; i < glob.size (); ++i) {
+			auto c = glob[i];
+			if (c == '*') {
+				if (i + 1 < glob.size () && glob[i + 1] == '*') {
+					// "**/" is zero or more directories, other "**" is anything
+					++i;
+					if (i + 1 < glob.size () && glob[i + 1] == '/') {
+						++i;
+						regex += QStringLiteral ("(?:.*/)?");
+					} else {
+						regex += QStringLiteral (".*");
+					}
+				} else {
+					regex += QStringLiteral ("[^/]*");
+				}
+			} else if (c == '?') {
+				regex += QStringLiteral ("[^/]");
+			} else if (c == '[') {
+				auto end = glob.indexOf (']', i + 2);
+				if (end == -1) {
+					regex += QStringLiteral ("\\[");
+				} else {
+					auto set = glob.mid (i + 1, end - i - 1);
+					if (set.startsWith ('!'))
+						set[0] = '^';
+					regex += '[' + set.replace ('\\', QStringLiteral ("\\\\")) + ']';
+					i = end;
+				}
+			} else if (c == '\\' && i + 1 < glob.size ()) {
+				++i;
+				regex += QRegularExpression::escape (glob.mid (i, 1));
+			} else {
+				regex += QRegularExpression::escape (QString (c));
+			}
+		}
+		return regex;
+	}
+};
+
+// Entries left out of a payload by a Filter
+struct Skipped {
+	int nb_files{0};
+	int nb_dirs{0}; // Content of skipped directories is not counted
+	qint64 size{0}; // Of skipped files only
+};
+
+/* Recursive directory traversal for payloads.
+ * Unlike QDirIterator::Subdirectories, excluded directories are never read.
+ * Returns readable files, without following symlinks (like the previous QDirIterator scan).
+ * Ignore files (Const::ignore_file_name) add rules for the subtree of their directory.
+ */
+class Scanner {
+private:
+	struct Level {
+		QString relative_dir;
+		std::unique_ptr<QDirIterator> entries;
+		std::size_t nb_file_rules; // Before loading the rule file of this directory
+	};
+
+	const QDir payload_dir;
+	const QDir::Filters entry_filter;
+	Filter filter;
+	Skipped & skipped;
+	std::vector<Level> levels;
+	QFileInfo found;
+	bool has_found{false};
+
+public:
+	Scanner (const QString & dir_path, bool ignore_hidden, const Filter & filter, Skipped & skipped)
+	    : payload_dir (dir_path),
+	      entry_filter (make_entry_filter (ignore_hidden)),
+	      filter (filter),
+	      skipped (skipped) {
+		enter (payload_dir.path (), QString ());
+	}
+
+	bool hasNext (void) {
+		// Named like QDirIterator
+		while (!has_found && !levels.empty ()) {
+			auto & level = levels.back ();
+			if (!level.entries->hasNext ()) {
+				filter.remove_file_rules_after (level.nb_file_rules);
+				levels.pop_back ();
+				continue;
+			}
+			QFileInfo entry (level.entries->next ());
+			auto relative_path = level.relative_dir.isEmpty ()
+			                         ? entry.fileName ()
+			                         : level.relative_dir + '/' + entry.fileName ();
+			if (entry.isDir ()) {
+				if (filter.is_excluded (relative_path, true))
+					++skipped.nb_dirs;
+				else
+					enter (entry.filePath (), relative_path); // Invalidates level
+			} else if (filter.is_excluded (relative_path, false)) {
+				++skipped.nb_files;
+				skipped.size += entry.size ();
+			} else {
+				found = entry;
+				has_found = true;
+			}
+		}
+		return has_found;
+	}
+	QFileInfo next (void) {
+		Q_ASSERT (has_found);
+		has_found = false;
+		return found;
+	}
+
+private:
+	static QDir::Filters make_entry_filter (bool ignore_hidden) {
+		auto filter_flags = QDir::Files | QDir::Dirs | QDir::NoSymLinks | QDir::NoDotAndDotDot |
+		                    QDir::Readable;
+		if (!ignore_hidden)
+			filter_flags |= QDir::Hidden;
+		return filter_flags;
+	}
+	void enter (const QString & path, const QString & relative_dir) {
+		auto nb_rules = filter.nb_file_rules ();
+		filter.load_rule_file (QDir (path), relative_dir);
+		levels.push_back (
+		    Level{relative_dir, std::unique_ptr<QDirIterator> (new QDirIterator (path, entry_filter)),
+		          nb_rules});
+	}
+};
+}
+
+#endif
@@ -47,22 +47,93 @@ constexpr auto app_version = STR (LOCALSHARE_VERSION);
 // Network service name
 constexpr auto service_type = "_localshare._tcp.";
 
+// Per directory exclude rules of uploaded directories (gitignore syntax)
+constexpr auto ignore_file_name = ".localshareignore";
+
 // Protocol
 constexpr quint16 protocol_magic = 0x0CAA;
 constexpr auto serializer_version = QDataStream::Qt_5_0; // We are only compatible with Qt5 anyway
 constexpr auto hash_algorithm = QCryptographicHash::Md5;
-constexpr quint16 protocol_version = 0x2;
+constexpr auto hash_size = 16; // bytes in a digest of hash_algorithm
+constexpr quint16 protocol_version = 0x9;
+constexpr quint16 min_protocol_version = 0x9; // Older peers cannot negotiate capabilities
+constexpr auto max_frame_size = qint64 (16 * 1024 * 1024); // largest data frame we accept
 
 // Performance parameters
-constexpr auto chunk_size = qint64 (10000);
-constexpr auto write_buffer_size = qint64 (100000);
+constexpr auto chunk_size = qint64 (10000);         // minimum, larger on fast links
+constexpr auto write_buffer_size = qint64 (100000); // minimum, larger on fast or long links
 constexpr auto max_work_msec = qint64 (100); // maximum time spent out of the event loop
+constexpr auto frames_per_batch = 64;         // frames parsed between checks of the work timer
+constexpr auto stall_warning_msec = qint64 (150); // longer event loop stalls are logged
+constexpr auto watchdog_tick_msec = 50;            // period of the dispatch latency probe
+constexpr auto local_copy_step = qint64 (64 * 1024 * 1024); // same host copy, between timer checks
+constexpr auto local_copy_buffer_size = qint64 (1024 * 1024);
+constexpr auto multi_hash_max_file_size = qint64 (1024 * 1024); // hashed several at once
+constexpr auto multi_hash_batch_size = qint64 (16 * 1024 * 1024); // read before hashing
+constexpr auto max_file_retries = 3; // resends of a file with a bad checksum
+constexpr auto checksums_per_frame = 4096; // digests grouped in one Checksums message
+constexpr auto inline_max_file_size = qint64 (4096); // smaller files are sent in batches
+constexpr auto inline_batch_size = qint64 (256 * 1024);   // max data in one batch
+constexpr auto inline_batch_max_files = 1024;
+
+// Multi-source pull
+constexpr auto pull_block_size = qint64 (1024 * 1024); // unit of scheduling between sources
+constexpr auto pull_range_piece_size = qint64 (256 * 1024); // max data in one Range frame
+constexpr auto pull_pipeline_msec = 250;    // requests in flight per source, in time at its rate
+constexpr auto pull_min_window_blocks = 2;
+constexpr auto pull_max_window_blocks = 64;
+constexpr auto pull_max_sources = 4;        // others are kept to replace failing ones
+constexpr auto pull_check_interval_msec = 1000;
+constexpr auto pull_stall_msec = 5000;      // source with requests but no data is dropped
+constexpr auto pull_slow_factor = 8;        // source slower than the best by this is replaced
+constexpr auto max_open_range_files = 32;   // mapped files kept open by random access
+
+// Dead peer detection (peer timeout is in settings)
+constexpr auto heartbeat_interval_msec = 2000; // also the period of timeout checks
+constexpr auto keepalive_idle_sec = 5;
+constexpr auto keepalive_interval_sec = 2;
+constexpr auto keepalive_count = 3;
+
+// Link probe (see Transfer::Base::start_probe) and tuning from its results
+constexpr auto probe_nb_pings = 4;                   // round trip time is the smallest
+constexpr auto probe_burst_msec = qint64 (200);      // duration of the throughput burst
+constexpr auto probe_max_burst_size = qint64 (64 * 1024 * 1024);
+constexpr auto probe_frame_size = qint64 (64 * 1024);
+constexpr auto probe_burst_buffer = qint64 (1024 * 1024); // in the socket buffer during a burst
+constexpr auto link_info_max_age_msec = qint64 (3600 * 1000); // older measurements are redone
+constexpr auto max_chunk_size = qint64 (1024 * 1024);
+constexpr auto max_send_window = qint64 (32 * 1024 * 1024);
+
+// Fan-out uploads (one payload read once for several peers, see Transfer::SharedStream)
+constexpr auto fanout_chunk_size = qint64 (256 * 1024);
+constexpr auto fanout_lag_window = qint64 (64 * 1024 * 1024); // buffered between first and last
+constexpr auto fanout_stall_msec = 5000;      // slowest peer is detached if blocking this long
+constexpr auto fanout_join_wait_msec = 30000; // peers accepting later send on their own
+
+// Receive scheduler (accepted downloads writing at once to a file system, see ReceiveScheduler)
+constexpr auto receive_initial_writers = 2;
+constexpr auto receive_max_writers = 8;
+constexpr auto receive_scheduler_interval_msec = 1000; // period of throughput measurements
+constexpr auto receive_scaling_gain = 0.1; // throughput increase needed to keep one more writer
+constexpr auto receive_hold_periods = 10;  // no raise of the limit after a useless one
+
+// Page cache release of streamed files (see Payload::Manager::CacheMode)
+constexpr auto cache_release_window = qint64 (8 * 1024 * 1024); // released at once, behind data
+
+// Sender pacing (userspace fallback when the kernel does not pace)
+constexpr auto pacing_burst_msec = qint64 (10); // data sent at once, in time at the pacing rate
+constexpr auto pacing_min_burst = qint64 (64 * 1024);
+constexpr auto background_dscp = 8; // CS1, traffic class below best effort
+
+// Event log (see core_eventlog.h)
+constexpr auto event_log_ring_size = 4096; // events kept per thread, 32 bytes each
 
 // Transfer notifier parameters
 constexpr auto rate_update_interval_msec = qint64 (1000 / 3); // should be bigger than progress
 constexpr auto progress_history_window_msec = 1000;
 constexpr auto progress_history_window_elem = 20;
 constexpr auto progress_update_interval_msec = qint64 (1000 / 10); // 10 fps max
+constexpr auto ack_interval_msec = progress_update_interval_msec; // receiver progress reports
 
 // Setup app object (graphical and console version)
 inline void setup (QCoreApplication & app) {
@@ -0,0 +1,383 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_MD5_H
+#define CORE_MD5_H
+
+#include <QtGlobal>
+#include <cstring>
+
+/* Multi-buffer MD5: hashes independent messages at the same time, one per SIMD lane.
+ * A MD5 stream has no parallelism, so hashing small files one by one leaves SIMD units idle.
+ * Here each lane processes a block of a different message in the same instructions.
+ * A lane takes the next message as soon as its own is done, so sizes can differ.
+ *
+ * The kernel is written once on vectors of lanes (gcc and clang vector extensions).
+ * On x86 it is compiled for AVX-512 (16 lanes) and AVX2 (8 lanes), selected at runtime.
+ * The fallback uses 4 lanes: SSE2 on x86-64, NEON on arm64, scalar with other compilers.
+ * Digests are the same as QCryptographicHash::Md5.
+ *
+ * Streams (files hashed as they are sent or received) use Md5::Stream, a scalar MD5.
+ * Unlike QCryptographicHash, it writes digests to a given buffer, without allocation.
+ */
+namespace Md5 {
+constexpr int digest_size = 16;
+constexpr int max_lanes = 16;
+
+namespace Detail {
+constexpr int block_size = 64;
+
+// Per step: message word, left rotation, additive constant (RFC 1321)
+constexpr int word_index[64] = {
+    0, 1, 2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15, //
+    1, 6, 11, 0,  5,  10, 15, 4,  9,  14, 3,  8,  13, 2,  7,  12, //
+    5, 8, 11, 14, 1,  4,  7,  10, 13, 0,  3,  6,  9,  12, 15, 2,  //
+    0, 7, 14, 5,  12, 3,  10, 1,  8,  15, 6,  13, 4,  11, 2,  9};
+constexpr int rotation[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, //
+    5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, //
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, //
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+constexpr quint32 constant[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613,
+    0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193,
+    0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d,
+    0x02441453, 0xd8a1e681, 0xe7d3fbc8, 0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122,
+    0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665, 0xf4292244,
+    0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb,
+    0xeb86d391};
+constexpr quint32 initial_state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+// State of all lanes: words a, b, c, d
+struct State {
+	quint32 words[4][max_lanes];
+};
+
+inline quint32 load_le32 (const unsigned char * p) {
+	return quint32 (p[0]) | quint32 (p[1]) << 8 | quint32 (p[2]) << 16 | quint32 (p[3]) << 24;
+}
+
+#if defined(__GNUC__)
+#define LOCALSHARE_MD5_ALWAYS_INLINE __attribute__ ((always_inline)) inline
+typedef quint32 Vec4 __attribute__ ((vector_size (16)));
+typedef quint32 Vec8 __attribute__ ((vector_size (32)));
+typedef quint32 Vec16 __attribute__ ((vector_size (64)));
+#else
+#define LOCALSHARE_MD5_ALWAYS_INLINE inline
+// Minimal vector of 4 lanes for other compilers (scalar loops)
+struct Vec4 {
+	quint32 v[4];
+	quint32 & operator[] (int i) { return v[i]; }
+	quint32 operator[] (int i) const { return v[i]; }
+};
+template <typename F> inline Vec4 lanewise (const Vec4 & x, const Vec4 & y, F f) {
+	Vec4 r;
+	for (int i = 0; i < 4; ++i)
+		r.v[i] = f (x.v[i], y.v[i]);
+	return r;
+}
+inline Vec4 operator+ (const Vec4 & x, const Vec4 & y) {
+	return lanewise (x, y, [](quint32 a, quint32 b) { return a + b; });
+}
+inline Vec4 operator& (const Vec4 & x, const Vec4 & y) {
+	return lanewise (x, y, [](quint32 a, quint32 b) { return a & b; });
+}
+inline Vec4 operator| (const Vec4 & x, const Vec4 & y) {
+	return lanewise (x, y, [](quint32 a, quint32 b) { return a | b; });
+}
+inline Vec4 operator^ (const Vec4 & x, const Vec4 & y) {
+	return lanewise (x, y, [](quint32 a, quint32 b) { return a ^ b; });
+}
+inline Vec4 operator~ (const Vec4 & x) {
+	return lanewise (x, x, [](quint32 a, quint32) { return ~a; });
+}
+inline Vec4 operator+ (const Vec4 & x, quint32 c) {
+	return lanewise (x, x, [c](quint32 a, quint32) { return a + c; });
+}
+inline Vec4 operator<< (const Vec4 & x, int n) {
+	return lanewise (x, x, [n](quint32 a, quint32) { return a << n; });
+}
+inline Vec4 operator>> (const Vec4 & x, int n) {
+	return lanewise (x, x, [n](quint32 a, quint32) { return a >> n; });
+}
+#endif
+
+// One block of each lane. Unused lanes must point to readable blocks (result ignored).
+template <typename V, int Lanes>
+LOCALSHARE_MD5_ALWAYS_INLINE void process_block (State & state,
+                                                 const unsigned char * const * blocks) {
+	V w[16];
+	for (int i = 0; i < 16; ++i)
+		for (int l = 0; l < Lanes; ++l)
+			w[i][l] = load_le32 (blocks[l] + 4 * i);
+	V a, b, c, d;
+	for (int l = 0; l < Lanes; ++l) {
+		a[l] = state.words[0][l];
+		b[l] = state.words[1][l];
+		c[l] = state.words[2][l];
+		d[l] = state.words[3][l];
+	}
+	const V a0 = a, b0 = b, c0 = c, d0 = d;
+	for (int i = 0; i < 64; ++i) {
+		V f;
+		if (i < 16)
+			f = d ^ (b & (c ^ d));
+		else if (i < 32)
+			f = c ^ (d & (b ^ c));
+		else if (i < 48)
+			f = b ^ c ^ d;
+		else
+			f = c ^ (b | ~d);
+		auto t = d;
+		d = c;
+		c = b;
+		auto x = a + f + w[word_index[i]] + constant[i];
+		b = b + ((x << rotation[i]) | (x >> (32 - rotation[i])));
+		a = t;
+	}
+	a = a + a0;
+	b = b + b0;
+	c = c + c0;
+	d = d + d0;
+	for (int l = 0; l < Lanes; ++l) {
+		state.words[0][l] = a[l];
+		state.words[1][l] = b[l];
+		state.words[2][l] = c[l];
+		state.words[3][l] = d[l];
+	}
+}
+
+using Kernel = void (*) (State &, const unsigned char * const *);
+
+inline void kernel_4 (State & state, const unsigned char * const * blocks) {
+	process_block<Vec4, 4> (state, blocks);
+}
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LOCALSHARE_MD5_X86_DISPATCH
+__attribute__ ((target ("avx2"))) inline void kernel_8 (State & state,
+                                                      const unsigned char * const * blocks) {
+	process_block<Vec8, 8> (state, blocks);
+}
+__attribute__ ((target ("avx512f"))) inline void kernel_16 (State & state,
+                                                          const unsigned char * const * blocks) {
+	process_block<Vec16, 16> (state, blocks);
+}
+#endif
+
+// Best kernel for this cpu, and its number of lanes
+inline Kernel select_kernel (int & lanes) {
+#ifdef LOCALSHARE_MD5_X86_DISPATCH
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx512f")) {
+		lanes = 16;
+		return kernel_16;
+	}
+	if (__builtin_cpu_supports ("avx2")) {
+		lanes = 8;
+		return kernel_8;
+	}
+#endif
+	lanes = 4;
+	return kernel_4;
+}
+
+// Scalar version of process_block, for streams: steps are unrolled at compile time
+template <int I> struct Steps {
+	static LOCALSHARE_MD5_ALWAYS_INLINE void run (quint32 & a, quint32 & b, quint32 & c, quint32 & d,
+	                                              const quint32 * w) {
+		auto f = I < 16 ? d ^ (b & (c ^ d))
+		                : I < 32 ? c ^ (d & (b ^ c)) : I < 48 ? b ^ c ^ d : c ^ (b | ~d);
+		auto x = a + f + w[word_index[I]] + constant[I];
+		a = d;
+		d = c;
+		c = b;
+		b = b + ((x << rotation[I]) | (x >> (32 - rotation[I])));
+		Steps<I + 1>::run (a, b, c, d, w);
+	}
+};
+template <> struct Steps<64> {
+	static LOCALSHARE_MD5_ALWAYS_INLINE void run (quint32 &, quint32 &, quint32 &, quint32 &,
+	                                              const quint32 *) {}
+};
+inline void process_block_scalar (quint32 * state, const unsigned char * block) {
+	quint32 w[16];
+	for (int i = 0; i < 16; ++i)
+		w[i] = load_le32 (block + 4 * i);
+	auto a = state[0], b = state[1], c = state[2], d = state[3];
+	Steps<0>::run (a, b, c, d, w);
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+// Message being hashed in a lane: full blocks from data, then 1 or 2 padded tail blocks
+struct Lane {
+	int message{-1}; // -1 if idle
+	const unsigned char * data{nullptr};
+	qint64 nb_full_blocks{0};
+	qint64 next_block{0};
+	int nb_tail_blocks{0};
+	unsigned char tail[2 * block_size];
+
+	void start (int index, const char * message_data, qint64 size) {
+		message = index;
+		data = reinterpret_cast<const unsigned char *> (message_data);
+		nb_full_blocks = size / block_size;
+		next_block = 0;
+		auto rest = int(size % block_size);
+		nb_tail_blocks = rest + 9 <= block_size ? 1 : 2;
+		std::memset (tail, 0, sizeof (tail));
+		if (rest > 0)
+			std::memcpy (tail, data + nb_full_blocks * block_size, size_t (rest));
+		tail[rest] = 0x80;
+		auto bits = quint64 (size) * 8;
+		auto length = tail + nb_tail_blocks * block_size - 8;
+		for (int i = 0; i < 8; ++i)
+			length[i] = static_cast<unsigned char> (bits >> (8 * i));
+	}
+	const unsigned char * block (void) const {
+		if (next_block < nb_full_blocks)
+			return data + next_block * block_size;
+		return tail + (next_block - nb_full_blocks) * block_size;
+	}
+	bool advance (void) {
+		// Returns true when the message is done
+		++next_block;
+		return next_block == nb_full_blocks + nb_tail_blocks;
+	}
+};
+}
+
+// Lanes of the kernel used on this cpu
+inline int nb_lanes (void) {
+	int lanes = 0;
+	Detail::select_kernel (lanes);
+	return lanes;
+}
+
+/* Hash count messages (data[i], sizes[i] bytes).
+ * The digest of message i is written at digests + i * digest_size.
+ */
+inline void hash_many (const char * const * data, const qint64 * sizes, int count,
+                       char * digests) {
+	using namespace Detail;
+	static int lanes = 0;
+	static const Kernel kernel = select_kernel (lanes);
+	static const unsigned char idle_block[block_size] = {};
+
+	State state;
+	Lane lane[max_lanes];
+	int next_message = 0;
+	auto start_next = [&](int l) {
+		if (next_message < count) {
+			lane[l].start (next_message, data[next_message], sizes[next_message]);
+			++next_message;
+			for (int w = 0; w < 4; ++w)
+				state.words[w][l] = initial_state[w];
+		} else {
+			lane[l].message = -1;
+		}
+	};
+	int nb_active = 0;
+	for (int l = 0; l < lanes; ++l) {
+		start_next (l);
+		if (lane[l].message >= 0)
+			++nb_active;
+	}
+
+	const unsigned char * blocks[max_lanes];
+	while (nb_active > 0) {
+		for (int l = 0; l < lanes; ++l)
+			blocks[l] = lane[l].message >= 0 ? lane[l].block () : idle_block;
+		kernel (state, blocks);
+		for (int l = 0; l < lanes; ++l) {
+			if (lane[l].message < 0 || !lane[l].advance ())
+				continue;
+			// Digest is a, b, c, d in little endian
+			auto digest = digests + lane[l].message * digest_size;
+			for (int w = 0; w < 4; ++w)
+				for (int i = 0; i < 4; ++i)
+					digest[4 * w + i] = static_cast<char> (state.words[w][l] >> (8 * i));
+			start_next (l);
+			if (lane[l].message < 0)
+				--nb_active;
+		}
+	}
+}
+
+/* MD5 of a stream of data, added in pieces of any size.
+ * Only a partial block is buffered.
+ */
+class Stream {
+private:
+	quint32 state[4];
+	unsigned char buffer[Detail::block_size];
+	quint64 length; // Bytes added since reset
+
+public:
+	Stream () { reset (); }
+
+	void reset (void) {
+		std::memcpy (state, Detail::initial_state, sizeof (state));
+		length = 0;
+	}
+
+	void add_data (const char * data, qint64 size) {
+		using Detail::block_size;
+		auto p = reinterpret_cast<const unsigned char *> (data);
+		auto used = int(length % block_size);
+		length += quint64 (size);
+		if (used > 0) {
+			auto n = int(qMin (qint64 (block_size - used), size));
+			std::memcpy (buffer + used, p, size_t (n));
+			p += n;
+			size -= n;
+			if (used + n < block_size)
+				return;
+			Detail::process_block_scalar (state, buffer);
+		}
+		for (; size >= block_size; p += block_size, size -= block_size)
+			Detail::process_block_scalar (state, p);
+		if (size > 0)
+			std::memcpy (buffer, p, size_t (size));
+	}
+
+	// Digest of the data added so far, written at digest (digest_size bytes)
+	void result (char * digest) const {
+		using Detail::block_size;
+		static const char padding[block_size] = {char(0x80)};
+		auto bits = length * 8;
+		char bits_le[8];
+		for (int i = 0; i < 8; ++i)
+			bits_le[i] = static_cast<char> (bits >> (8 * i));
+		// Padding up to 8 bytes before the end of a block, then the length
+		auto pad = (2 * block_size - 8 - int(length % block_size)) % block_size;
+		Stream end (*this);
+		end.add_data (padding, pad == 0 ? block_size : pad);
+		end.add_data (bits_le, 8);
+		for (int w = 0; w < 4; ++w)
+			for (int i = 0; i < 4; ++i)
+				digest[4 * w + i] = static_cast<char> (end.state[w] >> (8 * i));
+	}
+};
+}
+
+#endif
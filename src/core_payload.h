@@ -24,16 +24,66 @@
 #include <QDateTime>
 #include <QElapsedTimer>
 #include <QDir>
-#include <QDirIterator>
 #include <QFile>
 #include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
 #include <QObject>
+#include <QPair>
+#include <QRunnable>
+#include <QStringList>
+#include <QThreadPool>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <iterator>
 #include <list>
 #include <memory>
+#include <vector>
 
+#include "core_filter.h"
 #include "core_localshare.h"
+#include "core_eventlog.h"
+#include "core_md5.h"
+#include "core_trace.h"
+#include "portability.h"
 
 namespace Payload {
+/* Page cache release of the end of written files, once closed (see File::set_drop_cache).
+ * Write back of the last window must be waited for before the release, which can take a while
+ * on slow disks: it is done in a separate thread, on the file opened again by path.
+ * The thread pool has one thread, so releases do not compete for the disk.
+ */
+class CacheReleaser {
+private:
+	class Job : public QRunnable {
+	private:
+		QString path;
+		qint64 offset;
+		qint64 len;
+
+	public:
+		Job (const QString & path, qint64 offset, qint64 len)
+		    : path (path), offset (offset), len (len) {}
+		void run (void) Q_DECL_OVERRIDE {
+			QFile file (path);
+			if (file.open (QIODevice::ReadOnly))
+				release_written_range (file.handle (), offset, len);
+		}
+	};
+
+	QThreadPool pool;
+
+	CacheReleaser () { pool.setMaxThreadCount (1); }
+
+public:
+	static void release_written (const QString & path, qint64 offset, qint64 len) {
+		static CacheReleaser releaser; // Waits for pending releases at exit
+		releaser.pool.start (new Job (path, offset, len));
+	}
+};
+
 /* Represent a File in a payload.
  * file_path is relative to the payload root_dir and contains the file name.
  * It caches info from QFileInfo to check if it changed later.
@@ -52,6 +102,12 @@ namespace Payload {
  * - mmap cannot be used on them
  * - most operations will be noop, and no mapping is performed
  *
+ * Small files (up to Const::inline_max_file_size, including empty ones) are inline:
+ * they are sent in batches, read in one call, and written by an InlineWriter.
+ *
+ * With set_drop_cache, data streamed by read_data/write_data is released from the page cache.
+ * The end of written data is released in a separate thread after close (see CacheReleaser).
+ *
  * This class is neither copyable nor movable (due to QFile).
  * It is not a QObject as signals/slots of QFile are not useful.
  */
@@ -62,14 +118,33 @@ private:
 	QString last_error;
 
 	QString file_path;
-	qint64 size;
+	qint64 size; // Of data in the transfer (0 for links)
 	QDateTime last_modified;
 
+	// Hard link to a previous file of the payload (by index), which carries the data
+	qint32 link_target{-1};
+	qint64 link_size{0};
+
 	// QFile destructor will close file and mappings
 	QFile file;
+	QFile copy_source; // Only used by same host copies
 	char * mapping{nullptr};
 	qint64 pos;
-	QCryptographicHash hash{Const::hash_algorithm};
+	Md5::Stream hash; // Const::hash_algorithm, without allocation per digest
+	static_assert (Const::hash_algorithm == QCryptographicHash::Md5, "File hash is Md5::Stream");
+
+	// Page cache release of data behind pos (see Manager::CacheMode)
+	bool drop_cache{false};
+	qint64 cache_released{0};    // Data before it was released
+	qint64 writeback_started{0}; // Receiver: data before it is written back, or being
+
+	// Tracepoints and event log (see core_trace.h, core_eventlog.h)
+	quint32 trace_id{0};
+	quint32 trace_index{0};
+
+	// Receiver: retries after a checksum mismatch
+	int nb_retries{0};
+	bool waiting_for_retry{false};
 
 public:
 	File () = default;
@@ -77,25 +152,66 @@ public:
 	    : file_path (payload_dir.relativeFilePath (file_info.filePath ())),
 	      size (file_info.size ()),
 	      last_modified (file_info.lastModified ()) {}
+	File (const QString & file_path, qint64 size) : file_path (file_path), size (size) {}
 
 	QString get_last_error (void) const { return last_error; }
 	bool at_end (void) const { return pos == size; }
+	qint64 get_remaining (void) const { return size - pos; }
 
 	QString get_relative_path (void) const { return file_path; }
 	qint64 get_size (void) const { return size; }
+	QDateTime get_last_modified (void) const { return last_modified; } // Sender only
+	qint64 get_logical_size (void) const { return is_link () ? link_size : size; }
+
+	void set_trace (quint32 transfer_id, quint32 index) {
+		trace_id = transfer_id;
+		trace_index = index;
+	}
+
+	bool is_link (void) const { return link_target >= 0; }
+	bool is_inline (void) const { return !is_link () && size <= Const::inline_max_file_size; }
+	quint32 get_link_target (void) const { return quint32 (link_target); }
+	void set_link (quint32 target, qint64 content_size) {
+		link_target = qint32 (target);
+		link_size = content_size;
+		size = 0;
+	}
+
+	// Metadata only, for copies of a file list (the file itself is not opened)
+	void copy_metadata (const File & other) {
+		file_path = other.file_path;
+		size = other.size;
+		last_modified = other.last_modified;
+		link_target = other.link_target;
+		link_size = other.link_size;
+	}
 
-	// Only export/import filename and size
-	void to_stream (QDataStream & stream) const { stream << file_path << size; }
-	void from_stream (QDataStream & stream) { stream >> file_path >> size; }
+	// Only export/import filename, size, and link
+	void to_stream (QDataStream & stream) const {
+		stream << file_path << get_logical_size () << link_target;
+	}
+	void from_stream (QDataStream & stream) {
+		stream >> file_path >> size >> link_target;
+		if (is_link ())
+			set_link (quint32 (link_target), size);
+	}
 	bool validate_path (void) const {
 		// Check path is not out of target dir tree
 		return QDir::isRelativePath (file_path) && !file_path.contains ("..");
 	}
 
-	// Hash export / import-check
-	QByteArray get_checksum (void) const { return hash.result (); }
-	bool test_checksum (const QByteArray & cs) {
-		if (cs != hash.result ()) {
+	// Hash export / import-check. Inline files and links have no checksum in the main stream.
+	bool has_own_checksum (void) const { return !is_link () && !is_inline (); }
+	// Digests have Const::hash_size bytes, and are written or compared in place
+	void get_checksum (char * digest) const { hash.result (digest); }
+	bool test_checksum (const char * digest) {
+		char computed[Const::hash_size];
+		hash.result (computed);
+		return test_checksum (digest, computed);
+	}
+	bool test_checksum (const char * digest, const char * computed) {
+		// computed is a digest from this file
+		if (std::memcmp (digest, computed, Const::hash_size) != 0) {
 			last_error = tr ("Checksum does not match for file %1").arg (file_path);
 			return false;
 		} else {
@@ -103,6 +219,21 @@ public:
 		}
 	}
 
+	// Retry status (receiver)
+	bool is_waiting_for_retry (void) const { return waiting_for_retry; }
+	bool request_retry (void) {
+		if (nb_retries >= Const::max_file_retries) {
+			last_error = tr ("Checksum does not match for file %1 after %2 retries")
+			                 .arg (file_path)
+			                 .arg (nb_retries);
+			return false;
+		}
+		++nb_retries;
+		waiting_for_retry = true;
+		return true;
+	}
+	void retry_done (void) { waiting_for_retry = false; }
+
 	// QIODevice similar open & close
 
 	bool open (const QDir & payload_dir, QIODevice::OpenMode mode) {
@@ -143,20 +274,187 @@ public:
 				return false;
 			}
 			mapping = reinterpret_cast<char *> (addr);
+			if (drop_cache)
+				advise_sequential (file.handle (), mapping, size);
+		}
+		pos = 0;
+		cache_released = writeback_started = 0;
+		hash.reset ();
+		LOCALSHARE_TRACE (file_open, trace_id, trace_index, size, mode == QIODevice::ReadWrite);
+		EventLog::record (EventLog::FileOpened, trace_id, trace_index, size);
+		return true;
+	}
+	// Set before open
+	void set_drop_cache (bool enabled) { drop_cache = enabled; }
+
+	/* Sender of inline batches: append the whole file content to data, without mapping.
+	 * No hash is computed, as the batch has its own.
+	 */
+	bool read_inline (const QDir & payload_dir, QByteArray & data) {
+		Q_ASSERT (is_inline ());
+		QFileInfo info (payload_dir.filePath (file_path));
+		if (info.size () != size || info.lastModified () != last_modified) {
+			last_error = tr ("File %1 has changed").arg (file_path);
+			return false;
+		}
+		QFile f (info.filePath ());
+		if (!f.open (QIODevice::ReadOnly)) {
+			last_error = tr ("Unable to open file %1: %2").arg (info.filePath (), f.errorString ());
+			return false;
+		}
+		auto content = f.read (size);
+		if (content.size () != size) {
+			last_error = tr ("Unable to read file %1: %2").arg (file_path, f.errorString ());
+			return false;
+		}
+		data += content;
+		return true;
+	}
+
+	/* Receiver: make this path a hard link to the target file, whose data is complete.
+	 * Without hard links in the file system, the data is copied instead.
+	 */
+	bool create_link (const QDir & payload_dir, const File & target) {
+		Q_ASSERT (is_link ());
+		QFileInfo info (payload_dir.filePath (file_path));
+		auto dir = info.dir ();
+		if (!dir.mkpath (".")) {
+			last_error = tr ("Unable to create path: %1").arg (dir.path ());
+			return false;
+		}
+		QFile::remove (info.filePath ()); // Replace existing files, like open ()
+		auto target_path = payload_dir.filePath (target.file_path);
+		if (!make_hard_link (target_path, info.filePath ()) &&
+		    !QFile::copy (target_path, info.filePath ())) {
+			last_error = tr ("Unable to link file %1 to %2").arg (file_path, target.file_path);
+			return false;
+		}
+		return true;
+	}
+
+	/* Same host copy (receiver only): data is copied from the sender file, not the socket.
+	 * The copy is done in kernel if possible (reflink clone, or copy_file_range).
+	 * The target permissions are restricted to those of the source.
+	 * Thus a copy cannot make data more visible than the source file was.
+	 * No hash is computed, as no data is going through our process.
+	 */
+	bool open_copy (const QDir & payload_dir, const QDir & source_dir) {
+		copy_source.setFileName (source_dir.filePath (file_path));
+		if (!copy_source.open (QIODevice::ReadOnly)) {
+			last_error = tr ("Unable to open file %1: %2")
+			                 .arg (copy_source.fileName (), copy_source.errorString ());
+			return false;
+		}
+		if (copy_source.size () != size) {
+			last_error = tr ("File %1 has changed").arg (file_path);
+			return false;
+		}
+		QFileInfo info (payload_dir.filePath (file_path));
+		auto dir = info.dir ();
+		if (!dir.mkpath (".")) {
+			last_error = tr ("Unable to create path: %1").arg (dir.path ());
+			return false;
+		}
+		file.setFileName (info.filePath ());
+		if (!file.open (QIODevice::WriteOnly)) {
+			last_error = tr ("Unable to open file %1: %2").arg (info.filePath (), file.errorString ());
+			return false;
+		}
+		if (!file.setPermissions (file.permissions () & copy_source.permissions ())) {
+			last_error = tr ("Unable to set permissions of file %1").arg (info.filePath ());
+			return false;
+		}
+		pos = 0;
+		if (size > 0 && clone_file (copy_source.handle (), file.handle ()))
+			pos = size;
+		return true;
+	}
+	qint64 copy_data (qint64 bytes) {
+		// Returns bytes copied, or -1 on error
+		auto len = qMin (bytes, size - pos);
+		if (len <= 0)
+			return 0;
+		auto copied = copy_file_data (copy_source.handle (), file.handle (), pos, len);
+		if (copied <= 0) {
+			// Not supported (or other file systems): copy through a buffer
+			if (!copy_source.seek (pos) || !file.seek (pos)) {
+				last_error = tr ("Unable to seek in file %1").arg (file_path);
+				return -1;
+			}
+			auto data = copy_source.read (qMin (len, Const::local_copy_buffer_size));
+			copied = file.write (data);
+			if (data.isEmpty () || copied != data.size ()) {
+				last_error = tr ("Unable to copy file %1: %2").arg (file_path, file.errorString ());
+				return -1;
+			}
+		}
+		pos += copied;
+		return copied;
+	}
+
+	/* Hash the file from disk (random access transfers, where data is not received in order).
+	 * Empty files are created if needed.
+	 */
+	bool open_hashing (const QDir & payload_dir) {
+		auto path = payload_dir.filePath (file_path);
+		if (size == 0 && !QFileInfo::exists (path))
+			return open (payload_dir, QIODevice::ReadWrite); // Creates it
+		file.setFileName (path);
+		if (!file.open (QIODevice::ReadOnly)) {
+			last_error = tr ("Unable to open file %1: %2").arg (file.fileName (), file.errorString ());
+			return false;
 		}
 		pos = 0;
 		hash.reset ();
 		return true;
 	}
+	// Whole content, hashed outside (several files at once, see Md5::hash_many)
+	bool read_for_hashing (const QDir & payload_dir, QByteArray & data) {
+		auto path = payload_dir.filePath (file_path);
+		if (size == 0 && !QFileInfo::exists (path)) {
+			if (!open (payload_dir, QIODevice::ReadWrite)) // Creates it
+				return false;
+			close ();
+		}
+		QFile f (path);
+		if (!f.open (QIODevice::ReadOnly)) {
+			last_error = tr ("Unable to open file %1: %2").arg (path, f.errorString ());
+			return false;
+		}
+		data = f.read (size);
+		if (data.size () != size) {
+			last_error = tr ("Unable to read file %1: %2").arg (file_path, f.errorString ());
+			return false;
+		}
+		return true;
+	}
+	qint64 hash_data (qint64 bytes) {
+		// Returns bytes hashed, or -1 on error
+		auto data = file.read (qMin (bytes, size - pos));
+		if (data.isEmpty () && pos < size) {
+			last_error = tr ("Unable to read file %1: %2").arg (file_path, file.errorString ());
+			return -1;
+		}
+		hash.add_data (data.constData (), data.size ());
+		pos += data.size ();
+		return data.size ();
+	}
 
 	bool is_open (void) const { return file.isOpen (); }
 
 	void close (void) {
+		if (file.isOpen ()) {
+			LOCALSHARE_TRACE (file_close, trace_id, trace_index, pos);
+			EventLog::record (EventLog::FileClosed, trace_id, trace_index, pos);
+		}
 		if (mapping != nullptr) {
+			if (drop_cache)
+				release_cache_at_close ();
 			file.unmap (reinterpret_cast<uchar *> (mapping));
 			mapping = nullptr;
 		}
 		file.close ();
+		copy_source.close ();
 	}
 
 	/* Read or write data to the file, to or from a QDataStream.
@@ -172,8 +470,10 @@ public:
 		auto p = &mapping[pos];
 		auto bytes_read = target.writeRawData (p, qMin (bytes, size - pos));
 		if (bytes_read > 0) {
-			hash.addData (p, bytes_read);
+			hash.add_data (p, bytes_read);
 			pos += bytes_read;
+			if (drop_cache)
+				release_cache (false);
 		}
 		return bytes_read;
 	}
@@ -185,11 +485,264 @@ public:
 		auto p = &mapping[pos];
 		auto bytes_read = source.readRawData (p, qMin (bytes, size - pos));
 		if (bytes_read > 0) {
-			hash.addData (p, bytes_read);
+			hash.add_data (p, bytes_read);
 			pos += bytes_read;
+			if (drop_cache)
+				release_cache (false);
 		}
 		return bytes_read;
 	}
+
+	// Sender resuming in the middle of the file: hash data that was sent already, without sending
+	qint64 skip_data (qint64 bytes) {
+		auto len = qMin (bytes, size - pos);
+		if (len <= 0)
+			return 0;
+		Q_ASSERT (mapping);
+		hash.add_data (&mapping[pos], len);
+		pos += len;
+		if (drop_cache)
+			release_cache (false);
+		return len;
+	}
+
+	// Positional versions (random access transfers): no hash, position is not used
+	qint64 read_at (QDataStream & target, qint64 offset, qint64 bytes) {
+		Q_ASSERT (mapping && 0 <= offset && offset + bytes <= size);
+		return target.writeRawData (&mapping[offset], bytes);
+	}
+	qint64 write_at (QDataStream & source, qint64 offset, qint64 bytes) {
+		Q_ASSERT (mapping && 0 <= offset && offset + bytes <= size);
+		return source.readRawData (&mapping[offset], bytes);
+	}
+
+private:
+	void release_cache (bool all) {
+		// Released by windows behind pos, or up to pos when closing.
+		// The receiver starts write back one window ahead, so the release rarely waits for the disk.
+		auto written = (file.openMode () & QIODevice::WriteOnly) != 0;
+		auto end = all ? pos : pos - pos % Const::cache_release_window;
+		if (written && writeback_started < end) {
+			start_writeback (file.handle (), mapping, writeback_started, end - writeback_started);
+			writeback_started = end;
+		}
+		auto release_end = all || !written ? end : end - Const::cache_release_window;
+		if (release_end > cache_released) {
+			release_cached_range (file.handle (), mapping, cache_released,
+			                      release_end - cache_released, written);
+			cache_released = release_end;
+		}
+	}
+	void release_cache_at_close (void) {
+		// Read data is released now. Written data only starts its write back: close must not wait.
+		if ((file.openMode () & QIODevice::WriteOnly) == 0) {
+			release_cache (true);
+			return;
+		}
+		if (writeback_started < pos)
+			start_writeback (file.handle (), mapping, writeback_started, pos - writeback_started);
+		if (cache_released < pos)
+			CacheReleaser::release_written (file.fileName (), cache_released, pos - cache_released);
+		writeback_started = cache_released = pos;
+	}
+};
+
+/* Checksums of a range of files, in one flat buffer of digests (Const::hash_size bytes each).
+ * Serialized as quint32(first_file), quint32(nb_files), quint32(nb_digests), raw digests.
+ * In the main stream, files without their own checksum have no digest (File::has_own_checksum).
+ * A resent file is alone in its list, and always has a digest.
+ * Lists of all files (random access) have one digest per file.
+ * Digests are copied and compared in place: no allocation per file.
+ * Buffers can be reused with reset (), which keeps the reserved capacity.
+ */
+class ChecksumList : public Streamable {
+private:
+	quint32 first_file{0};
+	quint32 nb_files{0};
+	QByteArray digests;
+
+	char * append_digest (void) {
+		// Space for one more digest, filled by the caller (no allocation within the reserve)
+		digests.resize (digests.size () + Const::hash_size);
+		return digests.data () + digests.size () - Const::hash_size;
+	}
+
+public:
+	quint32 get_first_file (void) const { return first_file; }
+	quint32 get_nb_files (void) const { return nb_files; }
+	int size (void) const { return digests.size () / Const::hash_size; }
+	bool empty (void) const { return digests.isEmpty (); }
+	const char * at (int i) const {
+		Q_ASSERT (0 <= i && i < size ());
+		return digests.constData () + i * Const::hash_size;
+	}
+	bool operator== (const ChecksumList & other) const {
+		return first_file == other.first_file && nb_files == other.nb_files &&
+		       digests == other.digests;
+	}
+	bool operator!= (const ChecksumList & other) const { return !(*this == other); }
+
+	void reserve (int nb_digests) { digests.reserve (nb_digests * Const::hash_size); }
+	void reset (quint32 first) {
+		first_file = first;
+		nb_files = 0;
+		digests.resize (0);
+	}
+	void add_file (const File & file) {
+		if (file.has_own_checksum ())
+			file.get_checksum (append_digest ());
+		++nb_files;
+	}
+	void add_resent_file (const File & file) {
+		// Resent files always have a digest, including inline files (their batch failed)
+		file.get_checksum (append_digest ());
+		++nb_files;
+	}
+
+	// One digest per file, set by index
+	void reset_all (quint32 count) {
+		first_file = 0;
+		nb_files = count;
+		digests.fill ('\0', int(count) * Const::hash_size);
+	}
+	char * digest_at (int i) {
+		Q_ASSERT (0 <= i && i < size ());
+		return digests.data () + i * Const::hash_size;
+	}
+	void set (int i, const char * digest) { std::memcpy (digest_at (i), digest, Const::hash_size); }
+
+	void to_stream (QDataStream & stream) const {
+		stream << first_file << nb_files << quint32 (size ());
+		stream.writeRawData (digests.constData (), digests.size ());
+	}
+	void from_stream (QDataStream & stream) {
+		quint32 nb_digests;
+		stream >> first_file >> nb_files >> nb_digests;
+		auto bytes = qint64 (nb_digests) * Const::hash_size;
+		// Digests must be buffered already: bounds the allocation with bad counts
+		if (stream.status () != QDataStream::Ok || nb_digests > nb_files ||
+		    bytes > stream.device ()->bytesAvailable ()) {
+			stream.setStatus (QDataStream::ReadCorruptData);
+			return;
+		}
+		digests.resize (int(bytes));
+		if (stream.readRawData (digests.data (), int(bytes)) != bytes)
+			stream.setStatus (QDataStream::ReadPastEnd);
+	}
+};
+
+/* Same host copy: the source files as the sender sees them, by file index.
+ * Identity (device, inode) and modification time from the scan, in msecs since epoch.
+ * Links have no data, and no entry to check (null identity).
+ */
+class SourceIdentities : public Streamable {
+public:
+	struct Entry {
+		FileIdentity identity;
+		qint64 last_modified;
+	};
+	std::vector<Entry> entries;
+
+	void to_stream (QDataStream & stream) const {
+		stream << quint32 (entries.size ());
+		for (auto & e : entries)
+			stream << e.identity.device << e.identity.inode << e.last_modified;
+	}
+	void from_stream (QDataStream & stream) {
+		quint32 count;
+		stream >> count;
+		// Entries must be buffered already: bounds the allocation with bad counts
+		if (stream.status () != QDataStream::Ok ||
+		    qint64 (count) * qint64 (3 * sizeof (quint64)) > stream.device ()->bytesAvailable ()) {
+			stream.setStatus (QDataStream::ReadCorruptData);
+			return;
+		}
+		entries.resize (count);
+		for (auto & e : entries)
+			stream >> e.identity.device >> e.identity.inode >> e.last_modified;
+	}
+};
+
+/* Writes the files of received inline batches to disk, in a separate thread.
+ * The thread pool has one thread, so batches are written in order.
+ * Writing many small files is mostly syscalls (mkpath, open, close), which would stall the loop.
+ * The first error stops further writes, and is returned by wait ().
+ */
+class InlineWriter {
+	Q_DECLARE_TR_FUNCTIONS (InlineWriter);
+
+private:
+	struct Item {
+		QString path;
+		int offset; // In batch data
+		int size;
+	};
+	struct State {
+		QMutex mutex;
+		QString error;
+	};
+
+	class Job : public QRunnable {
+	private:
+		QByteArray data;
+		std::vector<Item> items;
+		std::shared_ptr<State> state;
+
+	public:
+		Job (const QByteArray & data, std::vector<Item> items, std::shared_ptr<State> state)
+		    : data (data), items (std::move (items)), state (std::move (state)) {}
+		void run (void) Q_DECL_OVERRIDE {
+			{
+				QMutexLocker lock (&state->mutex);
+				if (!state->error.isEmpty ())
+					return;
+			}
+			for (auto & item : items) {
+				auto error = write (item);
+				if (!error.isEmpty ()) {
+					QMutexLocker lock (&state->mutex);
+					state->error = error;
+					return;
+				}
+			}
+		}
+
+	private:
+		QString write (const Item & item) const {
+			auto dir = QFileInfo (item.path).dir ();
+			if (!dir.mkpath ("."))
+				return tr ("Unable to create path: %1").arg (dir.path ());
+			QFile file (item.path);
+			if (!file.open (QIODevice::WriteOnly))
+				return tr ("Unable to open file %1: %2").arg (item.path, file.errorString ());
+			if (file.write (data.constData () + item.offset, item.size) != item.size)
+				return tr ("Unable to write file %1: %2").arg (item.path, file.errorString ());
+			return QString ();
+		}
+	};
+
+	QThreadPool pool;
+	std::shared_ptr<State> state{std::make_shared<State> ()};
+	std::vector<Item> items; // Of the batch being built
+
+public:
+	InlineWriter () { pool.setMaxThreadCount (1); }
+	~InlineWriter () { pool.waitForDone (); }
+
+	void add_file (const QString & path, int offset, int size) {
+		items.push_back ({path, offset, size});
+	}
+	void write_batch (const QByteArray & data) {
+		// Data is shared, not copied
+		pool.start (new Job (data, std::move (items), state));
+		items.clear ();
+	}
+
+	QString wait (void) {
+		pool.waitForDone ();
+		QMutexLocker lock (&state->mutex);
+		return state->error;
+	}
 };
 
 /* Represent file and dirs.
@@ -219,9 +772,38 @@ public:
  * Chunks are not cut by file boundaries: they operate on the concantenated data of all files.
  * Multiple files may be sent in one chunk; data is dispatched according to file limits.
  * When a file has been completely sent, its checksum is available and can be sent.
+ * Checksums are taken by ranges of consecutive files (ChecksumList), in file order.
  * Upload is complete if all data then checksums have been sent.
  * Download is complete if all data then checksums have been received (and checkums valid).
  *
+ * A file with a bad checksum is not an error for the receiver, up to Const::max_file_retries.
+ * The receiver records its index (take_retry_requests), and the sender queues it (queue_resend).
+ * After the main stream, the sender resends each file alone: data chunks then its checksum.
+ * The receiver routes chunks to the resent file (receive_again), then tests the new checksum.
+ * Other files are not touched by retries.
+ *
+ * Pipelined scan: the sender can start the transfer while the payload dir is being scanned.
+ * start_scan () prepares the payload, and scan_step () adds files until the manifest is complete.
+ * The offer is then open-ended (total size -1), and files found later are sent in manifest pages.
+ * The receiver appends them to its list, and the final total size closes the manifest.
+ * The transfer cannot be complete before the manifest.
+ * Appending to the list does not move iterators at end (), so they are moved to the new files.
+ *
+ * Directory scans apply a Filter (core_filter.h): excluded subtrees are never read.
+ * Excluded entries are counted in get_skipped ().
+ *
+ * Small files are inline (File::is_inline): they are sent in batches instead of chunks.
+ * A batch is the raw data of consecutive inline files, with one checksum for all of them.
+ * Chunks stop before inline files, so a batch always starts at a file boundary.
+ * The receiver hands batches to an InlineWriter thread, and waits for it before closing.
+ * If a batch checksum does not match, each of its files is retried like a bad file.
+ * Links have no data: both sides pass them in the stream (skip_links).
+ *
+ * Random access (multi-source pull): data is transfered by ranges of the concatenated data.
+ * Ranges can arrive in any order, so file hashes are computed from disk at the end (hash_step).
+ * The source computes them once before serving, the receiver checks them against the source.
+ * Bad files are reported by take_retry_requests (), and their data should be requested again.
+ *
  * Note: This class never checks the status of the stream object.
  *
  * TODO ability to set a position (for restarts) ?
@@ -232,38 +814,136 @@ class Manager : public Streamable {
 public:
 	enum Mode { Closed, Sending, Receiving };
 	enum PayloadType { Invalid, SingleFile, Directory };
+
+	/* Page cache use of files streamed in order (main stream and retries).
+	 * Streaming a payload larger than memory evicts the whole working set of the host.
+	 * With CacheDrop, data is released from the cache behind the position (after write back).
+	 * CacheAuto drops if the payload is larger than the physical memory.
+	 * Random access files (pull) keep the cache, as ranges may be read again.
+	 */
+	enum CacheMode { CacheAuto, CacheDrop, CacheKeep };
+	static QStringList cache_mode_names (void) { return {"auto", "drop", "keep"}; }
+	static bool cache_mode_from_name (const QString & name, CacheMode & mode) {
+		auto index = cache_mode_names ().indexOf (name);
+		if (index < 0)
+			return false;
+		mode = CacheMode (index);
+		return true;
+	}
+
 	using Checksum = QByteArray;
-	using ChecksumList = QList<Checksum>;
+	using ChecksumList = Payload::ChecksumList;
+
+	// Next inline files to send in one batch
+	struct InlineBatch {
+		quint32 nb_files;
+		qint64 data_size;
+	};
 
 private:
 	using FileList = std::list<File>; // std::list can handle File (non copyable/movable)
 
+public:
+	/* Files found after the offer, sent in Manifest messages.
+	 * The sender serializes a range of its list in place (must be done before any other append).
+	 * The receiver reads files in a separate list, which is spliced into the payload.
+	 */
+	class ManifestPage : public Streamable {
+		friend class Manager;
+
+	private:
+		FileList::const_iterator first;
+		FileList::const_iterator last;
+		FileList received;
+
+	public:
+		ManifestPage () = default;
+		ManifestPage (FileList::const_iterator first, FileList::const_iterator last)
+		    : first (first), last (last) {}
+
+		void to_stream (QDataStream & stream) const {
+			stream << quint32 (std::distance (first, last));
+			for (auto it = first; it != last; ++it)
+				stream << *it;
+		}
+		void from_stream (QDataStream & stream) {
+			quint32 c;
+			stream >> c;
+			for (quint32 i = 0; i < c && stream.status () == QDataStream::Ok; ++i) {
+				received.emplace_back ();
+				stream >> received.back ();
+			}
+		}
+	};
+
+private:
 	QString last_error;
 
 	// Transfer display information
-	qint64 total_size{0};
+	qint64 total_size{0};   // Data to transfer
+	qint64 logical_size{0}; // Including hard links (data sent once)
+	int nb_links{0};
 	// transfer name and fullpath are recomputed
 
 	QDir root_dir;        // Should always store an absolute path
 	QString payload_root; // '.' for SingleFile, '<dir>' for Directory
 	FileList files;
+	std::vector<FileList::iterator> file_index; // Files by index
 
 	// Progress
 	Mode transfer_status{Closed};
 	FileList::iterator current_file{files.end ()};
+	quint32 current_index{0}; // Of current_file
 	FileList::iterator next_file_to_checksum{files.end ()};
 	qint64 total_transfered{0};
 	int nb_files_transfered{0};
+	qint64 chunk_size{Const::chunk_size}; // Sender: tuned to the link (see Transfer::LinkInfo)
+	quint32 trace_id{0};                  // Transfer, for tracepoints and the event log
+	CacheMode cache_mode{CacheAuto};
+
+	// Retries
+	FileList::iterator resend_file{files.end ()}; // File being sent or received again
+	quint32 resend_index{0};                      // Of resend_file
+	std::deque<quint32> resend_queue;             // Sender: files to send again
+	std::vector<quint32> retry_requests;          // Receiver: failed files, not reported yet
+	int nb_pending_retries{0};                    // Receiver: failed files, not received again yet
+
+	// Pipelined scan
+	std::unique_ptr<Scanner> scanner;                   // Sender: scan in progress
+	bool manifest_complete{true};                       // Until scan end, or ManifestEnd message
+	FileList::iterator first_unannounced{files.end ()}; // Sender: files not in offer or pages yet
+	Skipped skipped;                                    // Sender: excluded by filters
+	QHash<QPair<quint64, quint64>, quint32> inodes;     // Sender: first file of multi-link inodes
+
+	// Same host copy: source of the receiver
+	QDir copy_source_dir;
+	SourceIdentities copy_source_ids;
+
+	// Random access
+	std::vector<qint64> file_offsets;    // Offset of each file in the concatenated data
+	std::deque<File *> open_range_files; // Files mapped for ranges, oldest first
+	std::deque<quint32> hash_queue;      // Files to hash from disk
+	ChecksumList file_checksums;         // Hashes from disk, by file index
+
+	std::unique_ptr<InlineWriter> inline_writer; // Receiver: created at the first inline batch
+
+	// Sender of a fan-out upload detached from the shared stream (see resume_main_stream)
+	quint32 resume_rehash{0}; // Next sent file to hash again for its checksum
+	qint64 resume_skip{0};    // Data of current_file sent already, to hash again
 
 public:
 	QString get_last_error (void) const { return last_error; }
 
 	qint64 get_total_size (void) const { return total_size; }
+	qint64 get_logical_size (void) const { return logical_size; }
+	int get_nb_links (void) const { return nb_links; }
 	qint64 get_total_transfered_size (void) const { return total_transfered; }
 	int get_nb_files (void) const { return int(files.size ()); }
 	int get_nb_files_transfered (void) const { return nb_files_transfered; }
+	const Skipped & get_skipped (void) const { return skipped; }
 
 	const QDir & get_root_dir (void) const { return root_dir; }
+	QString get_payload_dir_path (void) const { return get_payload_dir ().absolutePath (); }
 	void set_root_dir (const QString & dir_path) {
 		Q_ASSERT (transfer_status == Closed);
 		root_dir.setPath (dir_path);
@@ -299,15 +979,23 @@ public:
 	}
 	QString inspect_files (void) const {
 		QString text;
-		for (auto & f : files)
-			text += QStringLiteral ("-\t%1 (%2)\n")
-			            .arg (f.get_relative_path (), size_to_string (f.get_size ()));
+		for (auto & f : files) {
+			if (f.is_link ())
+				text += QStringLiteral ("-\t%1 (%2, %3)\n")
+				            .arg (f.get_relative_path (), size_to_string (f.get_logical_size ()),
+				                  tr ("link to %1")
+				                      .arg (file_index[f.get_link_target ()]->get_relative_path ()));
+			else
+				text += QStringLiteral ("-\t%1 (%2)\n")
+				            .arg (f.get_relative_path (), size_to_string (f.get_size ()));
+		}
 		return text;
 	}
 
 	// File list management
 
-	bool from_source_path (const QString & path, bool ignore_hidden) {
+	bool from_source_path (const QString & path, bool ignore_hidden,
+	                       const Filter & filter = Filter ()) {
 		Q_ASSERT (transfer_status == Closed);
 		Q_ASSERT (get_type () == Invalid); // Should only be called once
 		auto cleaned_path = QFileInfo (path).canonicalFilePath ();
@@ -319,17 +1007,13 @@ public:
 		root_dir = path_info.dir ();
 		if (path_info.isFile ()) {
 			payload_root = ".";
-			files.emplace_back (path_info, root_dir);
-			total_size += path_info.size ();
+			append_file (path_info, root_dir);
 			return true;
 		} else if (path_info.isDir ()) {
 			payload_root = path_info.fileName ();
 			auto payload_dir = get_payload_dir ();
 			// Recursively search dirs for files
-			auto filter_flags = QDir::Files | QDir::NoSymLinks | QDir::NoDotAndDotDot | QDir::Readable;
-			if (!ignore_hidden)
-				filter_flags |= QDir::Hidden;
-			QDirIterator it (path_info.filePath (), filter_flags, QDirIterator::Subdirectories);
+			Scanner it (path_info.filePath (), ignore_hidden, filter, skipped);
 			QElapsedTimer timer;
 			timer.start();
 			while (it.hasNext ()) {
@@ -338,9 +1022,7 @@ public:
 					QCoreApplication::processEvents ();
 					timer.start ();
 				}
-				QFileInfo entry (it.next ());
-				files.emplace_back (entry, payload_dir);
-				total_size += entry.size ();
+				append_file (it.next (), payload_dir);
 			}
 			if (files.empty ()) {
 				last_error = tr ("No file found in directory: %1").arg (path);
@@ -353,11 +1035,110 @@ public:
 		}
 	}
 
+	bool copy_file_list (const Manager & source) {
+		// Sender: same payload as a scanned one, without scanning again (fan-out uploads)
+		Q_ASSERT (transfer_status == Closed);
+		Q_ASSERT (get_type () == Invalid); // Should only be called once
+		Q_ASSERT (source.manifest_complete);
+		root_dir = source.root_dir;
+		payload_root = source.payload_root;
+		for (auto & f : source.files) {
+			files.emplace_back ();
+			files.back ().copy_metadata (f);
+			add_to_index (std::prev (files.end ()));
+		}
+		total_size = source.total_size;
+		skipped = source.skipped;
+		set_all_announced ();
+		return !files.empty ();
+	}
+
+	// Pipelined scan (sender)
+
+	bool start_scan (const QString & path, bool ignore_hidden, const Filter & filter = Filter ()) {
+		// Like from_source_path, but the content of a directory is found later by scan_step ()
+		Q_ASSERT (transfer_status == Closed);
+		Q_ASSERT (get_type () == Invalid); // Should only be called once
+		QFileInfo path_info (QFileInfo (path).canonicalFilePath ());
+		if (!path_info.isDir ())
+			return from_source_path (path, ignore_hidden, filter); // Also reports errors
+		root_dir = path_info.dir ();
+		payload_root = path_info.fileName ();
+		scanner.reset (new Scanner (path_info.filePath (), ignore_hidden, filter, skipped));
+		manifest_complete = false;
+		return true;
+	}
+	bool scan_step (void) {
+		// Scan for at most Const::max_work_msec
+		Q_ASSERT (!manifest_complete && scanner);
+		auto payload_dir = get_payload_dir ();
+		QElapsedTimer timer;
+		timer.start ();
+		while (scanner->hasNext ()) {
+			QFileInfo entry (scanner->next ());
+			append_file (entry, payload_dir);
+			if (timer.elapsed () > Const::max_work_msec)
+				return true;
+		}
+		scanner.reset ();
+		if (files.empty ()) {
+			last_error = tr ("No file found in directory: %1").arg (get_payload_dir_path ());
+			return false;
+		}
+		manifest_complete = true;
+		return close_if_all_checksummed ();
+	}
+	bool is_manifest_complete (void) const { return manifest_complete; }
+
+	bool has_unannounced_files (void) const { return first_unannounced != files.end (); }
+	void set_all_announced (void) { first_unannounced = files.end (); }
+	ManifestPage take_manifest_page (void) {
+		ManifestPage page (first_unannounced, files.end ());
+		set_all_announced ();
+		return page;
+	}
+
+	// Pipelined scan (receiver)
+
+	bool receive_manifest_page (ManifestPage & page) {
+		if (manifest_complete) {
+			last_error = tr ("Manifest page after the end of the manifest");
+			return false;
+		}
+		if (page.received.empty ())
+			return true;
+		auto first_new = page.received.begin (); // Stays valid after splice
+		auto first_index = file_index.size ();
+		files.splice (files.end (), page.received);
+		for (auto it = first_new; it != files.end (); ++it)
+			add_to_index (it);
+		for (auto i = first_index; i < file_index.size (); ++i) {
+			auto & f = *file_index[i];
+			if (!f.validate_path () || f.get_size () < 0 || !is_valid_link (quint32 (i))) {
+				last_error = tr ("Invalid file in manifest page");
+				return false; // Transfer will be aborted, no need to remove files
+			}
+			total_size += f.get_size ();
+		}
+		move_end_iterators_to (first_new);
+		return true;
+	}
+	bool receive_manifest_end (qint64 announced_total_size) {
+		if (manifest_complete || files.empty () || announced_total_size != total_size) {
+			last_error = tr ("Invalid end of manifest");
+			return false;
+		}
+		manifest_complete = true;
+		return close_if_all_checksummed ();
+	}
+
 	// Import/export. File class is not movable nor copyable, so extra care is needed.
 
 	void to_stream (QDataStream & stream) const {
+		// Total size is -1 if the manifest is open-ended (scan in progress)
 		Q_ASSERT (get_type () != Invalid);
-		stream << payload_root << total_size << quint32 (files.size ());
+		stream << payload_root << (manifest_complete ? total_size : qint64 (-1))
+		       << quint32 (files.size ());
 		for (const auto & f : files)
 			stream << f;
 	}
@@ -367,9 +1148,18 @@ public:
 		quint32 c;
 		stream >> payload_root >> total_size >> c;
 		files.clear ();
+		file_index.clear ();
 		for (quint32 i = 0; i < c; ++i) {
 			files.emplace_back ();
 			stream >> files.back ();
+			add_to_index (std::prev (files.end ()));
+		}
+		if (total_size == -1) {
+			// Open-ended: total of files announced so far
+			manifest_complete = false;
+			total_size = 0;
+			for (auto & f : files)
+				total_size += f.get_size ();
 		}
 	}
 	bool validate (void) const {
@@ -377,10 +1167,13 @@ public:
 			return false;
 		if (payload_root.contains ("..") || payload_root.contains ('/') || payload_root.contains ('\\'))
 			return false;
-		if (files.empty ())
+		if (files.empty () && manifest_complete)
 			return false;
 		for (auto & f : files)
-			if (!f.validate_path ())
+			if (!f.validate_path () || f.get_size () < 0)
+				return false;
+		for (quint32 i = 0; i < quint32 (file_index.size ()); ++i)
+			if (!is_valid_link (i))
 				return false;
 		return true;
 	}
@@ -395,27 +1188,62 @@ public:
 		total_transfered = 0;
 		nb_files_transfered = 0;
 		current_file = next_file_to_checksum = files.begin ();
+		current_index = 0;
 	}
 
 	void stop_transfer (void) {
+		close_range_files ();
+		if (inline_writer)
+			inline_writer->wait (); // Errors have been reported if the transfer was completed
 		if (current_file != files.end ())
 			current_file->close ();
+		if (resend_file != files.end ()) {
+			resend_file->close ();
+			resend_file = files.end ();
+		}
 		current_file = next_file_to_checksum = files.end ();
 		transfer_status = Closed;
 	}
 
 	bool is_transfer_complete (void) const {
 		// No specific marker for success, but this should catch all cases.
-		return transfer_status == Closed && last_error.isEmpty () && total_transfered == total_size;
+		return transfer_status == Closed && last_error.isEmpty () && total_transfered == total_size &&
+		       !has_pending_resend () && nb_pending_retries == 0 && manifest_complete;
+	}
+	bool has_unsent_files (void) const {
+		// Sender: files remain in the main stream (may be links, with no data)
+		return current_file != files.end ();
 	}
 
 	// Send / receive next chunk
 
+	void set_chunk_size (qint64 size) {
+		chunk_size = qBound (Const::chunk_size, size, Const::max_chunk_size);
+	}
+	qint64 get_chunk_size (void) const { return chunk_size; }
+
+	void set_cache_mode (CacheMode mode) { cache_mode = mode; }
+	void set_trace_id (quint32 transfer_id) { trace_id = transfer_id; } // Before adding files
+	quint32 get_current_index (void) const { return current_index; }
+	bool drops_cache (void) const {
+		if (cache_mode == CacheAuto) {
+			auto memory = physical_memory_size ();
+			return memory > 0 && total_size > memory;
+		}
+		return cache_mode == CacheDrop;
+	}
+
 	qint64 next_chunk_size (void) const {
-		// Chunk are all of size Const::chunk_size, except the last which is truncated
-		// 0 means no more to transfer
+		// Chunk are of size chunk_size, except before an inline file or at the end
+		// 0 means no chunk to send: end of data or inline files (see next_inline_batch)
 		Q_ASSERT (total_transfered <= total_size);
-		return qMin (Const::chunk_size, total_size - total_transfered);
+		qint64 size = 0;
+		for (auto it = current_file; it != files.end () && !it->is_inline (); ++it) {
+			size += it->is_open () ? it->get_remaining () : it->get_size ();
+			if (size >= chunk_size)
+				return chunk_size;
+		}
+		return size;
 	}
 
 	bool send_next_chunk (QDataStream & stream) {
@@ -425,8 +1253,13 @@ public:
 			Q_ASSERT (total_transfered <= total_size);
 			Q_ASSERT (nb_files_transfered <= get_nb_files ());
 			Q_ASSERT (current_file != files.end ()); // Should stop due to size test
-			if (!current_file->is_open () &&
-			    !current_file->open (get_payload_dir (), QIODevice::ReadOnly)) {
+			if (current_file->is_link ()) {
+				if (!pass_link ())
+					return false;
+				continue;
+			}
+			Q_ASSERT (!current_file->is_inline ()); // Should stop due to size computation
+			if (!current_file->is_open () && !open_streamed (*current_file, QIODevice::ReadOnly)) {
 				transfer_error (current_file->get_last_error ());
 				return false;
 			}
@@ -441,14 +1274,107 @@ public:
 			if (current_file->at_end ()) {
 				current_file->close ();
 				current_file++;
+				current_index++;
 			}
 		}
-		if (total_transfered == total_size)
-			Q_ASSERT (current_file == files.end ());
+		return true;
+	}
+	bool skip_links (void) {
+		// Pass links at the current position (created by the receiver)
+		while (current_file != files.end () && current_file->is_link ())
+			if (!pass_link ())
+				return false;
+		return true;
+	}
+
+	// Inline batches
+
+	InlineBatch next_inline_batch (void) const {
+		// Inline files at the current position, up to the batch limits. 0 files if none.
+		InlineBatch batch{0, 0};
+		for (auto it = current_file; it != files.end () && it->is_inline (); ++it) {
+			if (batch.nb_files == quint32 (Const::inline_batch_max_files) ||
+			    batch.data_size + it->get_size () > Const::inline_batch_size)
+				break;
+			++batch.nb_files;
+			batch.data_size += it->get_size ();
+		}
+		return batch;
+	}
+	bool send_inline_batch (QDataStream & stream, const InlineBatch & batch) {
+		// Content: quint32(nb_files), raw data of files, Checksum(data)
+		Q_ASSERT (transfer_status == Sending);
+		QByteArray data;
+		data.reserve (int(batch.data_size));
+		for (quint32 i = 0; i < batch.nb_files; ++i, ++current_file, ++current_index) {
+			Q_ASSERT (current_file != files.end () && current_file->is_inline ());
+			if (!current_file->read_inline (get_payload_dir (), data)) {
+				transfer_error (current_file->get_last_error ());
+				return false;
+			}
+		}
+		Q_ASSERT (data.size () == batch.data_size);
+		stream << batch.nb_files;
+		if (stream.writeRawData (data.constData (), data.size ()) != data.size ()) {
+			transfer_error (
+			    tr ("Unable to send data to socket: %1").arg (stream.device ()->errorString ()));
+			return false;
+		}
+		stream << QCryptographicHash::hash (data, Const::hash_algorithm);
+		total_transfered += batch.data_size;
+		return true;
+	}
+
+	qint64 inline_batch_data_size (quint32 nb_files) const {
+		// Receiver: data size of a batch, or -1 if the next files cannot be in a batch
+		if (nb_files == 0 || nb_files > quint32 (Const::inline_batch_max_files))
+			return -1;
+		qint64 data_size = 0;
+		auto it = current_file;
+		for (quint32 i = 0; i < nb_files; ++i, ++it) {
+			if (it == files.end () || !it->is_inline ())
+				return -1;
+			data_size += it->get_size ();
+		}
+		return data_size <= Const::inline_batch_size ? data_size : -1;
+	}
+	bool receive_inline_batch (QDataStream & stream, quint32 nb_files, qint64 data_size) {
+		// Size must come from inline_batch_data_size (nb_files), and links must be skipped
+		Q_ASSERT (transfer_status == Receiving);
+		Q_ASSERT (resend_file == files.end ());
+		QByteArray data (int(data_size), Qt::Uninitialized);
+		Checksum checksum;
+		if (stream.readRawData (data.data (), data.size ()) != data.size ()) {
+			transfer_error (
+			    tr ("Unable to receive data from socket: %1").arg (stream.device ()->errorString ()));
+			return false;
+		}
+		stream >> checksum;
+		if (QCryptographicHash::hash (data, Const::hash_algorithm) == checksum) {
+			if (!inline_writer)
+				inline_writer.reset (new InlineWriter);
+			auto payload_dir = get_payload_dir ();
+			int offset = 0;
+			for (quint32 i = 0; i < nb_files; ++i, ++current_file, ++current_index) {
+				auto size = int(current_file->get_size ());
+				inline_writer->add_file (payload_dir.filePath (current_file->get_relative_path ()),
+				                         offset, size);
+				offset += size;
+			}
+			inline_writer->write_batch (data);
+		} else {
+			// Nothing is written: all files will be received again
+			for (quint32 i = 0; i < nb_files; ++i, ++current_file, ++current_index)
+				if (!request_retry (*current_file, current_index))
+					return false;
+		}
+		total_transfered += data_size;
 		return true;
 	}
 
 	bool receive_chunk (QDataStream & stream, qint64 chunk_size) {
+		if (resend_file != files.end ())
+			return receive_chunk_again (stream, chunk_size);
 		Q_ASSERT (transfer_status == Receiving);
 		if (chunk_size > (total_size - total_transfered)) {
 			transfer_error (tr ("Chunk goes past the end of transfer"));
@@ -458,8 +1384,16 @@ public:
 		while (bytes_to_receive > 0) {
 			Q_ASSERT (total_transfered <= total_size);
 			Q_ASSERT (current_file != files.end ()); // Should stop due to size test
-			if (!current_file->is_open () &&
-			    !current_file->open (get_payload_dir (), QIODevice::ReadWrite)) {
+			if (current_file->is_link ()) {
+				if (!pass_link ())
+					return false;
+				continue;
+			}
+			if (current_file->is_inline ()) {
+				transfer_error (tr ("Chunk goes into a file that should be in an inline batch"));
+				return false;
+			}
+			if (!current_file->is_open () && !open_streamed (*current_file, QIODevice::ReadWrite)) {
 				transfer_error (current_file->get_last_error ());
 				return false;
 			}
@@ -474,54 +1408,695 @@ public:
 			if (current_file->at_end ()) {
 				current_file->close ();
 				current_file++;
+				current_index++;
 			}
 		}
-		if (total_transfered == total_size)
-			Q_ASSERT (current_file == files.end ());
 		return true;
 	}
 
 	// Checksums
 
-	ChecksumList take_pending_checksums (void) {
-		ChecksumList checksums;
+	int get_nb_pending_checksums (void) const {
+		// Sender: files processed since the last take (some may have no checksum)
+		return int(current_index) - nb_files_transfered;
+	}
+	void take_pending_checksums (ChecksumList & checksums) {
 		// We can only send checksums if files have been processed
+		checksums.reset (quint32 (nb_files_transfered));
 		for (; next_file_to_checksum != current_file; ++next_file_to_checksum) {
-			checksums.append (next_file_to_checksum->get_checksum ());
+			checksums.add_file (*next_file_to_checksum);
 			++nb_files_transfered;
 		}
-		if (next_file_to_checksum == files.end ()) {
-			Q_ASSERT (nb_files_transfered == get_nb_files ());
-			Q_ASSERT (total_transfered == total_size);
-			stop_transfer (); // Close the transfer
-		}
-		return checksums;
+		close_if_all_checksummed ();
 	}
 
 	bool test_checksums (const ChecksumList & checksums) {
 		// Test checksums against files (must have been processed before)
-		for (const auto & checksum : checksums) {
+		if (resend_file != files.end ())
+			return test_checksum_again (checksums);
+		if (!skip_links ())
+			return false;
+		if (checksums.get_first_file () != quint32 (nb_files_transfered)) {
+			transfer_error (tr ("Received checksums out of order."));
+			return false;
+		}
+		int next_digest = 0;
+		for (quint32 i = 0; i < checksums.get_nb_files (); ++i) {
 			if (next_file_to_checksum == current_file) {
 				transfer_error (tr ("Received checksum of incomplete file."));
 				return false;
 			}
-			if (!next_file_to_checksum->test_checksum (checksum)) {
-				last_error = next_file_to_checksum->get_last_error ();
-				return false;
+			if (next_file_to_checksum->has_own_checksum ()) {
+				if (next_digest == checksums.size ()) {
+					transfer_error (tr ("Missing checksum of file %1").arg (nb_files_transfered));
+					return false;
+				}
+				auto match = next_file_to_checksum->test_checksum (checksums.at (next_digest++));
+				LOCALSHARE_TRACE (checksum, trace_id, nb_files_transfered, match);
+				EventLog::record (EventLog::ChecksumChecked, trace_id, nb_files_transfered, match);
+				if (!match && !request_retry (*next_file_to_checksum, quint32 (nb_files_transfered)))
+					return false;
 			}
 			++next_file_to_checksum;
 			++nb_files_transfered;
 		}
-		if (next_file_to_checksum == files.end ()) {
-			Q_ASSERT (nb_files_transfered == get_nb_files ());
+		if (next_digest != checksums.size ()) {
+			transfer_error (tr ("Received checksums of files that have none."));
+			return false;
+		}
+		return close_if_all_checksummed ();
+	}
+
+	// Retries: sender side
+
+	bool queue_resend (quint32 index) {
+		// Checksums are grouped: a file may be retried before its checksum is sent (inline batch)
+		if (index >= current_index || file_at (index)->is_link ()) {
+			last_error = tr ("Retry requested for a file that was not sent");
+			return false;
+		}
+		resend_queue.push_back (index);
+		return true;
+	}
+	bool has_pending_resend (void) const {
+		return resend_file != files.end () || !resend_queue.empty ();
+	}
+	bool is_resending (void) const { return resend_file != files.end (); }
+	bool start_resend (quint32 & index) {
+		Q_ASSERT (!is_resending ());
+		Q_ASSERT (!resend_queue.empty ());
+		index = resend_queue.front ();
+		resend_queue.pop_front ();
+		resend_file = file_at (index);
+		resend_index = index;
+		if (!open_streamed (*resend_file, QIODevice::ReadOnly)) {
+			last_error = resend_file->get_last_error ();
+			resend_file->close ();
+			resend_file = files.end ();
+			return false;
+		}
+		return true;
+	}
+	qint64 next_resend_chunk_size (void) const {
+		// 0 means that the file has been sent, and its checksum can be taken
+		Q_ASSERT (is_resending ());
+		return qMin (chunk_size, resend_file->get_remaining ());
+	}
+	bool send_resend_chunk (QDataStream & stream) {
+		Q_ASSERT (is_resending ());
+		if (resend_file->read_data (stream, next_resend_chunk_size ()) == -1) {
+			last_error = tr ("Unable to send data to socket: %1").arg (stream.device ()->errorString ());
+			return false;
+		}
+		return true;
+	}
+	void take_resend_checksum (ChecksumList & checksums) {
+		Q_ASSERT (is_resending () && resend_file->at_end ());
+		checksums.reset (resend_index);
+		checksums.add_resent_file (*resend_file);
+		resend_file->close ();
+		resend_file = files.end ();
+	}
+
+	// Retries: receiver side
+
+	std::vector<quint32> take_retry_requests (void) {
+		std::vector<quint32> requests;
+		requests.swap (retry_requests);
+		return requests;
+	}
+	bool receive_again (quint32 index) {
+		if (is_resending () || index >= quint32 (get_nb_files ()) ||
+		    !file_at (index)->is_waiting_for_retry ()) {
+			last_error = tr ("Unexpected resend of file %1").arg (index);
+			return false;
+		}
+		resend_file = file_at (index);
+		resend_index = index;
+		if (!open_streamed (*resend_file, QIODevice::ReadWrite)) {
+			last_error = resend_file->get_last_error ();
+			resend_file->close ();
+			resend_file = files.end ();
+			return false;
+		}
+		return true;
+	}
+
+	/* Same host copy.
+	 * The sender gives its payload dir, and the identity and scan time of each file.
+	 * The receiver checks that it sees the same first file before copying from there.
+	 * Then each file is checked before and after its copy: a different file, or a file changed
+	 * since the offer (or during the copy), fails the transfer instead of giving a wrong copy.
+	 * No data goes through our process, so there is no checksum to test.
+	 * A complete copy closes the transfer.
+	 */
+
+	SourceIdentities get_source_identities (void) const {
+		auto payload_dir = get_payload_dir ();
+		SourceIdentities ids;
+		ids.entries.reserve (file_index.size ());
+		for (auto it : file_index) {
+			if (it->is_link ())
+				ids.entries.push_back ({FileIdentity (), 0});
+			else
+				ids.entries.push_back ({file_identity (payload_dir.filePath (it->get_relative_path ())),
+				                        it->get_last_modified ().toMSecsSinceEpoch ()});
+		}
+		return ids;
+	}
+	bool set_copy_source (const QDir & source_dir, SourceIdentities ids) {
+		/* Returns false if the source cannot be used (copy is then done through the network).
+		 * Every file must be the one the sender saw, and readable by us: files of another user
+		 * are often private, and a copy failing in the middle would fail the transfer.
+		 */
+		if (ids.entries.size () != file_index.size ())
+			return false;
+		copy_source_dir = source_dir;
+		copy_source_ids = std::move (ids);
+		for (quint32 i = 0; i < quint32 (file_index.size ()); ++i) {
+			auto & file = *file_index[i];
+			if (file.is_link ())
+				continue;
+			if (!is_same_copy_source (i) ||
+			    !QFileInfo (copy_source_dir.filePath (file.get_relative_path ())).isReadable ())
+				return false;
+		}
+		return true;
+	}
+
+	bool receive_local_copy (void) {
+		// Copy at most Const::local_copy_step bytes
+		Q_ASSERT (transfer_status == Receiving);
+		auto bytes_to_copy = Const::local_copy_step;
+		while (bytes_to_copy > 0 && current_file != files.end ()) {
+			if (current_file->is_link ()) {
+				if (!pass_link ())
+					return false;
+				next_file_to_checksum = current_file; // Not checked
+				++nb_files_transfered;
+				continue;
+			}
+			if (!current_file->is_open ()) {
+				if (!is_same_copy_source (current_index)) {
+					transfer_error (tr ("File %1 has changed").arg (current_file->get_relative_path ()));
+					return false;
+				}
+				if (!current_file->open_copy (get_payload_dir (), copy_source_dir)) {
+					transfer_error (current_file->get_last_error ());
+					return false;
+				}
+			}
+			auto copied = current_file->copy_data (bytes_to_copy);
+			if (copied == -1) {
+				transfer_error (current_file->get_last_error ());
+				return false;
+			}
+			bytes_to_copy -= copied;
+			total_transfered += copied;
+			if (current_file->at_end ()) {
+				current_file->close ();
+				if (!is_same_copy_source (current_index)) {
+					transfer_error (
+					    tr ("File %1 changed during the copy").arg (current_file->get_relative_path ()));
+					return false;
+				}
+				current_file++;
+				current_index++;
+				next_file_to_checksum = current_file; // Not checked
+				++nb_files_transfered;
+			}
+		}
+		if (current_file == files.end ()) {
 			Q_ASSERT (total_transfered == total_size);
-			stop_transfer (); // Close the transfer
+			stop_transfer ();
 		}
 		return true;
 	}
 
+	// Random access
+
+	void copy_manifest (const Manager & other) {
+		// Receiver of a pull: same files, to be written in our root dir
+		Q_ASSERT (transfer_status == Closed);
+		Q_ASSERT (get_type () == Invalid);
+		payload_root = other.payload_root;
+		total_size = other.total_size;
+		for (auto & f : other.files) {
+			files.emplace_back (f.get_relative_path (), f.get_size ());
+			if (f.is_link ())
+				files.back ().set_link (f.get_link_target (), f.get_logical_size ());
+			add_to_index (std::prev (files.end ()));
+		}
+	}
+	bool has_same_manifest (const Manager & other) const {
+		auto same_file = [](const File & a, const File & b) {
+			return a.get_relative_path () == b.get_relative_path () && a.get_size () == b.get_size () &&
+			       a.get_link_target () == b.get_link_target ();
+		};
+		return payload_root == other.payload_root && total_size == other.total_size &&
+		       files.size () == other.files.size () &&
+		       std::equal (files.begin (), files.end (), other.files.begin (), same_file);
+	}
+
+	void start_random_access (Mode mode) {
+		start_transfer (mode);
+		file_offsets.clear ();
+		qint64 offset = 0;
+		for (auto it : file_index) {
+			file_offsets.push_back (offset);
+			offset += it->get_size ();
+		}
+	}
+	bool transfer_range (QDataStream & stream, qint64 offset, qint64 length) {
+		// Read (Sending) or write (Receiving) a range of data
+		Q_ASSERT (transfer_status != Closed);
+		if (offset < 0 || length < 0 || offset > total_size - length) {
+			last_error = tr ("Range is out of the payload");
+			return false;
+		}
+		while (length > 0) {
+			auto index = file_index_at (offset);
+			auto & file = *file_index[index];
+			auto file_offset = offset - file_offsets[index];
+			auto bytes = qMin (length, file.get_size () - file_offset);
+			if (!open_range_file (file))
+				return false;
+			auto done = transfer_status == Sending ? file.read_at (stream, file_offset, bytes)
+			                                       : file.write_at (stream, file_offset, bytes);
+			if (done != bytes) {
+				last_error = tr ("Unable to transfer data of file %1: %2")
+				                 .arg (file.get_relative_path (), stream.device ()->errorString ());
+				return false;
+			}
+			offset += bytes;
+			length -= bytes;
+			if (transfer_status == Receiving)
+				total_transfered += bytes;
+		}
+		return true;
+	}
+	void discard_range_progress (qint64 bytes) {
+		// Received data that will be requested again (from another source)
+		total_transfered -= bytes;
+	}
+	std::pair<qint64, qint64> get_file_range (quint32 index) const {
+		return {file_offsets[index], file_index[index]->get_size ()};
+	}
+
+	void start_hashing (void) {
+		// Hash all files from disk, or only those that were retried
+		close_range_files ();
+		if (file_checksums.empty ()) {
+			for (int i = 0; i < get_nb_files (); ++i)
+				hash_queue.push_back (quint32 (i));
+			file_checksums.reset_all (quint32 (get_nb_files ()));
+		} else {
+			for (int i = 0; i < get_nb_files (); ++i)
+				if (file_index[i]->is_waiting_for_retry ())
+					hash_queue.push_back (quint32 (i));
+		}
+	}
+	bool hash_step (const ChecksumList * expected = nullptr) {
+		// Hash for at most Const::max_work_msec. Compares to expected if given.
+		Q_ASSERT (file_index.size () == files.size ());
+		QElapsedTimer timer;
+		timer.start ();
+		while (!hash_queue.empty ()) {
+			auto index = hash_queue.front ();
+			auto & file = *file_index[index];
+			if (is_multi_hashed (file)) {
+				if (!hash_small_files (expected))
+					return false;
+				if (timer.elapsed () > Const::max_work_msec)
+					return true;
+				continue;
+			}
+			if (file.is_link ()) {
+				// No data: the receiver creates it now that all targets are complete
+				if (transfer_status == Receiving &&
+				    !file.create_link (get_payload_dir (), *file_index[file.get_link_target ()])) {
+					transfer_error (file.get_last_error ());
+					return false;
+				}
+			} else {
+				if (!file.is_open () && !file.open_hashing (get_payload_dir ())) {
+					transfer_error (file.get_last_error ());
+					return false;
+				}
+				while (!file.at_end ()) {
+					if (file.hash_data (Const::local_copy_buffer_size) == -1) {
+						transfer_error (file.get_last_error ());
+						return false;
+					}
+					if (timer.elapsed () > Const::max_work_msec)
+						return true;
+				}
+				file.close ();
+			}
+			hash_queue.pop_front ();
+			file.get_checksum (file_checksums.digest_at (int(index)));
+			if (expected != nullptr &&
+			    !check_hashed_file (file, index, *expected, file_checksums.at (int(index))))
+				return false;
+		}
+		return true;
+	}
+	bool is_hashing_done (void) const { return hash_queue.empty (); }
+	static bool is_multi_hashed (const File & file) {
+		return !file.is_link () && !file.is_open () &&
+		       file.get_size () <= Const::multi_hash_max_file_size;
+	}
+	bool hash_small_files (const ChecksumList * expected) {
+		/* Next small files of the queue hashed together, one per SIMD lane (see Md5::hash_many).
+		 * Most of the time of many small files payloads was spent in MD5, one file at a time.
+		 */
+		static_assert (Const::hash_algorithm == QCryptographicHash::Md5, "Md5 hash_many is MD5");
+		std::vector<quint32> indexes;
+		std::vector<QByteArray> contents;
+		qint64 batch_size = 0;
+		for (auto index : hash_queue) {
+			auto & file = *file_index[index];
+			if (!is_multi_hashed (file) || batch_size >= Const::multi_hash_batch_size)
+				break;
+			contents.emplace_back ();
+			if (!file.read_for_hashing (get_payload_dir (), contents.back ())) {
+				transfer_error (file.get_last_error ());
+				return false;
+			}
+			indexes.push_back (index);
+			batch_size += file.get_size ();
+		}
+		std::vector<const char *> data;
+		std::vector<qint64> sizes;
+		for (auto & content : contents) {
+			data.push_back (content.constData ());
+			sizes.push_back (content.size ());
+		}
+		QByteArray digests (int(indexes.size ()) * Md5::digest_size, Qt::Uninitialized);
+		Md5::hash_many (data.data (), sizes.data (), int(indexes.size ()), digests.data ());
+		for (std::size_t i = 0; i < indexes.size (); ++i) {
+			auto index = indexes[i];
+			auto digest = digests.constData () + i * Md5::digest_size;
+			hash_queue.pop_front ();
+			file_checksums.set (int(index), digest);
+			auto & file = *file_index[index];
+			if (expected != nullptr && !check_hashed_file (file, index, *expected, digest))
+				return false;
+		}
+		return true;
+	}
+	const ChecksumList & get_file_checksums (void) const { return file_checksums; }
+	void finish_random_access (void) {
+		Q_ASSERT (is_hashing_done () && nb_pending_retries == 0);
+		stop_transfer ();
+	}
+
+	/* Sender of a fan-out upload: the main stream comes from a shared producer.
+	 * Progress follows the frames given to the socket, so that retries of sent files are accepted.
+	 * At the end of the main stream, only resends are left.
+	 */
+	void set_shared_progress (qint64 transfered, quint32 nb_files_sent, int nb_files_checksummed) {
+		Q_ASSERT (transfer_status == Sending);
+		total_transfered = transfered;
+		current_index = nb_files_sent;
+		nb_files_transfered = nb_files_checksummed;
+	}
+	void end_shared_stream (void) {
+		Q_ASSERT (transfer_status == Sending);
+		Q_ASSERT (total_transfered == total_size);
+		stop_transfer (); // Checksums were all sent by the shared stream
+	}
+
+	/* Detached reader of a fan-out (too slow to share): the main stream continues from our files,
+	 * at the shared progress, which may be in the middle of a file.
+	 * The hashes of files sent since the last Checksums frame, and of the start of the current file,
+	 * were computed by the shared producer: resume_step () computes them again from disk.
+	 * Nothing can be sent until is_resuming () is false.
+	 */
+	void resume_main_stream (void) {
+		Q_ASSERT (transfer_status == Sending);
+		auto iterator_at = [this](quint32 index) {
+			return index < quint32 (get_nb_files ()) ? file_at (index) : files.end ();
+		};
+		current_file = iterator_at (current_index);
+		next_file_to_checksum = iterator_at (quint32 (nb_files_transfered));
+		resume_rehash = quint32 (nb_files_transfered);
+		qint64 offset = 0; // Of current_file in the concatenated data
+		for (quint32 i = 0; i < current_index; ++i)
+			offset += file_index[i]->get_size ();
+		resume_skip = total_transfered - offset;
+		Q_ASSERT (resume_skip == 0 || current_file != files.end ());
+	}
+	bool is_resuming (void) const { return resume_rehash < current_index || resume_skip > 0; }
+	bool resume_step (void) {
+		// Hash for at most Const::max_work_msec
+		QElapsedTimer timer;
+		timer.start ();
+		for (; resume_rehash < current_index; ++resume_rehash) {
+			auto & file = *file_at (resume_rehash);
+			if (!file.has_own_checksum ())
+				continue;
+			if (!file.is_open () && !file.open_hashing (get_payload_dir ())) {
+				transfer_error (file.get_last_error ());
+				return false;
+			}
+			while (!file.at_end ()) {
+				if (file.hash_data (Const::local_copy_buffer_size) == -1) {
+					transfer_error (file.get_last_error ());
+					return false;
+				}
+				if (timer.elapsed () > Const::max_work_msec)
+					return true;
+			}
+			file.close ();
+		}
+		if (resume_skip > 0) {
+			// Opening checks that the file did not change since the start of the stream
+			if (!current_file->is_open () && !open_streamed (*current_file, QIODevice::ReadOnly)) {
+				transfer_error (current_file->get_last_error ());
+				return false;
+			}
+			while (resume_skip > 0) {
+				resume_skip -= current_file->skip_data (qMin (resume_skip, Const::local_copy_buffer_size));
+				if (timer.elapsed () > Const::max_work_msec)
+					return true;
+			}
+		}
+		return true;
+	}
+
+	void set_copied_by_peer (void) {
+		// Sender side of a same host copy: the receiver did everything
+		Q_ASSERT (transfer_status == Closed);
+		total_transfered = total_size;
+		nb_files_transfered = get_nb_files ();
+	}
+
 private:
 	QDir get_payload_dir (void) const { return QDir (root_dir.filePath (payload_root)); }
+	bool open_streamed (File & file, QIODevice::OpenMode mode) {
+		file.set_drop_cache (drops_cache ());
+		return file.open (get_payload_dir (), mode);
+	}
+
+	void append_file (const QFileInfo & entry, const QDir & payload_dir) {
+		files.emplace_back (entry, payload_dir);
+		auto added = std::prev (files.end ());
+		find_hard_link (*added, entry);
+		add_to_index (added);
+		total_size += added->get_size ();
+		if (first_unannounced == files.end ())
+			first_unannounced = added;
+		move_end_iterators_to (added);
+	}
+	void move_end_iterators_to (FileList::iterator first_new) {
+		// Progress iterators at end () must point to files appended during a transfer
+		if (transfer_status == Closed)
+			return;
+		if (current_file == files.end ())
+			current_file = first_new;
+		if (next_file_to_checksum == files.end ())
+			next_file_to_checksum = first_new;
+	}
+	void add_to_index (FileList::iterator it) {
+		it->set_trace (trace_id, quint32 (file_index.size ()));
+		file_index.push_back (it);
+		logical_size += it->get_logical_size ();
+		if (it->is_link ())
+			++nb_links;
+	}
+
+	/* Hard links: paths of the same inode are sent as links to the first one.
+	 * Only the first path carries data; the receiver recreates the others as links.
+	 */
+	void find_hard_link (File & file, const QFileInfo & entry) {
+		if (entry.size () == 0)
+			return; // Nothing to save
+		auto id = file_identity (entry.filePath ());
+		if (!id.is_valid () || id.nb_links < 2)
+			return;
+		auto key = qMakePair (id.device, id.inode);
+		auto it = inodes.constFind (key);
+		if (it == inodes.constEnd ())
+			inodes.insert (key, quint32 (file_index.size ())); // Index of file, added next
+		else
+			file.set_link (it.value (), entry.size ());
+	}
+	bool is_valid_link (quint32 index) const {
+		// A link must follow its target, which carries its data
+		auto & f = *file_index[index];
+		if (!f.is_link ())
+			return true;
+		if (f.get_link_target () >= index)
+			return false;
+		auto & target = *file_index[f.get_link_target ()];
+		return !target.is_link () && target.get_size () > 0 &&
+		       target.get_size () == f.get_logical_size ();
+	}
+	bool pass_link (void) {
+		// Links have no data: the receiver creates them when passing them in the stream
+		Q_ASSERT (current_file->is_link ());
+		if (transfer_status == Receiving) {
+			auto & target = *file_index[current_file->get_link_target ()];
+			if (target.is_inline () && !wait_inline_writes ())
+				return false; // Target may not be written yet
+			if (!current_file->create_link (get_payload_dir (), target)) {
+				transfer_error (current_file->get_last_error ());
+				return false;
+			}
+		}
+		++current_file;
+		++current_index;
+		return true;
+	}
+
+	bool wait_inline_writes (void) {
+		if (!inline_writer)
+			return true;
+		auto error = inline_writer->wait ();
+		if (!error.isEmpty ()) {
+			transfer_error (error);
+			return false;
+		}
+		return true;
+	}
+
+	std::size_t file_index_at (qint64 offset) const {
+		// Last file starting at or before offset: skips empty files at this offset
+		auto it = std::upper_bound (file_offsets.begin (), file_offsets.end (), offset);
+		return std::size_t (std::distance (file_offsets.begin (), it)) - 1;
+	}
+	bool open_range_file (File & file) {
+		if (file.is_open ())
+			return true;
+		auto mode = transfer_status == Sending ? QIODevice::ReadOnly : QIODevice::ReadWrite;
+		if (!file.open (get_payload_dir (), mode)) {
+			last_error = file.get_last_error ();
+			file.close ();
+			return false;
+		}
+		open_range_files.push_back (&file);
+		if (open_range_files.size () > std::size_t (Const::max_open_range_files)) {
+			open_range_files.front ()->close ();
+			open_range_files.pop_front ();
+		}
+		return true;
+	}
+	void close_range_files (void) {
+		for (auto f : open_range_files)
+			f->close ();
+		open_range_files.clear ();
+	}
+	bool check_hashed_file (File & file, quint32 index, const ChecksumList & expected,
+	                        const char * digest) {
+		if (file.is_waiting_for_retry ()) {
+			file.retry_done ();
+			--nb_pending_retries;
+		}
+		auto match = file.test_checksum (expected.at (int(index)), digest);
+		LOCALSHARE_TRACE (checksum, trace_id, index, match);
+		EventLog::record (EventLog::ChecksumChecked, trace_id, index, match);
+		if (match) {
+			++nb_files_transfered;
+			return true;
+		}
+		return request_retry (file, index);
+	}
+
+	bool close_if_all_checksummed (void) {
+		// Fails if inline files could not be written
+		if (transfer_status != Closed && manifest_complete && next_file_to_checksum == files.end ()) {
+			Q_ASSERT (nb_files_transfered == get_nb_files ());
+			Q_ASSERT (total_transfered == total_size);
+			if (!wait_inline_writes ())
+				return false;
+			stop_transfer (); // Close the transfer
+		}
+		return true;
+	}
+
+	FileList::iterator file_at (quint32 index) {
+		Q_ASSERT (index < quint32 (get_nb_files ()));
+		return file_index[index];
+	}
+
+	bool is_same_copy_source (quint32 index) const {
+		// Same file as the sender saw, unchanged since its scan
+		auto & file = *file_index[index];
+		auto & entry = copy_source_ids.entries[index];
+		auto path = copy_source_dir.filePath (file.get_relative_path ());
+		auto identity = file_identity (path);
+		QFileInfo info (path);
+		return identity.is_valid () && identity == entry.identity && info.size () == file.get_size () &&
+		       info.lastModified ().toMSecsSinceEpoch () == entry.last_modified;
+	}
+
+	bool request_retry (File & file, quint32 index) {
+		if (!file.request_retry ()) {
+			last_error = file.get_last_error ();
+			return false;
+		}
+		retry_requests.push_back (index);
+		++nb_pending_retries;
+		return true;
+	}
+
+	bool receive_chunk_again (QDataStream & stream, qint64 chunk_size) {
+		if (chunk_size > resend_file->get_remaining ()) {
+			last_error = tr ("Chunk goes past the end of resent file");
+			return false;
+		}
+		while (chunk_size > 0) {
+			auto received = resend_file->write_data (stream, chunk_size);
+			if (received <= 0) {
+				last_error =
+				    tr ("Unable to receive data from socket: %1").arg (stream.device ()->errorString ());
+				return false;
+			}
+			chunk_size -= received;
+		}
+		return true;
+	}
+	bool test_checksum_again (const ChecksumList & checksums) {
+		if (checksums.get_first_file () != resend_index || checksums.get_nb_files () != 1 ||
+		    checksums.size () != 1 || !resend_file->at_end ()) {
+			last_error = tr ("Received checksum of incomplete resent file.");
+			return false;
+		}
+		auto file = resend_file;
+		file->close ();
+		resend_file = files.end ();
+		--nb_pending_retries;
+		auto match = file->test_checksum (checksums.at (0));
+		LOCALSHARE_TRACE (checksum, trace_id, resend_index, match);
+		EventLog::record (EventLog::ChecksumChecked, trace_id, resend_index, match);
+		if (match) {
+			file->retry_done ();
+			return true;
+		} else {
+			return request_retry (*file, resend_index);
+		}
+	}
 
 	void transfer_error (const QString & why) {
 		last_error = why;
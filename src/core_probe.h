@@ -0,0 +1,158 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_PROBE_H
+#define CORE_PROBE_H
+
+#include <QHostAddress>
+#include <QTcpSocket>
+
+#include "core_profile.h"
+#include "core_transfer.h"
+
+namespace Transfer {
+
+/* Prober: measures the link to a downloader, without transferring anything.
+ * The downloader answers the probe, then the connection is closed with Completed.
+ * The result is stored in settings like the probes of uploads.
+ */
+class Prober : public Base {
+	Q_OBJECT
+
+public:
+	enum Status { Error, Init, Starting, Probing, Completed };
+
+private:
+	Status status{Init};
+
+signals:
+	void status_changed (Status new_status, Status old_status);
+
+public:
+	Prober (const QString & peer_username, QObject * parent = nullptr)
+	    : Base (new QTcpSocket, peer_username, parent) {
+		QObject::connect (this, &Base::failed, [this] { set_status (Error); });
+	}
+
+	void connect (const QHostAddress & address, quint16 port) {
+		Q_ASSERT (status == Init);
+		open_connection (address, port);
+		set_status (Starting);
+	}
+
+	Status get_status (void) const { return status; }
+
+private:
+	void set_status (Status new_status) {
+		auto old = status;
+		status = new_status;
+		emit status_changed (new_status, old);
+	}
+
+	void on_handshake_completed (void) Q_DECL_OVERRIDE {
+		Q_ASSERT (status == Starting);
+		if (!get_capabilities ().has (Capabilities::LinkProbe)) {
+			failure (tr ("Peer does not answer link probes"));
+			return;
+		}
+		set_status (Probing);
+		start_probe ();
+	}
+	void on_probe_completed (void) Q_DECL_OVERRIDE {
+		Q_ASSERT (status == Probing);
+		if (!send_code_message (Message::Completed))
+			return;
+		close_connection ();
+		set_status (Completed);
+	}
+
+	bool on_receive_accept (void) Q_DECL_OVERRIDE {
+		protocol_error ("Accept in Prober");
+		return false;
+	}
+	bool on_receive_reject (void) Q_DECL_OVERRIDE {
+		protocol_error ("Reject in Prober");
+		return false;
+	}
+	bool on_receive_completed (void) Q_DECL_OVERRIDE {
+		protocol_error ("Completed in Prober");
+		return false;
+	}
+	bool on_receive_local_accept (void) Q_DECL_OVERRIDE {
+		protocol_error ("LocalAccept in Prober");
+		return false;
+	}
+	bool on_receive_pull_request (void) Q_DECL_OVERRIDE {
+		protocol_error ("PullRequest in Prober");
+		return false;
+	}
+	bool on_receive_offer (void) Q_DECL_OVERRIDE {
+		protocol_error ("Offer in Prober");
+		return false;
+	}
+	bool on_receive_chunk (void) Q_DECL_OVERRIDE {
+		protocol_error ("Chunk in Prober");
+		return false;
+	}
+	bool on_receive_checksums (void) Q_DECL_OVERRIDE {
+		protocol_error ("Checksums in Prober");
+		return false;
+	}
+	bool on_receive_local_source (void) Q_DECL_OVERRIDE {
+		protocol_error ("LocalSource in Prober");
+		return false;
+	}
+	bool on_receive_retry (void) Q_DECL_OVERRIDE {
+		protocol_error ("Retry in Prober");
+		return false;
+	}
+	bool on_receive_resend (void) Q_DECL_OVERRIDE {
+		protocol_error ("Resend in Prober");
+		return false;
+	}
+	bool on_receive_ack (void) Q_DECL_OVERRIDE {
+		protocol_error ("Ack in Prober");
+		return false;
+	}
+	bool on_receive_manifest (void) Q_DECL_OVERRIDE {
+		protocol_error ("Manifest in Prober");
+		return false;
+	}
+	bool on_receive_manifest_end (void) Q_DECL_OVERRIDE {
+		protocol_error ("ManifestEnd in Prober");
+		return false;
+	}
+	bool on_receive_range_request (void) Q_DECL_OVERRIDE {
+		protocol_error ("RangeRequest in Prober");
+		return false;
+	}
+	bool on_receive_range (void) Q_DECL_OVERRIDE {
+		protocol_error ("Range in Prober");
+		return false;
+	}
+	bool on_receive_inline_batch (void) Q_DECL_OVERRIDE {
+		protocol_error ("InlineBatch in Prober");
+		return false;
+	}
+	bool on_receive_queued (void) Q_DECL_OVERRIDE {
+		protocol_error ("Queued in Prober");
+		return false;
+	}
+};
+}
+
+#endif
@@ -0,0 +1,163 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_PROFILE_H
+#define CORE_PROFILE_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QString>
+#include <QStringList>
+
+#include "core_localshare.h"
+#include "core_settings.h"
+
+namespace Transfer {
+
+/* Network behaviour of a transfer, chosen per transfer.
+ *
+ * Without pacing, the sender refills the socket buffer in bursts whenever it drains.
+ * On shared switches, these bursts fill queues and add latency for other users.
+ * pacing_rate spreads sent data evenly in time: the kernel does it if possible (Linux).
+ * Otherwise the sender paces itself with a Pacer.
+ *
+ * congestion_control selects the TCP algorithm of the connection (Linux only, empty for default):
+ * - bbr for bulk transfers, it keeps queues short and handles losses better than cubic,
+ * - lp (TCP-LP) for background transfers, it yields to other traffic.
+ * Unavailable algorithms are ignored (the connection keeps the system default).
+ *
+ * dscp marks sent packets for routers and switches that prioritize traffic classes.
+ * Background transfers use CS1 (lower than best effort), in addition to TCP-LP.
+ */
+struct Profile {
+	QString name;
+	qint64 pacing_rate{0}; // Bytes per second, 0 for unlimited
+	QByteArray congestion_control;
+	int dscp{-1}; // DiffServ code point, -1 for system default
+
+	bool is_default (void) const {
+		return pacing_rate <= 0 && congestion_control.isEmpty () && dscp < 0;
+	}
+
+	// Predefined profiles, that options can then modify
+	static QStringList names (void) { return {"default", "bulk", "background"}; }
+	static bool from_name (const QString & name, Profile & profile) {
+		profile = Profile ();
+		profile.name = name;
+		if (name == "default")
+			return true;
+		if (name == "bulk") {
+			profile.congestion_control = "bbr";
+			return true;
+		}
+		if (name == "background") {
+			profile.congestion_control = "lp";
+			profile.dscp = Const::background_dscp;
+			return true;
+		}
+		return false;
+	}
+};
+
+/* Measured properties of the path to a peer (see Base::start_probe).
+ * They give the parameters of the sender:
+ * - the send window must cover the link for the round trip and while the event loop is busy,
+ * - chunks are larger on fast links (1ms of data), to reduce the per frame cost.
+ * Measurements are stored in settings per peer address and port, and reused for a while.
+ */
+struct LinkInfo {
+	qint64 rtt_usec{-1};
+	qint64 rate{-1}; // Bytes per second
+	bool cached{false};
+
+	bool is_valid (void) const { return rtt_usec >= 0 && rate > 0; }
+
+	qint64 send_window (void) const {
+		if (!is_valid ())
+			return Const::write_buffer_size;
+		auto covered_usec = rtt_usec + Const::max_work_msec * 1000;
+		return qBound (Const::write_buffer_size, rate * covered_usec / 1000000, Const::max_send_window);
+	}
+	qint64 chunk_size (void) const {
+		if (!is_valid ())
+			return Const::chunk_size;
+		return qBound (Const::chunk_size, rate / 1000, Const::max_chunk_size);
+	}
+
+	QString describe (void) const {
+		return QStringLiteral ("rtt %1ms, %2 Mbit/s%3")
+		    .arg (double(rtt_usec) / 1000., 0, 'f', 2)
+		    .arg (double(rate) * 8. / 1e6, 0, 'f', 1)
+		    .arg (cached ? QStringLiteral (" (cached)") : QString ());
+	}
+
+	static LinkInfo load (const QString & peer_key) {
+		LinkInfo info;
+		qint64 age_msec = 0;
+		if (!Settings::PeerLink (peer_key).get (info.rtt_usec, info.rate, age_msec) ||
+		    age_msec < 0 || age_msec > Const::link_info_max_age_msec)
+			return LinkInfo ();
+		info.cached = true;
+		return info;
+	}
+	void save (const QString & peer_key) const {
+		if (is_valid () && !cached)
+			Settings::PeerLink (peer_key).set (rtt_usec, rate);
+	}
+};
+
+/* Userspace pacing with a token bucket: data can be sent while there is credit.
+ * Credit grows at the pacing rate, up to one burst (Const::pacing_burst_msec of data).
+ */
+class Pacer {
+private:
+	qint64 rate{0}; // Bytes per second, 0 for disabled
+	qint64 credit{0};
+	QElapsedTimer clock;
+
+public:
+	void set_rate (qint64 bytes_per_sec) {
+		rate = qMax (bytes_per_sec, qint64 (0));
+		credit = burst ();
+		clock.start ();
+	}
+	bool is_enabled (void) const { return rate > 0; }
+
+	// Time to wait before sending more, 0 if allowed now
+	int wait_msec (void) {
+		if (rate <= 0)
+			return 0;
+		auto elapsed_usec = clock.nsecsElapsed () / 1000;
+		clock.start ();
+		credit = qMin (credit + rate * elapsed_usec / 1000000, burst ());
+		if (credit > 0)
+			return 0;
+		return int(-credit * 1000 / rate) + 1;
+	}
+	void consume (qint64 bytes) {
+		if (rate > 0)
+			credit -= bytes;
+	}
+
+private:
+	qint64 burst (void) const {
+		return qMax (rate * Const::pacing_burst_msec / 1000, Const::pacing_min_burst);
+	}
+};
+}
+
+#endif
@@ -0,0 +1,712 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_PULL_H
+#define CORE_PULL_H
+
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QTcpSocket>
+#include <QTimer>
+#include <algorithm>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "core_localshare.h"
+#include "core_payload.h"
+#include "core_transfer.h"
+#include "core_watchdog.h"
+
+namespace Transfer {
+
+/* Seed: serves ranges of a shared payload to a puller (server side connection).
+ * The payload is owned by a SeedServer, and must be hashed and in random access mode.
+ */
+class Seed : public Base {
+	Q_OBJECT
+
+public:
+	enum Status { Error, Starting, WaitingForRequest, Serving, Completed };
+
+private:
+	Status status{Starting};
+	Payload::Manager & source;
+	const QString our_username;
+
+signals:
+	void status_changed (Status new_status, Status old_status);
+
+public:
+	Seed (QAbstractSocket * socket, Payload::Manager & source, const QString & our_username,
+	      QObject * parent = nullptr)
+	    : Base (socket, parent), source (source), our_username (our_username) {
+		on_socket_connected ();
+		connect (this, &Base::failed, [this] { set_status (Error); });
+	}
+
+	Status get_status (void) const { return status; }
+
+private:
+	void set_status (Status new_status) {
+		auto old = status;
+		status = new_status;
+		emit status_changed (new_status, old);
+	}
+
+	void on_handshake_completed (void) Q_DECL_OVERRIDE {
+		Q_ASSERT (status == Starting);
+		set_status (WaitingForRequest);
+	}
+	bool on_receive_pull_request (void) Q_DECL_OVERRIDE {
+		if (status != WaitingForRequest) {
+			protocol_error ("PullRequest when not WaitingForRequest");
+			return false;
+		}
+		if (!send_source_offer (our_username, source))
+			return false;
+		set_status (Serving);
+		return true;
+	}
+	bool on_receive_range_request (void) Q_DECL_OVERRIDE {
+		if (status != Serving) {
+			protocol_error ("RangeRequest when not Serving");
+			return false;
+		}
+		qint64 offset, length;
+		if (!receive_range_request (offset, length))
+			return false;
+		if (length <= 0 || length > Const::pull_max_window_blocks * Const::pull_block_size) {
+			protocol_error (QString ("Invalid range length: %1").arg (length));
+			return false;
+		}
+		// Checked before writing any frame header. Offset is from the peer: no overflow here.
+		if (offset < 0 || offset > source.get_total_size () - length) {
+			protocol_error (QString ("Range out of the payload: %1+%2").arg (offset).arg (length));
+			return false;
+		}
+		return send_range (source, offset, length);
+	}
+	bool on_receive_completed (void) Q_DECL_OVERRIDE {
+		if (status != Serving) {
+			protocol_error ("Completed when not Serving");
+			return false;
+		}
+		close_connection ();
+		set_status (Completed);
+		return false;
+	}
+
+	bool on_receive_accept (void) Q_DECL_OVERRIDE {
+		protocol_error ("Accept in Seed");
+		return false;
+	}
+	bool on_receive_reject (void) Q_DECL_OVERRIDE {
+		protocol_error ("Reject in Seed");
+		return false;
+	}
+	bool on_receive_local_accept (void) Q_DECL_OVERRIDE {
+		protocol_error ("LocalAccept in Seed");
+		return false;
+	}
+	bool on_receive_offer (void) Q_DECL_OVERRIDE {
+		protocol_error ("Offer in Seed");
+		return false;
+	}
+	bool on_receive_chunk (void) Q_DECL_OVERRIDE {
+		protocol_error ("Chunk in Seed");
+		return false;
+	}
+	bool on_receive_checksums (void) Q_DECL_OVERRIDE {
+		protocol_error ("Checksums in Seed");
+		return false;
+	}
+	bool on_receive_local_source (void) Q_DECL_OVERRIDE {
+		protocol_error ("LocalSource in Seed");
+		return false;
+	}
+	bool on_receive_retry (void) Q_DECL_OVERRIDE {
+		protocol_error ("Retry in Seed");
+		return false;
+	}
+	bool on_receive_resend (void) Q_DECL_OVERRIDE {
+		protocol_error ("Resend in Seed");
+		return false;
+	}
+	bool on_receive_ack (void) Q_DECL_OVERRIDE {
+		protocol_error ("Ack in Seed");
+		return false;
+	}
+	bool on_receive_manifest (void) Q_DECL_OVERRIDE {
+		protocol_error ("Manifest in Seed");
+		return false;
+	}
+	bool on_receive_manifest_end (void) Q_DECL_OVERRIDE {
+		protocol_error ("ManifestEnd in Seed");
+		return false;
+	}
+	bool on_receive_range (void) Q_DECL_OVERRIDE {
+		protocol_error ("Range in Seed");
+		return false;
+	}
+	bool on_receive_inline_batch (void) Q_DECL_OVERRIDE {
+		protocol_error ("InlineBatch in Seed");
+		return false;
+	}
+	bool on_receive_queued (void) Q_DECL_OVERRIDE {
+		protocol_error ("Queued in Seed");
+		return false;
+	}
+};
+
+/* PullSource: connection to a Seed, driven by a Pull.
+ * Its own payload only stores the offer (to compare sources).
+ * Received ranges are written to the target payload of the Pull, if they were requested.
+ * The seed answers requests in order, so a range must continue the oldest request in flight.
+ * It measures its throughput, which gives the amount of requests to keep in flight.
+ */
+class PullSource : public Base {
+	Q_OBJECT
+
+public:
+	enum Status { Error, Init, Starting, WaitingForOffer, Ready, Closed };
+
+private:
+	Status status{Init};
+	Payload::Manager * target{nullptr};
+	Payload::Manager::ChecksumList checksums;
+
+	// Requests in flight, and throughput
+	std::deque<std::pair<qint64, qint64>> requests; // Offset and length left, oldest first
+	qint64 outstanding{0};
+	qint64 rate{0}; // bytes per second, smoothed
+	qint64 rate_bytes{0};
+	QElapsedTimer rate_timer;
+	QElapsedTimer last_data;
+
+signals:
+	void status_changed (Status new_status, Status old_status);
+	void range_received (qint64 offset, qint64 length);
+
+public:
+	PullSource (const QString & peer_username, QObject * parent = nullptr)
+	    : Base (new QTcpSocket, peer_username, parent) {
+		QObject::connect (this, &Base::failed, [this] { set_status (Error); });
+	}
+
+	void connect (const QHostAddress & address, quint16 port) {
+		Q_ASSERT (status == Init);
+		open_connection (address, port);
+		set_status (Starting);
+	}
+
+	Status get_status (void) const { return status; }
+	const Payload::Manager::ChecksumList & get_checksums (void) const { return checksums; }
+	void set_target (Payload::Manager * payload) { target = payload; }
+
+	bool request_range (qint64 offset, qint64 length) {
+		Q_ASSERT (status == Ready && target);
+		if (outstanding == 0) {
+			// Idle time does not count for the rate
+			last_data.start ();
+			rate_timer.start ();
+			rate_bytes = 0;
+		}
+		requests.emplace_back (offset, length);
+		outstanding += length;
+		return send_range_request (offset, length);
+	}
+	qint64 get_outstanding (void) const { return outstanding; }
+	qint64 get_rate (void) const { return rate; }
+	qint64 get_window (void) const {
+		return qBound (Const::pull_min_window_blocks * Const::pull_block_size,
+		               rate * Const::pull_pipeline_msec / 1000,
+		               Const::pull_max_window_blocks * Const::pull_block_size);
+	}
+	qint64 get_stalled_msec (void) const { return outstanding > 0 ? last_data.elapsed () : 0; }
+
+	void close_source (void) {
+		// Requests in flight are lost
+		if (status == Ready)
+			send_code_message (Message::Completed);
+		if (status != Error && status != Closed) {
+			close_connection ();
+			set_status (Closed);
+		}
+	}
+
+private:
+	void set_status (Status new_status) {
+		auto old = status;
+		status = new_status;
+		emit status_changed (new_status, old);
+	}
+	void update_rate (qint64 bytes) {
+		rate_bytes += bytes;
+		auto elapsed = rate_timer.elapsed ();
+		if (elapsed >= Const::rate_update_interval_msec) {
+			auto sample = (rate_bytes * 1000) / elapsed;
+			rate = rate == 0 ? sample : (3 * rate + sample) / 4;
+			rate_bytes = 0;
+			rate_timer.start ();
+		}
+	}
+
+	void on_handshake_completed (void) Q_DECL_OVERRIDE {
+		Q_ASSERT (status == Starting);
+		if (send_code_message (Message::PullRequest))
+			set_status (WaitingForOffer);
+	}
+	bool on_receive_offer (void) Q_DECL_OVERRIDE {
+		if (status != WaitingForOffer || payload.get_type () != Payload::Manager::Invalid) {
+			protocol_error ("Offer when not WaitingForOffer");
+			return false;
+		}
+		return receive_offer ();
+	}
+	bool on_receive_checksums (void) Q_DECL_OVERRIDE {
+		if (status != WaitingForOffer || payload.get_type () == Payload::Manager::Invalid) {
+			protocol_error ("Checksums when not WaitingForOffer");
+			return false;
+		}
+		if (!receive_checksum_list (checksums))
+			return false;
+		if (checksums.get_first_file () != 0 || checksums.size () != payload.get_nb_files () ||
+		    !payload.is_manifest_complete ()) {
+			protocol_error ("Source offer is incomplete");
+			return false;
+		}
+		set_status (Ready);
+		return true;
+	}
+	bool on_receive_range (void) Q_DECL_OVERRIDE {
+		if (status != Ready || target == nullptr) {
+			protocol_error ("Range when not Ready");
+			return false;
+		}
+		qint64 offset, length;
+		if (!receive_range_header (offset, length))
+			return false;
+		if (requests.empty () || offset != requests.front ().first ||
+		    length > requests.front ().second) {
+			protocol_error ("Range was not requested");
+			return false;
+		}
+		if (!receive_range_data (*target, offset, length))
+			return false;
+		auto & request = requests.front ();
+		request.first += length;
+		request.second -= length;
+		if (request.second == 0)
+			requests.pop_front ();
+		outstanding -= length;
+		last_data.start ();
+		update_rate (length);
+		emit range_received (offset, length);
+		return status == Ready; // Pull may have closed us
+	}
+
+	bool on_receive_accept (void) Q_DECL_OVERRIDE {
+		protocol_error ("Accept in PullSource");
+		return false;
+	}
+	bool on_receive_reject (void) Q_DECL_OVERRIDE {
+		protocol_error ("Reject in PullSource");
+		return false;
+	}
+	bool on_receive_completed (void) Q_DECL_OVERRIDE {
+		protocol_error ("Completed in PullSource");
+		return false;
+	}
+	bool on_receive_local_accept (void) Q_DECL_OVERRIDE {
+		protocol_error ("LocalAccept in PullSource");
+		return false;
+	}
+	bool on_receive_chunk (void) Q_DECL_OVERRIDE {
+		protocol_error ("Chunk in PullSource");
+		return false;
+	}
+	bool on_receive_local_source (void) Q_DECL_OVERRIDE {
+		protocol_error ("LocalSource in PullSource");
+		return false;
+	}
+	bool on_receive_retry (void) Q_DECL_OVERRIDE {
+		protocol_error ("Retry in PullSource");
+		return false;
+	}
+	bool on_receive_resend (void) Q_DECL_OVERRIDE {
+		protocol_error ("Resend in PullSource");
+		return false;
+	}
+	bool on_receive_ack (void) Q_DECL_OVERRIDE {
+		protocol_error ("Ack in PullSource");
+		return false;
+	}
+	bool on_receive_manifest (void) Q_DECL_OVERRIDE {
+		protocol_error ("Manifest in PullSource");
+		return false;
+	}
+	bool on_receive_manifest_end (void) Q_DECL_OVERRIDE {
+		protocol_error ("ManifestEnd in PullSource");
+		return false;
+	}
+	bool on_receive_pull_request (void) Q_DECL_OVERRIDE {
+		protocol_error ("PullRequest in PullSource");
+		return false;
+	}
+	bool on_receive_range_request (void) Q_DECL_OVERRIDE {
+		protocol_error ("RangeRequest in PullSource");
+		return false;
+	}
+	bool on_receive_inline_batch (void) Q_DECL_OVERRIDE {
+		protocol_error ("InlineBatch in PullSource");
+		return false;
+	}
+	bool on_receive_queued (void) Q_DECL_OVERRIDE {
+		protocol_error ("Queued in PullSource");
+		return false;
+	}
+};
+
+/* Pull: download the same payload from several sources at once.
+ * The first ready source gives the manifest and checksums; others must have identical ones.
+ *
+ * The payload is cut in blocks of Const::pull_block_size.
+ * Each source keeps requests in flight up to its window (throughput * Const::pull_pipeline_msec).
+ * Faster sources are served first, and drain their window faster, so they get more blocks.
+ *
+ * Up to Const::pull_max_sources are used, others wait in standby.
+ * A failed, stalled, or much slower source is dropped: its blocks are requested again elsewhere.
+ * A standby source then replaces it.
+ *
+ * When all blocks are received, files are hashed from disk and compared to the checksums.
+ * Blocks of bad files are requested again, up to Const::max_file_retries.
+ * Sources may all disconnect while hashing: the pull only fails then if a retry needs them.
+ */
+class Pull : public QObject {
+	Q_OBJECT
+
+public:
+	enum Status { Error, Starting, Transfering, Verifying, Completed };
+
+private:
+	struct Block {
+		qint64 offset;
+		qint64 length;
+		qint64 received;
+		PullSource * source; // Requested from, or nullptr
+		bool done;
+	};
+
+	Status status{Starting};
+	QString error;
+	const QString target_dir;
+	int peer_timeout{0}; // Seconds, 0 for default
+
+	Payload::Manager payload;
+	Notifier notifier;
+	Payload::Manager::ChecksumList checksums;
+
+	std::vector<Block> blocks;
+	std::deque<std::size_t> pending_blocks; // Not requested yet
+	std::size_t nb_blocks_done{0};
+
+	std::vector<PullSource *> sources; // In use
+	std::deque<PullSource *> standby;  // Ready, to replace a source
+	int nb_connecting{0};
+	QTimer check_timer;
+
+signals:
+	void status_changed (Status new_status, Status old_status);
+	void failed (void);
+
+public:
+	Pull (const QString & target_dir, QObject * parent = nullptr)
+	    : QObject (parent), target_dir (target_dir), notifier (payload) {
+		connect (&check_timer, &QTimer::timeout, this, &Pull::check_sources);
+		check_timer.start (Const::pull_check_interval_msec);
+	}
+
+	Status get_status (void) const { return status; }
+	QString get_error (void) const { return error; }
+	const Payload::Manager & get_payload (void) const { return payload; }
+	Notifier * get_notifier (void) { return &notifier; }
+	int get_nb_sources (void) const { return int(sources.size ()); }
+
+	void set_peer_timeout (int seconds) { peer_timeout = seconds; }
+
+	void add_source (const QString & peer_username, const QHostAddress & address, quint16 port) {
+		if (status == Error || status == Completed)
+			return;
+		auto source = new PullSource (peer_username, this);
+		if (peer_timeout > 0)
+			source->set_peer_timeout (peer_timeout);
+		connect (source, &PullSource::status_changed, this, &Pull::source_status_changed);
+		connect (source, &PullSource::range_received, this, &Pull::source_range_received);
+		connect (source, &Base::failed, this, &Pull::source_failed);
+		++nb_connecting;
+		source->connect (address, port);
+	}
+
+private slots:
+	void source_status_changed (PullSource::Status new_status) {
+		if (new_status == PullSource::Ready) {
+			auto source = qobject_cast<PullSource *> (sender ());
+			Q_ASSERT (source);
+			--nb_connecting;
+			source_ready (source);
+		}
+	}
+	void source_failed (void) {
+		auto source = qobject_cast<PullSource *> (sender ());
+		Q_ASSERT (source);
+		qWarning ("Pull: source %s failed: %s", qUtf8Printable (source->get_connection_info ()),
+		          qUtf8Printable (source->get_error ()));
+		if (!remove_source (source))
+			--nb_connecting; // Failed before being ready
+		source->deleteLater ();
+		if (status != Error && status != Completed) {
+			if (!check_sources_left ())
+				return;
+			schedule ();
+		}
+	}
+	void source_range_received (qint64 offset, qint64 length) {
+		auto source = qobject_cast<PullSource *> (sender ());
+		Q_ASSERT (source);
+		auto index = std::size_t (offset / Const::pull_block_size);
+		if (index >= blocks.size () || blocks[index].source != source ||
+		    offset != blocks[index].offset + blocks[index].received ||
+		    blocks[index].received + length > blocks[index].length) {
+			qWarning ("Pull: source %s sent an unexpected range",
+			          qUtf8Printable (source->get_connection_info ()));
+			drop_source (source);
+			return;
+		}
+		auto & block = blocks[index];
+		block.received += length;
+		if (block.received == block.length) {
+			block.done = true;
+			block.source = nullptr;
+			++nb_blocks_done;
+		}
+		notifier.may_progress ();
+		schedule ();
+	}
+
+	void check_sources (void) {
+		// Replace stalled sources, and much slower ones if a replacement is available
+		if (status != Transfering)
+			return;
+		qint64 best_rate = 0;
+		for (auto source : sources)
+			best_rate = qMax (best_rate, source->get_rate ());
+		for (auto source : std::vector<PullSource *> (sources)) {
+			if (source->get_stalled_msec () > Const::pull_stall_msec) {
+				qWarning ("Pull: source %s stalled", qUtf8Printable (source->get_connection_info ()));
+				drop_source (source);
+			} else if (!standby.empty () && source->get_outstanding () > 0 &&
+			           source->get_rate () * Const::pull_slow_factor < best_rate) {
+				qDebug ("Pull: source %s is slow, replacing it",
+				        qUtf8Printable (source->get_connection_info ()));
+				drop_source (source);
+			}
+		}
+	}
+
+	void verify_step (void) {
+		if (status != Verifying)
+			return;
+		Watchdog::Scope watch (Watchdog::PayloadHash);
+		if (!payload.hash_step (&checksums)) {
+			failure (tr ("Verification failed: %1").arg (payload.get_last_error ()));
+			return;
+		}
+		if (!payload.is_hashing_done ()) {
+			QTimer::singleShot (0, this, SLOT (verify_step ()));
+			return;
+		}
+		auto retries = payload.take_retry_requests ();
+		if (retries.empty ()) {
+			complete ();
+			return;
+		}
+		for (auto index : retries) {
+			qWarning ("Pull: bad checksum for file %u, requesting it again", index);
+			request_file_again (index);
+		}
+		set_status (Transfering);
+		if (check_sources_left ())
+			schedule ();
+	}
+
+private:
+	void set_status (Status new_status) {
+		auto old = status;
+		status = new_status;
+		emit status_changed (new_status, old);
+	}
+
+	void source_ready (PullSource * source) {
+		if (status == Error || status == Completed) {
+			source->close_source ();
+			source->deleteLater ();
+			return;
+		}
+		if (payload.get_type () == Payload::Manager::Invalid) {
+			// First source gives the payload
+			payload.copy_manifest (source->get_payload ());
+			checksums = source->get_checksums ();
+			payload.set_root_dir (target_dir);
+			payload.start_random_access (Payload::Manager::Receiving);
+			for (qint64 offset = 0; offset < payload.get_total_size ();
+			     offset += Const::pull_block_size) {
+				auto length = qMin (Const::pull_block_size, payload.get_total_size () - offset);
+				pending_blocks.push_back (blocks.size ());
+				blocks.push_back (Block{offset, length, 0, nullptr, false});
+			}
+			notifier.transfer_start ();
+			set_status (Transfering);
+		} else if (!payload.has_same_manifest (source->get_payload ()) ||
+		           source->get_checksums () != checksums) {
+			qWarning ("Pull: source %s has a different payload, ignored",
+			          qUtf8Printable (source->get_connection_info ()));
+			source->close_source ();
+			source->deleteLater ();
+			return;
+		}
+		source->set_target (&payload);
+		if (sources.size () < std::size_t (Const::pull_max_sources))
+			sources.push_back (source);
+		else
+			standby.push_back (source);
+		schedule ();
+	}
+
+	bool remove_source (PullSource * source) {
+		// Returns true if it was in use or standby. Its blocks are requested again later.
+		for (auto & block : blocks) {
+			if (block.source == source) {
+				payload.discard_range_progress (block.received);
+				block.received = 0;
+				block.source = nullptr;
+				pending_blocks.push_front (std::size_t (&block - blocks.data ()));
+			}
+		}
+		auto in_use = std::find (sources.begin (), sources.end (), source);
+		if (in_use != sources.end ()) {
+			sources.erase (in_use);
+			// Replace it
+			if (!standby.empty ()) {
+				sources.push_back (standby.front ());
+				standby.pop_front ();
+			}
+			return true;
+		}
+		auto in_standby = std::find (standby.begin (), standby.end (), source);
+		if (in_standby != standby.end ()) {
+			standby.erase (in_standby);
+			return true;
+		}
+		return false;
+	}
+	void drop_source (PullSource * source) {
+		remove_source (source);
+		source->close_source ();
+		source->deleteLater ();
+		if (check_sources_left ())
+			schedule ();
+	}
+	bool check_sources_left (void) {
+		// While Verifying, all blocks are on disk: sources are only needed again for retries
+		if (status == Verifying)
+			return true;
+		if (sources.empty () && standby.empty () && nb_connecting == 0) {
+			failure (tr ("No source left"));
+			return false;
+		}
+		return true;
+	}
+
+	void schedule (void) {
+		if (status != Transfering)
+			return;
+		// Fastest sources first
+		auto by_rate = sources;
+		std::sort (by_rate.begin (), by_rate.end (), [](const PullSource * a, const PullSource * b) {
+			return a->get_rate () > b->get_rate ();
+		});
+		for (auto source : by_rate) {
+			while (!pending_blocks.empty () && source->get_status () == PullSource::Ready &&
+			       source->get_outstanding () < source->get_window ()) {
+				auto & block = blocks[pending_blocks.front ()];
+				pending_blocks.pop_front ();
+				block.source = source;
+				block.received = 0;
+				if (!source->request_range (block.offset, block.length))
+					return; // Source failed, its blocks are pending again
+			}
+		}
+		if (nb_blocks_done == blocks.size ()) {
+			set_status (Verifying);
+			payload.start_hashing ();
+			QTimer::singleShot (0, this, SLOT (verify_step ()));
+		}
+	}
+	void request_file_again (quint32 index) {
+		auto range = payload.get_file_range (index);
+		if (range.second == 0)
+			return;
+		auto first = std::size_t (range.first / Const::pull_block_size);
+		auto last = std::size_t ((range.first + range.second - 1) / Const::pull_block_size);
+		for (auto i = first; i <= last; ++i) {
+			auto & block = blocks[i];
+			if (block.done) {
+				payload.discard_range_progress (block.length);
+				block.done = false;
+				block.received = 0;
+				--nb_blocks_done;
+				pending_blocks.push_back (i);
+			}
+		}
+	}
+
+	void complete (void) {
+		payload.finish_random_access ();
+		close_sources ();
+		notifier.transfer_end ();
+		set_status (Completed);
+	}
+	void failure (const QString & reason) {
+		error = reason;
+		close_sources ();
+		payload.stop_transfer ();
+		notifier.transfer_end ();
+		set_status (Error);
+		emit failed ();
+	}
+	void close_sources (void) {
+		check_timer.stop ();
+		for (auto source : sources)
+			source->close_source ();
+		for (auto source : standby)
+			source->close_source ();
+	}
+};
+}
+
+#endif
@@ -0,0 +1,196 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_SCHEDULER_H
+#define CORE_SCHEDULER_H
+
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+#include <QObject>
+#include <QPair>
+#include <QString>
+#include <QTimer>
+#include <QVector>
+#include <functional>
+
+#include "core_localshare.h"
+#include "portability.h"
+
+namespace Transfer {
+
+/* Admission of accepted downloads, per target file system.
+ *
+ * Concurrent writers to one disk make it seek between files, and together they write slower
+ * than a few at a time. Downloads are grouped by the device of their target dir, and only
+ * limit of them write at once; others wait in a queue, in order of acceptance.
+ *
+ * The limit adapts to the measured write throughput of the group (hill climbing):
+ * while writers are queued, the limit is raised by one, and kept only if the throughput grew by
+ * Const::receive_scaling_gain. After a raise that did not pay, it stays for a few periods.
+ *
+ * Writers are identified by an owner object, and removed when it is destroyed.
+ * position_changed is called with 0 when the writer is admitted (possibly from enqueue),
+ * and with its 1-based position while it is queued.
+ * Everything runs in the main thread.
+ */
+class ReceiveScheduler : public QObject {
+	Q_OBJECT
+
+private:
+	struct Writer {
+		QObject * owner;
+		std::function<qint64 (void)> bytes_written;
+		std::function<void(int)> position_changed;
+		qint64 last_written;
+		int position; // Last one given to position_changed
+	};
+	struct Disk {
+		int limit{Const::receive_initial_writers};
+		QVector<Writer> active;
+		QVector<Writer> queue;
+		qint64 rate_before_raise{-1}; // Set while a raise of limit is evaluated
+		int hold_periods{0};          // Left before the limit can be raised again
+	};
+	QHash<quint64, Disk> disks; // By device
+	QTimer timer;
+
+public:
+	static ReceiveScheduler & instance (void) {
+		static ReceiveScheduler scheduler;
+		return scheduler;
+	}
+
+	void enqueue (QObject * owner, const QString & target_dir,
+	              std::function<qint64 (void)> bytes_written,
+	              std::function<void(int)> position_changed) {
+		auto & disk = disks[device_of (target_dir)];
+		connect (owner, &QObject::destroyed, this, &ReceiveScheduler::release);
+		disk.queue.append (
+		    Writer{owner, std::move (bytes_written), std::move (position_changed), 0, -1});
+		if (!timer.isActive ())
+			timer.start ();
+		update (disk);
+	}
+
+	// The owner has stopped writing (completed, failed), or is destroyed
+	void release (QObject * owner) {
+		// Idle disks are removed by the timer, as this can be called from position_changed
+		for (auto & disk : disks) {
+			if (remove (disk.active, owner) || remove (disk.queue, owner)) {
+				disconnect (owner, &QObject::destroyed, this, &ReceiveScheduler::release);
+				update (disk);
+				return;
+			}
+		}
+	}
+
+private:
+	ReceiveScheduler () {
+		timer.setInterval (Const::receive_scheduler_interval_msec);
+		connect (&timer, &QTimer::timeout, this, &ReceiveScheduler::on_timer);
+	}
+
+	static quint64 device_of (const QString & target_dir) {
+		// The target dir may not exist yet: it will be created on the device of its nearest parent
+		auto path = QDir::cleanPath (QDir (target_dir).absolutePath ());
+		for (;;) {
+			auto identity = file_identity (path);
+			if (identity.is_valid ())
+				return identity.device;
+			auto parent = QFileInfo (path).path ();
+			if (parent == path)
+				return 0; // No existing parent (or no device information)
+			path = parent;
+		}
+	}
+
+	static bool remove (QVector<Writer> & writers, QObject * owner) {
+		for (int i = 0; i < writers.size (); ++i) {
+			if (writers[i].owner == owner) {
+				writers.remove (i);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void update (Disk & disk) {
+		// Admit while below limit, then tell the others their position if it changed.
+		// Callbacks may release writers: they are called once the disk is up to date.
+		QVector<QPair<std::function<void(int)>, int>> changes;
+		while (disk.active.size () < disk.limit && !disk.queue.isEmpty ()) {
+			auto writer = disk.queue.takeFirst ();
+			writer.last_written = writer.bytes_written ();
+			writer.position = 0;
+			disk.active.append (writer);
+			changes.append (qMakePair (writer.position_changed, 0));
+		}
+		for (int i = 0; i < disk.queue.size (); ++i) {
+			auto & writer = disk.queue[i];
+			if (writer.position != i + 1) {
+				writer.position = i + 1;
+				changes.append (qMakePair (writer.position_changed, i + 1));
+			}
+		}
+		for (auto & change : changes)
+			change.first (change.second);
+	}
+
+	void on_timer (void) {
+		for (auto & disk : disks) {
+			qint64 written = 0;
+			for (auto & writer : disk.active) {
+				auto total = writer.bytes_written ();
+				written += total - writer.last_written;
+				writer.last_written = total;
+			}
+			auto rate = written * 1000 / Const::receive_scheduler_interval_msec;
+			adapt_limit (disk, rate);
+			update (disk);
+		}
+		// Measurements are only kept while the disk is busy
+		for (auto it = disks.begin (); it != disks.end ();) {
+			if (it->active.isEmpty () && it->queue.isEmpty ())
+				it = disks.erase (it);
+			else
+				++it;
+		}
+		if (disks.isEmpty ())
+			timer.stop ();
+	}
+
+	void adapt_limit (Disk & disk, qint64 rate) {
+		if (disk.rate_before_raise >= 0) {
+			// Evaluate the last raise
+			if (double(rate) < double(disk.rate_before_raise) * (1. + Const::receive_scaling_gain)) {
+				disk.limit = qMax (disk.limit - 1, 1);
+				disk.hold_periods = Const::receive_hold_periods;
+			}
+			disk.rate_before_raise = -1;
+		} else if (disk.hold_periods > 0) {
+			--disk.hold_periods;
+		} else if (!disk.queue.isEmpty () && disk.active.size () >= disk.limit &&
+		           disk.limit < Const::receive_max_writers && rate > 0) {
+			disk.rate_before_raise = rate;
+			++disk.limit;
+		}
+	}
+};
+}
+
+#endif
@@ -19,10 +19,15 @@
 #define CORE_SERVER_H
 
 #include <QTcpServer>
+#include <QTimer>
 #include <QtGlobal>
 
 #include "compatibility.h"
+#include "core_payload.h"
+#include "core_profile.h"
+#include "core_pull.h"
 #include "core_transfer.h"
+#include "core_watchdog.h"
 
 namespace Transfer {
 
@@ -45,9 +50,10 @@ signals:
 	void download_ready (Transfer::Download * download);
 
 public:
-	Server (QObject * parent = nullptr) : QObject (parent) {
+	// Listens on any free port by default
+	Server (QObject * parent = nullptr, quint16 listen_port = 0) : QObject (parent) {
 		connect (&server, &QTcpServer::acceptError, this, &Server::server_error);
-		if (!server.listen ()) {
+		if (!server.listen (QHostAddress::Any, listen_port)) {
 			server_error ();
 			return;
 		}
@@ -55,6 +61,7 @@ public:
 			while (server.hasPendingConnections ()) {
 				auto socket = server.nextPendingConnection ();
 				auto download = new Transfer::Download (socket, this);
+				LOCALSHARE_TRACE (server_accept, download->get_transfer_id ());
 				connect (download, &Transfer::Download::failed, this, &Server::download_failed);
 				connect (download, &Transfer::Download::status_changed, this,
 				         &Server::download_status_changed);
@@ -75,6 +82,11 @@ private slots:
 		download->deleteLater ();
 	}
 	void download_status_changed (Transfer::Download::Status new_status) {
+		if (new_status == Transfer::Download::Completed) {
+			// Link probe connection, never given to the application
+			sender ()->deleteLater ();
+			return;
+		}
 		if (new_status == Transfer::Download::WaitingForUserChoice) {
 			// Give it to external structures
 			auto download = qobject_cast<Transfer::Download *> (sender ());
@@ -86,6 +98,85 @@ private slots:
 		}
 	}
 };
+
+/* Serve a payload to pullers (multi source download).
+ * The payload is hashed before listening, as pullers need the checksums in the offer.
+ * ready() is emitted when listening, failed() if the payload cannot be served.
+ * Seed connections live until their puller closes them.
+ */
+class SeedServer : public QObject {
+	Q_OBJECT
+
+private:
+	QTcpServer server;
+	Payload::Manager payload;
+	const QString our_username;
+	Profile profile; // Of seed connections
+
+signals:
+	void ready (void);
+	void failed (QString error);
+	void seed_status_changed (Transfer::Seed::Status new_status, QString peer);
+
+public:
+	SeedServer (const QString & our_username, QObject * parent = nullptr)
+	    : QObject (parent), our_username (our_username) {
+		connect (&server, &QTcpServer::acceptError,
+		         [this] { emit failed (tr ("Server failed: %1").arg (server.errorString ())); });
+		connect (&server, &QTcpServer::newConnection, [this] {
+			while (server.hasPendingConnections ()) {
+				auto socket = server.nextPendingConnection ();
+				auto seed = new Transfer::Seed (socket, payload, this->our_username, this);
+				seed->set_profile (profile);
+				connect (seed, &Transfer::Seed::status_changed, this, &SeedServer::seed_changed);
+			}
+		});
+	}
+
+	quint16 port (void) const { return server.serverPort (); }
+	const Payload::Manager & get_payload (void) const { return payload; }
+	void set_profile (const Profile & new_profile) { profile = new_profile; }
+
+	void set_payload (const QString & path, bool send_hidden_files,
+	                  const Payload::Filter & filter = Payload::Filter ()) {
+		Watchdog::Scope watch (Watchdog::PayloadScan);
+		if (!payload.from_source_path (path, !send_hidden_files, filter)) {
+			emit failed (payload.get_last_error ());
+			return;
+		}
+		payload.start_random_access (Payload::Manager::Sending);
+		payload.start_hashing ();
+		QTimer::singleShot (0, this, SLOT (hash_step ()));
+	}
+
+private slots:
+	void hash_step (void) {
+		Watchdog::Scope watch (Watchdog::PayloadHash);
+		if (!payload.hash_step ()) {
+			emit failed (payload.get_last_error ());
+			return;
+		}
+		if (!payload.is_hashing_done ()) {
+			QTimer::singleShot (0, this, SLOT (hash_step ()));
+			return;
+		}
+		if (!server.listen ()) {
+			emit failed (tr ("Server failed: %1").arg (server.errorString ()));
+			return;
+		}
+		emit ready ();
+	}
+
+	void seed_changed (Transfer::Seed::Status new_status) {
+		auto seed = qobject_cast<Transfer::Seed *> (sender ());
+		Q_ASSERT (seed);
+		if (new_status == Transfer::Seed::Error)
+			qWarning ("SeedServer: Seed failed: %s", qUtf8Printable (seed->get_error ()));
+		emit seed_status_changed (new_status, seed->get_connection_info ());
+		if (new_status == Transfer::Seed::Error || new_status == Transfer::Seed::Completed)
+			seed->deleteLater ();
+	}
+};
 }
 
 #endif
@@ -19,10 +19,12 @@
 #define CORE_SETTINGS_H
 
 #include <QByteArray>
+#include <QDateTime>
 #include <QDir>
 #include <QProcessEnvironment>
 #include <QSettings>
 #include <QStandardPaths>
+#include <QStringList>
 
 namespace Settings {
 
@@ -77,6 +79,43 @@ private:
 	bool default_value (void) const { return false; }
 };
 
+class UploadFilters : public Element<QStringList> {
+	// Exclude patterns for uploaded directories (gitignore syntax, '!' to include)
+private:
+	const char * key (void) const { return "upload/filters"; }
+	QStringList default_value (void) const { return {}; }
+};
+
+class PeerTimeout : public Element<int> {
+	// Seconds without any data from the peer before a transfer is considered dead
+private:
+	const char * key (void) const { return "network/peer_timeout"; }
+	int default_value (void) const { return 20; }
+	int normalize (int value) { return qMax (value, 2); }
+};
+
+class UploadProfile : public Element<QString> {
+	// Network profile of uploads (see Transfer::Profile)
+private:
+	const char * key (void) const { return "upload/profile"; }
+	QString default_value (void) const { return "default"; }
+};
+
+class UploadPacingRate : public Element<int> {
+	// Pacing rate of uploads in Mbit/s, 0 for unlimited
+private:
+	const char * key (void) const { return "upload/pacing_rate"; }
+	int default_value (void) const { return 0; }
+	int normalize (int value) { return qMax (value, 0); }
+};
+
+class CacheMode : public Element<QString> {
+	// Page cache use of transfered files: auto, drop or keep (see Payload::Manager::CacheMode)
+private:
+	const char * key (void) const { return "transfer/cache_mode"; }
+	QString default_value (void) const { return "auto"; }
+};
+
 class DownloadPath : public Element<QString> {
 	// Place to store downloaded files
 private:
@@ -118,6 +157,29 @@ private:
 	const char * key (void) const { return "interface/window_state"; }
 	QByteArray default_value (void) const { return {}; }
 };
+
+class PeerLink {
+	// Last link measurement with a peer (see Transfer::LinkInfo), by peer address and port
+private:
+	QSettings settings;
+	const QString key;
+
+public:
+	explicit PeerLink (const QString & peer_key) : key ("links/" + peer_key) {}
+
+	bool get (qint64 & rtt_usec, qint64 & rate, qint64 & age_msec) {
+		auto values = settings.value (key).toList ();
+		if (values.size () != 3)
+			return false;
+		rtt_usec = values[0].toLongLong ();
+		rate = values[1].toLongLong ();
+		age_msec = QDateTime::currentMSecsSinceEpoch () - values[2].toLongLong ();
+		return true;
+	}
+	void set (qint64 rtt_usec, qint64 rate) {
+		settings.setValue (key, QVariantList{rtt_usec, rate, QDateTime::currentMSecsSinceEpoch ()});
+	}
+};
 }
 
 #endif
@@ -0,0 +1,47 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_TRACE_H
+#define CORE_TRACE_H
+
+/* Static tracepoints (USDT probes of provider "localshare"), for bpftrace, perf or systemtap.
+ * Enabled by CONFIG += localshare_usdt (needs sys/sdt.h, from systemtap-sdt-dev on Linux).
+ * A probe is a nop instruction and an ELF note: it costs nothing until a tracer attaches.
+ * Arguments are integers already computed by the traced code, never strings built for it.
+ * Without the config flag, probes expand to nothing.
+ *
+ * Transfers are identified by Transfer::Base::get_transfer_id (), files by their index.
+ * Probes (arguments):
+ * - send_chunk (transfer, bytes, file index): main stream frames written to the socket
+ * - receive_chunk (transfer, bytes, file index): Chunk frame received
+ * - frame (transfer, code, size): frame dispatched by Base::receive_message
+ * - file_open (transfer, file index, size, writable), file_close (transfer, file index, position)
+ * - checksum (transfer, file index, match): file checked against a received checksum
+ * - server_accept (transfer): new connection, a Download
+ * - browser_event (added, more coming), resolver_done (port, error code): discovery callbacks
+ *
+ * $ bpftrace -l 'usdt:./localshare:*'
+ * $ bpftrace -e 'usdt:./localshare:localshare:send_chunk { @bytes[arg0] = sum(arg1); }'
+ */
+#ifdef LOCALSHARE_HAS_USDT
+#include <sys/sdt.h>
+#define LOCALSHARE_TRACE(name, ...) STAP_PROBEV (localshare, name, __VA_ARGS__)
+#else
+#define LOCALSHARE_TRACE(name, ...) ((void) 0)
+#endif
+
+#endif
@@ -21,15 +21,25 @@
 #include <QAbstractSocket>
 #include <QDataStream>
 #include <QElapsedTimer>
+#include <QHash>
 #include <QTcpSocket>
 #include <QTimer>
+#include <QtEndian>
 #include <deque>
 #include <limits>
+#include <memory>
 #include <tuple>
 #include <type_traits>
 
+#include "core_eventlog.h"
 #include "core_localshare.h"
 #include "core_payload.h"
+#include "core_profile.h"
+#include "core_scheduler.h"
+#include "core_settings.h"
+#include "core_trace.h"
+#include "core_watchdog.h"
+#include "portability.h"
 
 namespace Transfer {
 
@@ -38,34 +48,92 @@ namespace Message {
 	 *
 	 * Uploader         Downloader
 	 * ---[open connection]--->
-	 * ---[magic+ver]--->
-	 * <---[magic+ver]---
-	 * IF (magic/ver doesn't match) { abort () }
+	 * ---[magic+ver+capabilities]--->
+	 * <---[magic+ver+capabilities]---
+	 * IF (magic doesn't match or ver < min ver) { abort () }
+	 * <---[heartbeat]---> (at any time after, if nothing else to send)
+	 * IF (link not measured recently) {
+	 * ---[ping(time)]---> <---[pong(time)]--- (a few times, for the round trip time)
+	 * ---[probe data]---> (a burst, for the throughput)
+	 * ---[probe end]---> <---[probe report(bytes,time)]---
+	 * }
 	 * ---[offer]--->
+	 * ---[manifest(files)]---> (if the offer was open-ended, as the scan progresses)
+	 * ---[manifest end(total size)]---> (if the offer was open-ended, when the scan ends)
+	 * <---[queued(position)]--- (accepted but waiting for the receiver disk, see ReceiveScheduler)
 	 * IF (accepted) {
 	 * <---[accepted]---
-	 * ---[chunks/checksums]--->
+	 * ---[chunks/inline batches/checksums]---> (batches carry small files, see Payload::Manager)
+	 * <---[ack(bytes written)]--- (periodically, gives progress to the sender)
+	 * <---[retry(file)]--- (for each bad checksum, up to a limit)
+	 * ---[resend(file)/chunks/checksum]---> (for each retry, after all other chunks)
 	 * <--[completed]---
+	 * } ELSE IF (accepted and on same host) {
+	 * <---[local accepted]---
+	 * ---[local source]--->
+	 * IF (receiver sees the same files) {
+	 * <--[completed]--- (files are copied from the sender dir, each checked against the source)
+	 * } ELSE {
+	 * <---[accepted]--- (fallback to normal transfer)
+	 * }
 	 * } ELSE  {
 	 * <---[rejected]---
 	 * }
 	 * close () -- close ()
+	 *
+	 * Multi-source pull (the puller connects to sources that serve a prepared payload):
+	 * Puller           Source
+	 * ---[open connection]--->
+	 * <--[magic+ver+capabilities]--->
+	 * ---[pull request]--->
+	 * <---[offer]---
+	 * <---[checksums(all files)]---
+	 * ---[range request(offset,length)]---> (as many as needed, pipelined)
+	 * <---[range(offset,data)]--- (pieces of each requested range, in order)
+	 * ---[completed]---> (or close if this source is not needed anymore)
+	 * close () -- close ()
+	 *
+	 * Link probe only (localshare --probe), to a downloader:
+	 * ---[open connection]--->
+	 * <--[magic+ver+capabilities]--->
+	 * ---[ping... probe end]---> <---[pong... probe report]--- (as above)
+	 * ---[completed]--->
+	 * close () -- close ()
 	 */
 
 	/* All messages (except the initial handshake) are prefixed with a code to identify them.
-	 * The high byte of the code is the protocol version.
-	 * This ensures that stuff will break early if versions mismatch =)
+	 * The high byte of the code was the protocol version up to version 9, and is now fixed:
+	 * peers of different versions understand each other's codes.
+	 * New messages are only sent to peers that announce the matching feature (see Capabilities).
 	 */
 	using CodeType = quint16;
-	constexpr CodeType base_code = Const::protocol_version << 4;
+	constexpr CodeType base_code = 0x9 << 8;
 	enum Code : CodeType {
 		Error = base_code + 0, // +QString(error)
-		Offer = base_code + 1, // +QString(our_username),Payload(file_list)
+		Offer = base_code + 1, // +QString(our_username),Payload(file_list),QByteArray(host_id)
 		Accept = base_code + 2,
 		Reject = base_code + 3,
 		Chunk = base_code + 4,     // >Manual transfer...
-		Checksums = base_code + 5, // +Payload::Manager::ChecksumList
-		Completed = base_code + 6
+		Checksums = base_code + 5, // +Payload::ChecksumList
+		Completed = base_code + 6,
+		LocalAccept = base_code + 7,
+		LocalSource = base_code + 8, // +QString(payload_dir),Payload::SourceIdentities
+		Retry = base_code + 9,       // +quint32(file_index)
+		Resend = base_code + 10,     // +quint32(file_index)
+		Heartbeat = base_code + 11,
+		Ack = base_code + 12,        // +qint64(bytes_written)
+		Manifest = base_code + 13,     // +Payload::Manager::ManifestPage
+		ManifestEnd = base_code + 14,  // +qint64(total_size)
+		PullRequest = base_code + 15,  //
+		RangeRequest = base_code + 16, // +qint64(offset),qint64(length)
+		Range = base_code + 17,        // +qint64(offset), >Manual transfer...
+		InlineBatch = base_code + 18,  // +quint32(nb_files), >Manual transfer..., Checksum(data)
+		Ping = base_code + 19,         // +qint64(time_usec)
+		Pong = base_code + 20,         // +qint64(time_usec of the ping)
+		ProbeData = base_code + 21,    // >Filler bytes
+		ProbeEnd = base_code + 22,
+		ProbeReport = base_code + 23,  // +qint64(bytes),qint64(time_usec)
+		Queued = base_code + 24        // +quint32(position)
 	};
 
 	/* Messages with variable size content will be prefixed by their size (after code).
@@ -73,11 +141,138 @@ namespace Message {
 	 */
 	using SizePrefixType = quint32;
 	constexpr auto max_size = static_cast<qint64> (std::numeric_limits<SizePrefixType>::max ());
+
+	inline bool has_content (CodeType code) {
+		switch (code) {
+		case Error:
+		case Offer:
+		case Chunk:
+		case Checksums:
+		case LocalSource:
+		case Retry:
+		case Resend:
+		case Ack:
+		case Manifest:
+		case ManifestEnd:
+		case RangeRequest:
+		case Range:
+		case InlineBatch:
+		case Ping:
+		case Pong:
+		case ProbeData:
+		case ProbeReport:
+		case Queued:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	/* Frame headers are peeked from the socket buffer and decoded by hand.
+	 * QDataStream writes integers as raw big endian values, so this matches its output.
+	 */
+	constexpr qint64 code_size = sizeof (CodeType);
+	constexpr qint64 header_size = sizeof (CodeType) + sizeof (SizePrefixType);
+	inline CodeType decode_code (const char * header) {
+		return qFromBigEndian<CodeType> (reinterpret_cast<const uchar *> (header));
+	}
+	inline SizePrefixType decode_size (const char * header) {
+		return qFromBigEndian<SizePrefixType> (reinterpret_cast<const uchar *> (header + code_size));
+	}
 }
 
-// Information on size of serialized structures
-class Serialized {
-private:
+/* Capabilities, exchanged in the handshake (after magic and version, prefixed by their size).
+ * Optional protocol features, limits and algorithms of a peer, as a list of (key, value).
+ * Unknown keys are ignored, and missing keys take baseline values: new keys can be added
+ * without breaking older peers. Peers use the common subset (see negotiate).
+ */
+struct Capabilities : public Streamable {
+	enum Key : quint16 { FeaturesKey, MaxFrameSizeKey, HashesKey, CodecsKey };
+	enum Feature : quint64 {
+		LinkProbe = 1 << 0,  // Answers Ping and ProbeData (see Base::start_probe)
+		QueueNotice = 1 << 2, // Handles Queued (position in the receive queue of the peer)
+		LocalCopy = 1 << 3    // Handles LocalAccept (copies on the same host, checked by file)
+		// 1 << 1 was LocalCopy with a check of the first file only: not used anymore
+	};
+	enum Hash : quint64 { HashMd5 = 1 << 0 };     // Checksums of files
+	enum Codec : quint64 { CodecNone = 1 << 0 }; // Compression of data frames (raw only)
+
+	quint64 features{0};
+	qint64 max_frame_size{Message::max_size}; // Data frames larger than this are not accepted
+	quint64 hashes{HashMd5};
+	quint64 codecs{CodecNone};
+
+	static Capabilities ours (void) {
+		Capabilities c;
+		c.features = LinkProbe | LocalCopy | QueueNotice;
+		c.max_frame_size = Const::max_frame_size;
+		return c;
+	}
+	// Features, hashes and codecs supported by both, and the peer limits
+	static Capabilities negotiate (const Capabilities & ours, const Capabilities & peer) {
+		Capabilities c;
+		c.features = ours.features & peer.features;
+		c.max_frame_size = peer.max_frame_size;
+		c.hashes = ours.hashes & peer.hashes;
+		c.codecs = ours.codecs & peer.codecs;
+		return c;
+	}
+	bool has (Feature feature) const { return (features & feature) != 0; }
+
+	void to_stream (QDataStream & stream) const {
+		stream << quint16 (4);
+		stream << quint16 (FeaturesKey) << features;
+		stream << quint16 (MaxFrameSizeKey) << quint64 (max_frame_size);
+		stream << quint16 (HashesKey) << hashes;
+		stream << quint16 (CodecsKey) << codecs;
+	}
+	void from_stream (QDataStream & stream) {
+		*this = Capabilities ();
+		quint16 nb_keys = 0;
+		stream >> nb_keys;
+		for (quint16 i = 0; i < nb_keys && stream.status () == QDataStream::Ok; ++i) {
+			quint16 key = 0;
+			quint64 value = 0;
+			stream >> key >> value;
+			switch (key) {
+			case FeaturesKey:
+				features = value;
+				break;
+			case MaxFrameSizeKey:
+				max_frame_size = qint64 (qMin (value, quint64 (Message::max_size)));
+				break;
+			case HashesKey:
+				hashes = value;
+				break;
+			case CodecsKey:
+				codecs = value;
+				break;
+			default:
+				break; // From a newer peer
+			}
+		}
+	}
+
+	QString describe (void) const {
+		return QStringLiteral ("features 0x%1, max frame %2, hashes 0x%3, codecs 0x%4")
+		    .arg (features, 0, 16)
+		    .arg (size_to_string (max_frame_size))
+		    .arg (hashes, 0, 16)
+		    .arg (codecs, 0, 16);
+	}
+};
+
+/* Information on size of serialized structures.
+ * Fixed sizes are computed at compile time: QDataStream writes integers as raw values.
+ * Variable sized content is measured by serializing it to a dummy device.
+ * The device is only created at the first measurement (not at startup).
+ */
+namespace Serialized {
+	constexpr qint64 handshake_size =
+	    sizeof (Const::protocol_magic) + sizeof (Const::protocol_version);
+	// Capabilities follow, with a size prefix (a peer sending more is broken or hostile)
+	constexpr qint64 capabilities_max_size = 4096;
+
 	/* This helper class allow to measure size of serialized data.
 	 * It uses DummyDevice, a device that just counts the amount of bytes written.
 	 */
@@ -110,26 +305,18 @@ private:
 		}
 	};
 
-private:
-	MeasurementDevice device;
-
-public:
-	// Precomputed sizes
-	const qint64 handshake_size;
-	const qint64 message_code_size;
-	const qint64 message_size_prefix_size;
-
-public:
-	Serialized ()
-	    : handshake_size (compute_size (Const::protocol_magic, Const::protocol_version)),
-	      message_code_size (compute_size (Message::CodeType ())),
-	      message_size_prefix_size (compute_size (Message::SizePrefixType ())) {}
-
 	template <typename... Args> qint64 compute_size (const Args &... args) {
+		static MeasurementDevice device; // Only used from the main thread
 		return device.compute_size (args...);
 	}
-};
-extern Serialized serialized_info; // Global precomputed size info (defined in main.cpp)
+
+	// Content of an InlineBatch message
+	inline qint64 inline_batch_size (qint64 data_size) {
+		static const qint64 checksum_size =
+		    compute_size (QCryptographicHash::hash (QByteArray (), Const::hash_algorithm));
+		return qint64 (sizeof (quint32)) + data_size + checksum_size;
+	}
+}
 
 /* Implements the rate and progress notifications.
  * Signals:
@@ -149,6 +336,10 @@ extern Serialized serialized_info; // Global precomputed size info (defined in m
  * When progressed() are frequent enough, we emit instant_rate() before each of them with a flag.
  * This lets watching qobject wait for the progressed() signal before redrawing.
  * If progressed() is infrequent, instant_rate is emitted with a slow timer.
+ *
+ * The sender only knows how much was given to the socket, which can be far ahead of the receiver.
+ * So its progress comes from acknowledgements (bytes written by the receiver).
+ * The difference is available as the queued size.
  */
 class Notifier : public QObject {
 	Q_OBJECT
@@ -168,6 +359,8 @@ private:
 	std::deque<Progress> history;
 	QTimer update_rate_timer;
 
+	qint64 acknowledged{-1}; // Bytes acknowledged by the receiver, or -1 if progress is local
+
 public:
 	const Payload::Manager & payload;
 
@@ -202,6 +395,21 @@ public:
 		}
 	}
 
+	void use_acknowledged_progress (void) { acknowledged = 0; }
+	void set_acknowledged (qint64 bytes) {
+		Q_ASSERT (acknowledged >= 0);
+		acknowledged = qMax (acknowledged, bytes);
+	}
+
+	// Bytes that reached the receiver disk
+	qint64 get_transfered_size (void) const {
+		return acknowledged >= 0 ? acknowledged : payload.get_total_transfered_size ();
+	}
+	// Bytes sent but not written yet by the receiver (always 0 on the receiver side)
+	qint64 get_queued_size (void) const {
+		return qMax (payload.get_total_transfered_size () - get_transfered_size (), qint64 (0));
+	}
+
 	// After end only
 
 	qint64 get_transfer_time (void) const {
@@ -222,7 +430,7 @@ private:
 	void update_history (void) {
 		// Move window
 		auto epoch = transfer_timer.elapsed ();
-		history.push_back ({epoch, payload.get_total_transfered_size ()});
+		history.push_back ({epoch, get_transfered_size ()});
 		auto threshold = epoch - Const::progress_history_window_msec;
 		while (history.front ().epoch < threshold &&
 		       history.size () >= Const::progress_history_window_elem)
@@ -241,7 +449,7 @@ private:
 /* Transfer object base class.
  *
  * This class provides the implementation of protocol primitives.
- * It performs pre-protocol magic+ver verification ("handshake").
+ * It performs pre-protocol magic+ver verification and capability exchange ("handshake").
  * It will then parse the [code] or [code, size, <serialized content>] stream of messages.
  * Message handlers will be called when a message has been received.
  * Functions to send/receive messages are provided.
@@ -253,16 +461,48 @@ class Base : public QObject {
 	Q_OBJECT
 
 private:
-	enum Status { WaitingForHandshake, WaitingForCode, WaitingForSize, WaitingForContent };
+	enum Status { WaitingForHandshake, WaitingForMessage };
 	Status status{WaitingForHandshake};
-	Message::CodeType next_msg_code;
-	Message::SizePrefixType next_msg_size;
+	Capabilities capabilities; // Negotiated in the handshake
+	Message::CodeType next_msg_code{0};       // Code of the message being dispatched
+	Message::SizePrefixType next_msg_size{0}; // Content size of the message being dispatched
+	qint64 buffered{0};                    // Bytes in the socket buffer that are not parsed yet
 	QString error;
 	QString connection_info;
 
 	QAbstractSocket * socket;
 	QDataStream stream;
 
+	// Dead peer detection: heartbeats if idle, and timeout if the peer sends nothing
+	QTimer heartbeat_timer;
+	QElapsedTimer last_data_received;
+	qint64 peer_timeout_msec;
+
+	QElapsedTimer ack_timer; // Rate limits acknowledgements
+
+	Profile profile;
+	QString profile_info; // What was applied to the socket
+
+	// Link probe, as the side that measures
+	enum ProbeState { NoProbe, ProbePinging, ProbeSending, ProbeWaitingReport };
+	ProbeState probe_state{NoProbe};
+	int probe_pings_left{0};
+	qint64 probe_sent{0};
+	QElapsedTimer probe_clock;
+	QElapsedTimer probe_burst_timer;
+	LinkInfo link_info;
+	// Link probe, as the peer: data received after the first ProbeData frame (-1 before it)
+	qint64 probe_received{-1};
+	QElapsedTimer probe_receive_timer;
+
+	Payload::Manager::ChecksumList checksum_buffer; // Reused for Checksums messages
+
+	const quint32 transfer_id; // Identifies the transfer in tracepoints and the event log
+	static quint32 new_transfer_id (void) {
+		static quint32 last_id = 0; // Transfers are created in the main thread only
+		return ++last_id;
+	}
+
 protected:
 	enum FailureMode {
 		AbortMode,             // Critical, abort connection
@@ -272,6 +512,8 @@ protected:
 	Payload::Manager payload;
 	Notifier notifier;
 	QString peer_username;
+	QByteArray peer_host_id;
+	Pacer pacer; // Used by senders if the kernel does not pace
 
 signals:
 	void failed (void);
@@ -281,20 +523,53 @@ public:
 	    : QObject (parent),
 	      socket (socket_),
 	      stream (socket),
+	      peer_timeout_msec (Settings::PeerTimeout ().get () * 1000),
+	      transfer_id (new_transfer_id ()),
 	      notifier (payload),
 	      peer_username (peer_username) {
+		payload.set_trace_id (transfer_id);
 		socket->setParent (this);
 		stream.setVersion (Const::serializer_version);
+		checksum_buffer.reserve (Const::checksums_per_frame);
+		Payload::Manager::CacheMode cache_mode;
+		if (Payload::Manager::cache_mode_from_name (Settings::CacheMode ().get (), cache_mode))
+			payload.set_cache_mode (cache_mode);
 		connect (socket, static_cast<void (QAbstractSocket::*) (QAbstractSocket::SocketError)> (
 		                     &QAbstractSocket::error),
 		         this, &Base::on_socket_error);
 		connect (socket, &QAbstractSocket::connected, this, &Base::on_socket_connected);
 		connect (socket, &QAbstractSocket::readyRead, this, &Base::on_data_received);
 		connect (socket, &QAbstractSocket::bytesWritten, this, &Base::on_data_written);
+		connect (socket, &QAbstractSocket::bytesWritten, this, [this] {
+			if (probe_state == ProbeSending)
+				send_probe_burst ();
+		});
+		connect (&heartbeat_timer, &QTimer::timeout, this, &Base::on_heartbeat_timer);
 	}
 	Base (QAbstractSocket * socket, QObject * parent = nullptr) : Base (socket, QString (), parent) {}
 
 	QString get_error (void) const { return error; }
+	quint32 get_transfer_id (void) const { return transfer_id; }
+
+	// Common subset of both peers, after the handshake
+	const Capabilities & get_capabilities (void) const { return capabilities; }
+
+	void set_peer_timeout (int seconds) { peer_timeout_msec = qint64 (seconds) * 1000; }
+
+	// Set before the transfer starts (defaults to the setting)
+	void set_cache_mode (Payload::Manager::CacheMode mode) { payload.set_cache_mode (mode); }
+
+	// Applied when connected (immediately if already connected)
+	void set_profile (const Profile & new_profile) {
+		profile = new_profile;
+		if (socket->state () == QAbstractSocket::ConnectedState)
+			apply_profile ();
+	}
+	const Profile & get_profile (void) const { return profile; }
+	QString get_profile_info (void) const { return profile_info; }
+
+	// Measured by a link probe, or loaded from settings (invalid if neither)
+	const LinkInfo & get_link_info (void) const { return link_info; }
 
 	QString get_peer_username (void) const { return peer_username; }
 	QString get_connection_info (void) const { return connection_info; }
@@ -308,12 +583,17 @@ private slots:
 		failure (tr ("Network error: %1").arg (socket->errorString ()), AbortMode);
 	}
 	void on_data_received (void) {
+		Watchdog::Scope watch (Watchdog::DataReceived);
+		last_data_received.start ();
 		if (status == WaitingForHandshake && !receive_handshake ())
 			return;
+		// Parse all complete frames of the buffer; only check the timer once per batch of frames
+		buffered = socket->bytesAvailable ();
 		QElapsedTimer timer;
 		timer.start ();
+		int nb_frames = 0;
 		while (receive_message ()) {
-			if (timer.elapsed () > Const::max_work_msec) {
+			if (++nb_frames % Const::frames_per_batch == 0 && timer.elapsed () > Const::max_work_msec) {
 				// Return to event loop (but schedule this handler again)
 				QTimer::singleShot (0, this, SLOT (on_data_received ()));
 				break;
@@ -321,10 +601,27 @@ private slots:
 		}
 	}
 
+	void on_heartbeat_timer (void) {
+		if (last_data_received.elapsed () > peer_timeout_msec) {
+			failure (tr ("Peer is not responding (no data for %1s)")
+			             .arg (last_data_received.elapsed () / 1000),
+			         AbortMode);
+			return;
+		}
+		if (status == WaitingForMessage && socket->bytesToWrite () == 0)
+			send_code_message (Message::Heartbeat);
+	}
+
 protected slots:
 	void on_socket_connected (void) {
 		connection_info =
 		    tr ("%1 on port %2").arg (socket->peerAddress ().toString ()).arg (socket->peerPort ());
+		set_socket_keepalive (socket->socketDescriptor (), Const::keepalive_idle_sec,
+		                      Const::keepalive_interval_sec, Const::keepalive_count,
+		                      int(peer_timeout_msec));
+		apply_profile ();
+		last_data_received.start ();
+		heartbeat_timer.start (Const::heartbeat_interval_msec);
 		send_handshake ();
 	}
 	virtual void on_data_written (void) {}
@@ -336,16 +633,42 @@ protected:
 		socket->connectToHost (address, port);
 	}
 	void close_connection (void) {
+		heartbeat_timer.stop ();
 		socket->flush ();
 		socket->disconnectFromHost ();
 	}
 	qint64 write_buffer_size (void) const { return socket->bytesToWrite (); }
+	QAbstractSocket * get_socket (void) const { return socket; }
+
+	void apply_profile (void) {
+		auto fd = socket->socketDescriptor ();
+		if (!profile.congestion_control.isEmpty () &&
+		    !set_socket_congestion_control (fd, profile.congestion_control))
+			qWarning ("Congestion control %s is not available", profile.congestion_control.constData ());
+		if (profile.dscp >= 0 && !set_socket_dscp (fd, profile.dscp))
+			qWarning ("Unable to set DSCP %d on socket", profile.dscp);
+		auto kernel_pacing = profile.pacing_rate > 0 && set_socket_pacing_rate (fd, profile.pacing_rate);
+		pacer.set_rate (kernel_pacing ? 0 : profile.pacing_rate);
+
+		auto algorithm = get_socket_congestion_control (fd);
+		profile_info = tr ("profile %1, congestion control %2")
+		                   .arg (profile.name.isEmpty () ? QStringLiteral ("default") : profile.name,
+		                         algorithm.isEmpty () ? tr ("unknown") : QString (algorithm));
+		if (profile.pacing_rate > 0)
+			profile_info += tr (", paced at %1/s (%2)")
+			                    .arg (size_to_string (profile.pacing_rate),
+			                          kernel_pacing ? tr ("kernel") : tr ("userspace"));
+		if (profile.dscp >= 0)
+			profile_info += tr (", DSCP %1").arg (profile.dscp);
+	}
 
 	// Error reporting
 
 	void failure (const QString & reason, FailureMode mode = SendNoticeAndCloseMode) {
 		// For failures that are printed to users
+		EventLog::record (EventLog::TransferFailed, transfer_id, mode);
 		error = reason;
+		heartbeat_timer.stop ();
 		if (mode == SendNoticeAndCloseMode)
 			send_content_message (Message::Error, error);
 		if (mode == AbortMode) {
@@ -359,6 +682,7 @@ protected:
 	}
 	void protocol_error (const char * details) {
 		// Internal failures (or attack)
+		EventLog::record (EventLog::ProtocolError, transfer_id, next_msg_code, next_msg_size);
 		qWarning ("Protocol error: %s", details);
 		failure (tr ("Protocol error"), AbortMode);
 	}
@@ -386,27 +710,57 @@ protected:
 	// Message event Handlers
 
 	virtual void on_handshake_completed (void) = 0;
+	virtual void on_probe_completed (void) {} // Results in link_info
 	// Bool event handlers should return false to stop further processing of messages
 	virtual bool on_receive_accept (void) = 0;
 	virtual bool on_receive_reject (void) = 0;
 	virtual bool on_receive_completed (void) = 0;
+	virtual bool on_receive_local_accept (void) = 0;
+	virtual bool on_receive_pull_request (void) = 0;
 	// Event handlers of messages with content are called when content is buffered
 	virtual bool on_receive_offer (void) = 0;
 	virtual bool on_receive_chunk (void) = 0;
 	virtual bool on_receive_checksums (void) = 0;
+	virtual bool on_receive_local_source (void) = 0;
+	virtual bool on_receive_retry (void) = 0;
+	virtual bool on_receive_resend (void) = 0;
+	virtual bool on_receive_ack (void) = 0;
+	virtual bool on_receive_manifest (void) = 0;
+	virtual bool on_receive_manifest_end (void) = 0;
+	virtual bool on_receive_range_request (void) = 0;
+	virtual bool on_receive_range (void) = 0;
+	virtual bool on_receive_inline_batch (void) = 0;
+	virtual bool on_receive_queued (void) = 0;
 
 	// Protocol interaction utilities
 
+	/* Link probe: measures the round trip time (smallest of a few pings), then the throughput.
+	 * Throughput is measured by the peer, on a burst of Const::probe_burst_msec of filler data.
+	 * The peer measures from the arrival of the first ProbeData frame to the ProbeEnd frame.
+	 * All connections answer probes at any time, which is handled in receive_message.
+	 */
+	void start_probe (void) {
+		Q_ASSERT (probe_state == NoProbe);
+		link_info = LinkInfo ();
+		probe_state = ProbePinging;
+		probe_pings_left = Const::probe_nb_pings;
+		probe_clock.start ();
+		send_content_message (Message::Ping, qint64 (probe_clock.nsecsElapsed () / 1000));
+	}
+	void set_link_info (const LinkInfo & info) { link_info = info; }
+
 	bool send_code_message (Message::Code code) {
 		stream << Message::CodeType (code);
 		return check_stream ();
 	}
 
 	bool send_offer (const QString & our_username) {
-		return send_content_message (Message::Offer, std::tie (our_username, payload));
+		auto our_host_id = host_id ();
+		payload.set_all_announced (); // Files found later go to manifest pages
+		return send_content_message (Message::Offer, std::tie (our_username, payload, our_host_id));
 	}
 	bool receive_offer (void) {
-		stream >> std::tie (peer_username, payload);
+		stream >> std::tie (peer_username, payload, peer_host_id);
 		if (!check_stream ())
 			return false;
 		if (!payload.validate ()) {
@@ -416,183 +770,867 @@ protected:
 		return true;
 	}
 
+	// Open-ended manifest (pipelined scan)
+	bool send_manifest_page (void) {
+		return send_content_message (Message::Manifest, payload.take_manifest_page ());
+	}
+	bool send_manifest_end (void) {
+		return send_content_message (Message::ManifestEnd, payload.get_total_size ());
+	}
+	bool receive_manifest (void) {
+		Payload::Manager::ManifestPage page;
+		stream >> page;
+		if (!check_stream ())
+			return false;
+		if (!payload.receive_manifest_page (page)) {
+			protocol_error (payload.get_last_error ());
+			return false;
+		}
+		return true;
+	}
+	bool receive_manifest_end (void) {
+		qint64 total_size;
+		stream >> total_size;
+		if (!check_stream ())
+			return false;
+		if (!payload.receive_manifest_end (total_size)) {
+			protocol_error (payload.get_last_error ());
+			return false;
+		}
+		return true;
+	}
+
+	// Multi-source pull
+	bool send_source_offer (const QString & our_username, const Payload::Manager & source) {
+		// Offer and checksums of a shared payload
+		auto our_host_id = host_id ();
+		return send_content_message (Message::Offer, std::tie (our_username, source, our_host_id)) &&
+		       send_content_message (Message::Checksums, source.get_file_checksums ());
+	}
+	bool receive_checksum_list (Payload::Manager::ChecksumList & checksums) {
+		stream >> checksums;
+		return check_stream ();
+	}
+	bool send_range_request (qint64 offset, qint64 length) {
+		return send_content_message (Message::RangeRequest, std::tie (offset, length));
+	}
+	bool receive_range_request (qint64 & offset, qint64 & length) {
+		stream >> std::tie (offset, length);
+		return check_stream ();
+	}
+	bool send_range (Payload::Manager & source, qint64 offset, qint64 length) {
+		// Cut in pieces, each in its own frame
+		while (length > 0) {
+			auto piece = qMin (length, Const::pull_range_piece_size);
+			stream << Message::CodeType (Message::Range)
+			       << Message::SizePrefixType (sizeof (offset) + piece) << offset;
+			if (!source.transfer_range (stream, offset, piece)) {
+				failure (tr ("Send range error: %1").arg (source.get_last_error ()));
+				return false;
+			}
+			if (!check_stream ())
+				return false;
+			offset += piece;
+			length -= piece;
+		}
+		return true;
+	}
+	// Range frames are received in two steps, so that the range can be checked before writing it
+	bool receive_range_header (qint64 & offset, qint64 & length) {
+		stream >> offset;
+		length = qint64 (next_msg_size) - qint64 (sizeof (offset));
+		if (!check_stream ())
+			return false;
+		if (length <= 0) {
+			protocol_error ("Empty range");
+			return false;
+		}
+		return true;
+	}
+	bool receive_range_data (Payload::Manager & target, qint64 offset, qint64 length) {
+		if (!target.transfer_range (stream, offset, length)) {
+			failure (tr ("Receive range error: %1").arg (target.get_last_error ()));
+			return false;
+		}
+		return check_stream ();
+	}
+
+	bool is_peer_on_same_host (void) const {
+		return !peer_host_id.isEmpty () && peer_host_id == host_id ();
+	}
+	bool send_local_source (void) {
+		auto dir = payload.get_payload_dir_path ();
+		auto identities = payload.get_source_identities ();
+		return send_content_message (Message::LocalSource, std::tie (dir, identities));
+	}
+	bool receive_local_source (bool & is_usable) {
+		// Usable if we see the same files as the sender at this path
+		QString dir;
+		Payload::SourceIdentities identities;
+		stream >> std::tie (dir, identities);
+		if (!check_stream ())
+			return false;
+		is_usable =
+		    QDir::isAbsolutePath (dir) && payload.set_copy_source (QDir (dir), std::move (identities));
+		return true;
+	}
+
+public:
+	/* Writes the next step of the main stream of a sending payload:
+	 * a chunk, or a batch if small files are next (links have no data), then checksums if due.
+	 * Also used to produce the shared stream of fan-out uploads (see SharedStream).
+	 * Returns false with an error if the payload failed (stream errors are left to the caller).
+	 */
+	static bool write_next_frames (QDataStream & out, Payload::Manager & source,
+	                               Payload::Manager::ChecksumList & checksums, QString & error) {
+		if (!source.skip_links ()) {
+			error = tr ("Send chunk error: %1").arg (source.get_last_error ());
+			return false;
+		}
+		auto batch = source.next_inline_batch ();
+		if (batch.nb_files > 0) {
+			auto size = Serialized::inline_batch_size (batch.data_size);
+			out << Message::CodeType (Message::InlineBatch) << Message::SizePrefixType (size);
+			if (!source.send_inline_batch (out, batch)) {
+				error = tr ("Send chunk error: %1").arg (source.get_last_error ());
+				return false;
+			}
+		} else {
+			auto size = source.next_chunk_size ();
+			Q_ASSERT (size <= Message::max_size);
+			if (size > 0) {
+				out << Message::CodeType (Message::Chunk) << Message::SizePrefixType (size);
+				if (!source.send_next_chunk (out)) {
+					error = tr ("Send chunk error: %1").arg (source.get_last_error ());
+					return false;
+				}
+			}
+		}
+		// Checksums are grouped, and all sent at the end of the main stream
+		if (source.get_nb_pending_checksums () >= Const::checksums_per_frame ||
+		    !source.has_unsent_files ()) {
+			source.take_pending_checksums (checksums);
+			if (checksums.get_nb_files () > 0)
+				out << Message::CodeType (Message::Checksums)
+				    << Message::SizePrefixType (Serialized::compute_size (checksums)) << checksums;
+		}
+		return true;
+	}
+
+protected:
 	bool send_next_chunk (void) {
-		auto size = payload.next_chunk_size ();
-		Q_ASSERT (size > 0); // Should not be called if no more chunks
-		Q_ASSERT (size <= Message::max_size);
-		stream << Message::CodeType (Message::Chunk) << Message::SizePrefixType (size);
-		if (!payload.send_next_chunk (stream)) {
-			failure (tr ("Send chunk error: %1").arg (payload.get_last_error ()));
+		QString send_error;
+		auto buffered = write_buffer_size ();
+		if (!write_next_frames (stream, payload, checksum_buffer, send_error)) {
+			failure (send_error);
 			return false;
 		}
 		if (!check_stream ())
 			return false;
-		// Send checksums if any
-		auto checksums = payload.take_pending_checksums ();
-		if (!checksums.empty ())
-			return send_content_message (Message::Checksums, checksums);
+		auto sent = write_buffer_size () - buffered;
+		LOCALSHARE_TRACE (send_chunk, transfer_id, sent, payload.get_current_index ());
+		EventLog::record (EventLog::ChunkSent, transfer_id, sent, payload.get_current_index ());
 		notifier.may_progress ();
 		return true;
 	}
 	bool receive_next_chunk (void) {
+		// Also receive the run of Chunk frames that follows, if already buffered
 		Q_ASSERT (next_msg_size > 0);
-		if (!payload.receive_chunk (stream, next_msg_size)) {
-			failure (tr ("Receive chunk error: %1").arg (payload.get_last_error ()));
+		auto chunk_size = next_msg_size;
+		if (chunk_size > Const::max_frame_size) {
+			protocol_error ("Chunk larger than the announced max frame size");
 			return false;
 		}
+		qint64 received = 0;
+		for (int nb_chunks = 1;; ++nb_chunks) {
+			if (!payload.receive_chunk (stream, chunk_size)) {
+				failure (tr ("Receive chunk error: %1").arg (payload.get_last_error ()));
+				return false;
+			}
+			if (!check_stream ())
+				return false;
+			LOCALSHARE_TRACE (receive_chunk, transfer_id, chunk_size, payload.get_current_index ());
+			received += chunk_size;
+			if (nb_chunks == Const::frames_per_batch)
+				break;
+			Message::CodeType code;
+			Message::SizePrefixType size;
+			if (!peek_frame (code, size) || code != Message::Chunk || size == 0 ||
+			    size > Const::max_frame_size)
+				break;
+			consume_frame (Message::header_size, size);
+			chunk_size = size;
+		}
+		// One event per batch
+		EventLog::record (EventLog::ChunksReceived, transfer_id, received,
+		                  payload.get_current_index ());
+		notifier.may_progress ();
+		return may_send_ack ();
+	}
+	bool receive_checksums (void) {
+		stream >> checksum_buffer;
 		if (!check_stream ())
 			return false;
+		if (!payload.test_checksums (checksum_buffer)) {
+			failure (payload.get_last_error ());
+			return false;
+		}
+		if (!send_retry_requests ())
+			return false;
 		notifier.may_progress ();
 		return true;
 	}
-	bool receive_checksums (void) {
-		Payload::Manager::ChecksumList checksums;
-		stream >> checksums;
+	bool receive_inline_batch (void) {
+		quint32 nb_files;
+		stream >> nb_files;
 		if (!check_stream ())
 			return false;
-		if (!payload.test_checksums (checksums)) {
-			failure (payload.get_last_error ());
+		if (!payload.skip_links ()) {
+			failure (tr ("Receive chunk error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		auto data_size = payload.inline_batch_data_size (nb_files);
+		if (data_size < 0 || Serialized::inline_batch_size (data_size) != next_msg_size) {
+			protocol_error (QString ("Inline batch does not match the manifest: %1 files").arg (nb_files));
+			return false;
+		}
+		if (!payload.receive_inline_batch (stream, nb_files, data_size)) {
+			failure (tr ("Receive chunk error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		if (!check_stream () || !send_retry_requests ())
+			return false;
+		notifier.may_progress ();
+		return may_send_ack ();
+	}
+	bool send_retry_requests (void) {
+		for (auto index : payload.take_retry_requests ()) {
+			qWarning ("Transfer[%p]: bad checksum for file %u, asking for a retry", this, index);
+			if (!send_content_message (Message::Retry, index))
+				return false;
+		}
+		return true;
+	}
+
+	// Acknowledgements (receiver to sender progress)
+	bool may_send_ack (void) {
+		if (ack_timer.isValid () && ack_timer.elapsed () < Const::ack_interval_msec)
+			return true;
+		ack_timer.start ();
+		return send_content_message (Message::Ack, payload.get_total_transfered_size ());
+	}
+	bool receive_ack (void) {
+		qint64 bytes_written;
+		stream >> bytes_written;
+		if (!check_stream ())
+			return false;
+		if (!(0 <= bytes_written && bytes_written <= payload.get_total_size ())) {
+			protocol_error (QString ("Ack out of range: %1").arg (bytes_written));
 			return false;
 		}
+		notifier.set_acknowledged (bytes_written);
 		notifier.may_progress ();
 		return true;
 	}
 
+	// Retries
+	bool receive_retry (void) {
+		quint32 index;
+		stream >> index;
+		if (!check_stream ())
+			return false;
+		if (!payload.queue_resend (index)) {
+			protocol_error (payload.get_last_error ());
+			return false;
+		}
+		return true;
+	}
+	bool send_next_resend_chunk (void) {
+		// Sends the Resend header, then chunks of the file, then its checksum
+		if (!payload.is_resending ()) {
+			quint32 index;
+			if (!payload.start_resend (index)) {
+				failure (tr ("Resend error: %1").arg (payload.get_last_error ()));
+				return false;
+			}
+			return send_content_message (Message::Resend, index);
+		}
+		auto size = payload.next_resend_chunk_size ();
+		if (size == 0) {
+			payload.take_resend_checksum (checksum_buffer);
+			return send_content_message (Message::Checksums, checksum_buffer);
+		}
+		stream << Message::CodeType (Message::Chunk) << Message::SizePrefixType (size);
+		if (!payload.send_resend_chunk (stream)) {
+			failure (tr ("Send chunk error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		return check_stream ();
+	}
+	bool receive_resend (void) {
+		quint32 index;
+		stream >> index;
+		if (!check_stream ())
+			return false;
+		if (!payload.receive_again (index)) {
+			failure (tr ("Resend error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		return true;
+	}
+
 private:
 	// Basic message primitives
 
 	bool send_handshake (void) {
-		stream << std::tie (Const::protocol_magic, Const::protocol_version);
+		auto ours = Capabilities::ours ();
+		stream << std::tie (Const::protocol_magic, Const::protocol_version)
+		       << Message::SizePrefixType (Serialized::compute_size (ours)) << ours;
 		return check_stream ();
 	}
 	bool receive_handshake (void) {
 		// Returns true if can continue to receive stuff
-		if (socket->bytesAvailable () < serialized_info.handshake_size)
-			return false;
-		std::remove_const<decltype (Const::protocol_magic)>::type magic;
-		std::remove_const<decltype (Const::protocol_version)>::type version;
-		stream >> std::tie (magic, version);
-		if (!check_stream ())
+		constexpr auto header_size =
+		    Serialized::handshake_size + qint64 (sizeof (Message::SizePrefixType));
+		char header[header_size];
+		auto peeked = socket->peek (header, header_size);
+		if (peeked < Serialized::handshake_size)
 			return false;
+		// Checked before waiting for capabilities: older peers do not send them
+		auto magic = qFromBigEndian<quint16> (reinterpret_cast<const uchar *> (header));
+		auto version = qFromBigEndian<quint16> (reinterpret_cast<const uchar *> (header + 2));
 		if (magic != Const::protocol_magic) {
 			protocol_error ("Magic check failed");
 			return false;
 		}
-		if (version != Const::protocol_version) {
-			failure (tr ("Protocol version mismatch: %1 vs %2").arg (version, Const::protocol_version));
+		if (version < Const::min_protocol_version) {
+			failure (tr ("Protocol version mismatch: %1, at least %2 is needed")
+			             .arg (version)
+			             .arg (Const::min_protocol_version));
 			return false;
 		}
-		status = WaitingForCode;
+		if (peeked < header_size)
+			return false;
+		auto size = qFromBigEndian<Message::SizePrefixType> (
+		    reinterpret_cast<const uchar *> (header + Serialized::handshake_size));
+		if (size > Serialized::capabilities_max_size) {
+			protocol_error ("Capabilities too large");
+			return false;
+		}
+		if (socket->bytesAvailable () < header_size + qint64 (size))
+			return false;
+		// Parsed from a copy: keys after the known ones must not desynchronize the stream
+		stream.skipRawData (int(header_size));
+		QByteArray data (int(size), Qt::Uninitialized);
+		stream.readRawData (data.data (), int(size));
+		if (!check_stream ())
+			return false;
+		QDataStream data_stream (data);
+		data_stream.setVersion (Const::serializer_version);
+		Capabilities peer;
+		data_stream >> peer;
+		if (data_stream.status () != QDataStream::Ok) {
+			protocol_error ("Bad capabilities");
+			return false;
+		}
+		capabilities = Capabilities::negotiate (Capabilities::ours (), peer);
+		qDebug ("Transfer[%p]: peer protocol %u, common %s", this, version,
+		        qUtf8Printable (capabilities.describe ()));
+		if (!(capabilities.hashes & Capabilities::HashMd5)) {
+			failure (tr ("No checksum algorithm in common with the peer"));
+			return false;
+		}
+		status = WaitingForMessage;
 		on_handshake_completed ();
 		return true;
 	}
 
 	template <typename Msg> bool send_content_message (Message::Code code, const Msg & msg) {
-		auto size = serialized_info.compute_size (msg);
+		auto size = Serialized::compute_size (msg);
 		Q_ASSERT (size < Message::max_size);
 		stream << Message::CodeType (code) << Message::SizePrefixType (size) << msg;
 		return check_stream ();
 	}
-	bool receive_message (void) {
-		// Returns true if can continue to receive stuff
-		if (status == WaitingForCode) {
-			if (socket->bytesAvailable () < serialized_info.message_code_size)
-				return false;
-			stream >> next_msg_code;
+	/* Peek the header of the next frame, without consuming anything.
+	 * Returns true if the frame is complete (header and content are buffered).
+	 * size is only set for messages with content.
+	 */
+	bool peek_frame (Message::CodeType & code, Message::SizePrefixType & size) const {
+		char header[Message::header_size];
+		if (buffered < Message::code_size)
+			return false;
+		auto peeked = socket->peek (header, qMin (buffered, Message::header_size));
+		if (peeked < Message::code_size)
+			return false;
+		code = Message::decode_code (header);
+		if (!Message::has_content (code))
+			return true;
+		if (peeked < Message::header_size)
+			return false;
+		size = Message::decode_size (header);
+		return buffered >= Message::header_size + qint64 (size);
+	}
+	void consume_frame (qint64 header_size, qint64 content_size) {
+		// Skip the header; content is left for the handler to read
+		stream.skipRawData (header_size);
+		buffered -= header_size + content_size;
+	}
+
+	// Link probe messages
+
+	bool receive_ping (void) {
+		qint64 time_usec;
+		stream >> time_usec;
+		return check_stream () && send_content_message (Message::Pong, time_usec);
+	}
+	bool receive_pong (void) {
+		if (probe_state != ProbePinging) {
+			protocol_error ("Pong without Ping");
+			return false;
+		}
+		qint64 time_usec;
+		stream >> time_usec;
+		if (!check_stream ())
+			return false;
+		auto rtt_usec = probe_clock.nsecsElapsed () / 1000 - time_usec;
+		if (link_info.rtt_usec < 0 || rtt_usec < link_info.rtt_usec)
+			link_info.rtt_usec = qMax (rtt_usec, qint64 (0));
+		if (--probe_pings_left > 0)
+			return send_content_message (Message::Ping, qint64 (probe_clock.nsecsElapsed () / 1000));
+		probe_state = ProbeSending;
+		probe_sent = 0;
+		probe_burst_timer.start ();
+		return send_probe_burst ();
+	}
+	bool send_probe_burst (void) {
+		// Keeps the socket buffer filled until the end of the burst
+		static const QByteArray filler (int(Const::probe_frame_size), '\0');
+		while (write_buffer_size () < Const::probe_burst_buffer) {
+			if (probe_burst_timer.elapsed () >= Const::probe_burst_msec ||
+			    probe_sent >= Const::probe_max_burst_size) {
+				probe_state = ProbeWaitingReport;
+				return send_code_message (Message::ProbeEnd);
+			}
+			stream << Message::CodeType (Message::ProbeData)
+			       << Message::SizePrefixType (filler.size ());
+			stream.writeRawData (filler.constData (), filler.size ());
 			if (!check_stream ())
 				return false;
-			switch (next_msg_code) {
-			// After: get size
-			case Message::Error:
-			case Message::Offer:
-			case Message::Chunk:
-			case Message::Checksums:
-				status = WaitingForSize;
-				break;
-			// After : get next message code
+			probe_sent += filler.size ();
+		}
+		return true;
+	}
+	bool receive_probe_data (void) {
+		stream.skipRawData (next_msg_size);
+		if (!check_stream ())
+			return false;
+		if (probe_received < 0) {
+			probe_receive_timer.start (); // The first frame is not timed
+			probe_received = 0;
+		} else {
+			probe_received += next_msg_size;
+		}
+		return true;
+	}
+	bool receive_probe_end (void) {
+		auto bytes = qMax (probe_received, qint64 (0));
+		auto time_usec = probe_received < 0 ? qint64 (0) : probe_receive_timer.nsecsElapsed () / 1000;
+		probe_received = -1;
+		return send_content_message (Message::ProbeReport, std::tie (bytes, time_usec));
+	}
+	QString peer_link_key (void) const {
+		// Several peers can be behind one address (NAT, same host): the port tells them apart
+		return QStringLiteral ("%1:%2")
+		    .arg (socket->peerAddress ().toString ())
+		    .arg (socket->peerPort ());
+	}
+	bool receive_probe_report (void) {
+		if (probe_state != ProbeWaitingReport) {
+			protocol_error ("ProbeReport without probe");
+			return false;
+		}
+		qint64 bytes, time_usec;
+		stream >> std::tie (bytes, time_usec);
+		if (!check_stream ())
+			return false;
+		probe_state = NoProbe;
+		link_info.rate = time_usec > 0 ? bytes * 1000000 / time_usec : 0;
+		link_info.save (peer_link_key ());
+		on_probe_completed ();
+		return true;
+	}
+
+	bool receive_message (void) {
+		// Returns true if can continue to receive stuff
+		Message::CodeType code;
+		if (!peek_frame (code, next_msg_size))
+			return false;
+		next_msg_code = code;
+		LOCALSHARE_TRACE (frame, transfer_id, code, Message::has_content (code) ? next_msg_size : 0);
+		if (!Message::has_content (code)) {
+			consume_frame (Message::code_size, 0);
+			switch (code) {
 			case Message::Accept:
 				return on_receive_accept ();
 			case Message::Reject:
 				return on_receive_reject ();
 			case Message::Completed:
 				return on_receive_completed ();
+			case Message::LocalAccept:
+				return on_receive_local_accept ();
+			case Message::PullRequest:
+				return on_receive_pull_request ();
+			case Message::Heartbeat:
+				return true; // Only resets the timeout
+			case Message::ProbeEnd:
+				return receive_probe_end ();
 			default:
-				protocol_error (QString ("Unknown message type: %1").arg (next_msg_code, 0, 16));
+				protocol_error (QString ("Unknown message type: %1").arg (code, 0, 16));
 				return false;
 			}
 		}
-		if (status == WaitingForSize) {
-			if (socket->bytesAvailable () < serialized_info.message_size_prefix_size)
-				return false;
-			stream >> next_msg_size;
-			if (!check_stream ())
-				return false;
-			if (next_msg_size <= 0) {
-				protocol_error ("Next message size <= 0");
-				return false;
-			}
-			status = WaitingForContent;
+		if (next_msg_size <= 0) {
+			protocol_error ("Next message size <= 0");
+			return false;
 		}
-		if (status == WaitingForContent) {
-			if (socket->bytesAvailable () < next_msg_size)
-				return false;
-			switch (next_msg_code) {
-			case Message::Error: {
-				// After : nothing
-				QString error_msg;
-				stream >> error_msg;
-				if (check_stream ())
-					failure (tr ("Peer failed with: %1").arg (error_msg), CloseMode);
-				return false;
-			}
-			// After : get next message code
-			case Message::Offer:
-				status = WaitingForCode;
-				return on_receive_offer ();
-			case Message::Chunk:
-				status = WaitingForCode;
-				return on_receive_chunk ();
-			case Message::Checksums:
-				status = WaitingForCode;
-				return on_receive_checksums ();
-			default:
-				Q_UNREACHABLE ();
-				return false;
-			}
+		consume_frame (Message::header_size, next_msg_size);
+		switch (code) {
+		case Message::Error: {
+			// After : nothing
+			QString error_msg;
+			stream >> error_msg;
+			if (check_stream ())
+				failure (tr ("Peer failed with: %1").arg (error_msg), CloseMode);
+			return false;
+		}
+		case Message::Offer:
+			return on_receive_offer ();
+		case Message::Chunk:
+			return on_receive_chunk ();
+		case Message::Checksums:
+			return on_receive_checksums ();
+		case Message::LocalSource:
+			return on_receive_local_source ();
+		case Message::Retry:
+			return on_receive_retry ();
+		case Message::Resend:
+			return on_receive_resend ();
+		case Message::Ack:
+			return on_receive_ack ();
+		case Message::Manifest:
+			return on_receive_manifest ();
+		case Message::ManifestEnd:
+			return on_receive_manifest_end ();
+		case Message::RangeRequest:
+			return on_receive_range_request ();
+		case Message::Range:
+			return on_receive_range ();
+		case Message::InlineBatch:
+			return on_receive_inline_batch ();
+		case Message::Ping:
+			return receive_ping ();
+		case Message::Pong:
+			return receive_pong ();
+		case Message::ProbeData:
+			return receive_probe_data ();
+		case Message::ProbeReport:
+			return receive_probe_report ();
+		case Message::Queued:
+			return on_receive_queued ();
+		default:
+			Q_UNREACHABLE ();
+			return false;
 		}
+	}
+};
+
+/* Main stream of a payload, produced once for the uploads of a fan-out (one payload to N peers).
+ * The payload is scanned once, and each upload sends a copy of its file list in its offer.
+ * Uploads that accept join the stream, as readers with a cursor in a buffer of frames.
+ * Frames are read and hashed once, on demand of the fastest reader, then kept until all readers
+ * have sent them (and the readers that were expected have joined, see fanout_join_wait_msec).
+ * Readers that cannot join (late) send the payload on their own, like a normal upload.
+ * Retries are sent by each upload from its copy, after the end of the shared stream.
+ *
+ * The buffer holds at most Const::fanout_lag_window bytes: the fastest reader waits beyond it.
+ * If this lasts Const::fanout_stall_msec, the slowest reader is detached: its upload continues on
+ * its own from its copy of the payload, at its cursor (see Payload::Manager::resume_main_stream).
+ * The stream is shared between uploads with a shared pointer, and lives as long as they do.
+ */
+class SharedStream : public QObject {
+	Q_OBJECT
+
+public:
+	struct Frame {
+		QByteArray data;          // Serialized frames
+		qint64 total_transfered;  // Payload progress after them
+		quint32 nb_files_sent;
+		int nb_files_transfered;
+	};
+
+private:
+	Payload::Manager source;
+	Payload::Manager::ChecksumList checksum_buffer;
+	bool started{false};
+	QString error;
+
+	std::deque<Frame> frames;
+	quint64 first_seq{0}; // Of frames.front ()
+	qint64 buffered_bytes{0};
+	QHash<const QObject *, quint64> cursors; // Readers, with the sequence of their next frame
+	int nb_expected{0};                      // Uploads that may still join
+	bool joins_closed{false};
+	bool blocked{false}; // A reader waits for the buffer to move
+	QTimer join_timer;
+	QTimer stall_timer;
+
+signals:
+	void frames_available (void);
+	void reader_detached (const QObject * reader);
+	void failed (QString error);
+
+public:
+	SharedStream () {
+		Payload::Manager::CacheMode cache_mode;
+		if (Payload::Manager::cache_mode_from_name (Settings::CacheMode ().get (), cache_mode))
+			source.set_cache_mode (cache_mode);
+		join_timer.setSingleShot (true);
+		stall_timer.setSingleShot (true);
+		connect (&join_timer, &QTimer::timeout, [this] { close_joins (); });
+		connect (&stall_timer, &QTimer::timeout, [this] { on_stall (); });
+	}
+
+	bool set_payload (const QString & path, bool send_hidden_files,
+	                  const Payload::Filter & filter = Payload::Filter ()) {
+		Watchdog::Scope watch (Watchdog::PayloadScan);
+		if (!source.from_source_path (path, !send_hidden_files, filter)) {
+			error = source.get_last_error ();
+			return false;
+		}
+		source.set_chunk_size (Const::fanout_chunk_size);
+		return true;
+	}
+	const Payload::Manager & get_payload (void) const { return source; }
+	QString get_error (void) const { return error; }
+	void set_cache_mode (Payload::Manager::CacheMode mode) { source.set_cache_mode (mode); }
+
+	// Readers
+
+	void expect_reader (void) { ++nb_expected; }
+	void cancel_reader (void) {
+		// An expected reader will not join
+		if (nb_expected > 0)
+			--nb_expected;
+		trim ();
+	}
+	bool join (const QObject * reader) {
+		if (nb_expected > 0)
+			--nb_expected;
+		if (joins_closed || first_seq > 0)
+			return false; // Start of the stream is gone
+		cursors.insert (reader, 0);
+		if (!join_timer.isActive ())
+			join_timer.start (Const::fanout_join_wait_msec);
 		return true;
 	}
+	void leave (const QObject * reader) {
+		cursors.remove (reader);
+		trim ();
+	}
+
+	// Next frame of a reader, produced if needed. Null if it must wait, at the end, or on error.
+	const Frame * peek (const QObject * reader) {
+		Q_ASSERT (cursors.contains (reader));
+		auto seq = cursors.value (reader);
+		if (seq < first_seq + frames.size ())
+			return &frames[seq - first_seq];
+		return produce () ? &frames.back () : nullptr;
+	}
+	void pop (const QObject * reader) {
+		Q_ASSERT (cursors.contains (reader));
+		++cursors[reader];
+		trim ();
+	}
+	bool is_at_end (const QObject * reader) const {
+		return started && !source.has_unsent_files () &&
+		       cursors.value (reader) == first_seq + frames.size ();
+	}
+
+private:
+	bool produce (void) {
+		if (!error.isEmpty ())
+			return false;
+		if (!started) {
+			source.start_transfer (Payload::Manager::Sending);
+			started = true;
+		}
+		if (!source.has_unsent_files ())
+			return false;
+		if (buffered_bytes >= Const::fanout_lag_window) {
+			blocked = true;
+			if (!stall_timer.isActive ())
+				stall_timer.start (Const::fanout_stall_msec);
+			return false;
+		}
+		Frame frame;
+		QDataStream out (&frame.data, QIODevice::WriteOnly);
+		out.setVersion (Const::serializer_version);
+		if (!Base::write_next_frames (out, source, checksum_buffer, error)) {
+			emit failed (error);
+			return false;
+		}
+		frame.total_transfered = source.get_total_transfered_size ();
+		frame.nb_files_sent = source.get_current_index ();
+		frame.nb_files_transfered = source.get_nb_files_transfered ();
+		buffered_bytes += frame.data.size ();
+		frames.push_back (std::move (frame));
+		return true;
+	}
+
+	void trim (void) {
+		// Drop frames sent by all readers, unless expected readers may still join
+		if (!joins_closed && nb_expected > 0)
+			return;
+		auto min_seq = first_seq + frames.size ();
+		for (auto seq : cursors)
+			min_seq = qMin (min_seq, seq);
+		if (min_seq == first_seq)
+			return;
+		while (first_seq < min_seq) {
+			buffered_bytes -= frames.front ().data.size ();
+			frames.pop_front ();
+			++first_seq;
+		}
+		stall_timer.stop ();
+		if (blocked) {
+			blocked = false;
+			emit frames_available ();
+		}
+	}
+
+	void close_joins (void) {
+		joins_closed = true;
+		nb_expected = 0;
+		trim ();
+	}
+	void on_stall (void) {
+		if (buffered_bytes < Const::fanout_lag_window)
+			return;
+		if (!joins_closed && nb_expected > 0) {
+			close_joins (); // Waiting for joins: let the stream move on
+			return;
+		}
+		// Detach the slowest reader
+		const QObject * slowest = nullptr;
+		for (auto it = cursors.begin (); it != cursors.end (); ++it)
+			if (slowest == nullptr || it.value () < cursors.value (slowest))
+				slowest = it.key ();
+		if (slowest == nullptr)
+			return;
+		cursors.remove (slowest);
+		qWarning ("SharedStream: detaching a reader lagging by %lld bytes",
+		          static_cast<long long> (buffered_bytes));
+		emit reader_detached (slowest);
+		trim ();
+	}
 };
 
 /* Upload class.
  * Split initialization (start), to allow catching files search errors.
  * Can be displayed from the beginning (after start).
+ *
+ * With a pipelined payload, the directory scan continues in the background (continue_scan).
+ * New files are announced to the peer after each scan step, and data is sent as soon as possible.
  */
 class Upload : public Base {
 	Q_OBJECT
 
 public:
 	enum Status { Error, Init, Starting, WaitingForPeerAnswer, Transfering, Completed, Rejected };
+	enum ProbeMode {
+		ProbeIfNeeded, // Unless the link was measured recently (see LinkInfo::load)
+		ProbeAlways,
+		ProbeNever // Use default parameters
+	};
 
 private:
 	const QString our_username;
 	Status status;
+	bool copied_by_peer{false}; // Peer on same host is copying files from our disk
+	QTimer pacing_timer;        // Resumes sending after a userspace pacing pause
+	ProbeMode probe_mode{ProbeIfNeeded};
+	qint64 send_window{Const::write_buffer_size}; // Data kept in the socket buffer
+	int queue_position{0}; // In the receive queue of the peer, 0 if not queued
+
+	// Fan-out: the main stream comes from a SharedStream, if joined at accept
+	enum SharedState { NotShared, SharedExpected, SharedJoined, SharedLeft };
+	std::shared_ptr<SharedStream> shared;
+	SharedState shared_state{NotShared};
 
 signals:
 	void status_changed (Status new_status, Status old_status);
+	void queue_position_changed (int position);
 
 public:
 	Upload (const QString & peer_username, const QString & our_username, QObject * parent = nullptr)
 	    : Base (new QTcpSocket, peer_username, parent), our_username (our_username), status (Init) {
-		QObject::connect (this, &Base::failed, [this] { set_status (Error); });
+		QObject::connect (this, &Base::failed, [this] {
+			leave_shared_stream ();
+			set_status (Error);
+		});
+		notifier.use_acknowledged_progress ();
+		pacing_timer.setSingleShot (true);
+		QObject::connect (&pacing_timer, &QTimer::timeout, [this] {
+			if (status == Transfering && !copied_by_peer)
+				resume_sending ();
+		});
 	}
 
-	bool set_payload (const QString & file_path_to_send, bool send_hidden_files) {
+	bool set_payload (const QString & file_path_to_send, bool send_hidden_files,
+	                  bool pipelined = false, const Payload::Filter & filter = Payload::Filter ()) {
 		Q_ASSERT (status == Init);
-		if (!payload.from_source_path (file_path_to_send, !send_hidden_files)) {
+		Watchdog::Scope watch (Watchdog::PayloadScan);
+		auto ok = pipelined ? payload.start_scan (file_path_to_send, !send_hidden_files, filter)
+		                    : payload.from_source_path (file_path_to_send, !send_hidden_files, filter);
+		if (!ok) {
 			failure (tr ("Cannot get file information: %1").arg (payload.get_last_error ()), AbortMode);
 			return false;
 		}
+		if (!payload.is_manifest_complete ())
+			QTimer::singleShot (0, this, SLOT (continue_scan ()));
+		return true;
+	}
+
+	~Upload () { leave_shared_stream (); }
+
+	// Fan-out: send the payload of a shared stream, instead of set_payload
+	bool set_shared_payload (const std::shared_ptr<SharedStream> & stream) {
+		Q_ASSERT (status == Init);
+		if (!payload.copy_file_list (stream->get_payload ())) {
+			failure (tr ("Cannot get file information: %1").arg (stream->get_error ()), AbortMode);
+			return false;
+		}
+		shared = stream;
+		shared_state = SharedExpected;
+		shared->expect_reader ();
+		QObject::connect (shared.get (), &SharedStream::frames_available, this, [this] {
+			if (status == Transfering && shared_state == SharedJoined)
+				resume_sending ();
+		});
+		QObject::connect (shared.get (), &SharedStream::reader_detached, this,
+		                  [this](const QObject * reader) {
+			                  if (reader != this || shared_state != SharedJoined)
+				                  return;
+			                  // Too slow to share: continues on its own, from the last frame sent
+			                  shared_state = SharedLeft;
+			                  payload.resume_main_stream ();
+			                  if (status == Transfering)
+				                  resume_sending ();
+		                  });
+		QObject::connect (shared.get (), &SharedStream::failed, this, [this](const QString & error) {
+			if (shared_state == SharedJoined)
+				failure (error);
+		});
 		return true;
 	}
 
@@ -604,20 +1642,124 @@ public:
 	}
 
 	Status get_status (void) const { return status; }
+	// Position in the receive queue of the peer while WaitingForPeerAnswer (0 if not queued)
+	int get_queue_position (void) const { return queue_position; }
+
+	void set_probe_mode (ProbeMode mode) {
+		Q_ASSERT (status == Init);
+		probe_mode = mode;
+	}
+
+private slots:
+	void continue_scan (void) {
+		if (!(status == Init || status == Starting || status == WaitingForPeerAnswer ||
+		      status == Transfering))
+			return; // Finished or failed
+		Watchdog::Scope watch (Watchdog::PayloadScan);
+		if (!payload.scan_step ()) {
+			auto connected = status == WaitingForPeerAnswer || status == Transfering;
+			failure (tr ("Cannot get file information: %1").arg (payload.get_last_error ()),
+			         connected ? SendNoticeAndCloseMode : AbortMode);
+			return;
+		}
+		if (status == WaitingForPeerAnswer || status == Transfering) {
+			// Offer is sent: announce new files (before any of their data)
+			if (payload.has_unannounced_files () && !send_manifest_page ())
+				return;
+			if (payload.is_manifest_complete () && !send_manifest_end ())
+				return;
+		}
+		if (!payload.is_manifest_complete ())
+			QTimer::singleShot (0, this, SLOT (continue_scan ()));
+		if (status == Transfering && !copied_by_peer)
+			resume_sending ();
+	}
+	void continue_resume (void) {
+		// Hashing after a detach writes nothing: no bytesWritten to continue from
+		if (status == Transfering)
+			resume_sending ();
+	}
 
 private:
 	void set_status (Status new_status) {
 		auto old = status;
+		EventLog::record (EventLog::UploadStatus, get_transfer_id (), new_status, old);
 		status = new_status;
 		emit status_changed (new_status, old);
 	}
+	bool has_data_to_send (void) {
+		if (shared_state == SharedJoined) {
+			if (shared->peek (this) != nullptr)
+				return true; // May have produced the frame
+			if (!shared->is_at_end (this))
+				return false; // Waits for slower readers, resumed by frames_available
+			leave_shared_stream ();
+			payload.end_shared_stream ();
+		}
+		return payload.is_resuming () || payload.has_unsent_files () || payload.has_pending_resend ();
+	}
+	bool send_next (void) {
+		if (shared_state == SharedJoined)
+			return send_next_shared_frame ();
+		if (payload.is_resuming ())
+			return resume_main_stream ();
+		// Resends start when the main stream has nothing (they are not interrupted)
+		if (!payload.is_resending () && payload.has_unsent_files ())
+			return send_next_chunk ();
+		else
+			return send_next_resend_chunk ();
+	}
+	bool send_next_shared_frame (void) {
+		auto frame = shared->peek (this);
+		Q_ASSERT (frame != nullptr);
+		if (get_socket ()->write (frame->data) != frame->data.size ()) {
+			failure (tr ("Sending data failed: %1").arg (get_socket ()->errorString ()), AbortMode);
+			return false;
+		}
+		payload.set_shared_progress (frame->total_transfered, frame->nb_files_sent,
+		                             frame->nb_files_transfered);
+		shared->pop (this);
+		notifier.may_progress ();
+		return true;
+	}
+	bool resume_main_stream (void) {
+		// Detached from the shared stream: hash what it sent, in steps, before sending on our own
+		if (!payload.resume_step ()) {
+			failure (tr ("Send chunk error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		if (payload.is_resuming ())
+			QTimer::singleShot (0, this, SLOT (continue_resume ()));
+		return true;
+	}
+	void leave_shared_stream (void) {
+		if (shared_state == SharedExpected)
+			shared->cancel_reader ();
+		else if (shared_state == SharedJoined)
+			shared->leave (this);
+		if (shared_state != NotShared)
+			shared_state = SharedLeft;
+	}
+
+	bool resume_sending (void) {
+		// Restart sending if it stopped (no more bytesWritten signals if idle)
+		return refill_send_buffer ();
+	}
+
 	bool refill_send_buffer (void) {
+		Watchdog::Scope watch (Watchdog::RefillSendBuffer);
 		QElapsedTimer timer;
 		timer.start ();
-		while (write_buffer_size () < Const::write_buffer_size &&
-		       payload.get_total_transfered_size () < payload.get_total_size ()) {
-			if (!send_next_chunk ())
+		while (write_buffer_size () < send_window && has_data_to_send ()) {
+			if (auto wait = pacer.wait_msec ()) {
+				if (!pacing_timer.isActive ())
+					pacing_timer.start (wait);
+				return true;
+			}
+			auto before = write_buffer_size ();
+			if (!send_next ())
 				return false;
+			pacer.consume (write_buffer_size () - before);
 			if (timer.elapsed () > Const::max_work_msec)
 				return true; // Return to event loop
 		}
@@ -630,24 +1772,53 @@ private:
 
 	void on_handshake_completed (void) Q_DECL_OVERRIDE {
 		Q_ASSERT (status == Starting);
+		if (probe_mode != ProbeNever && get_capabilities ().has (Capabilities::LinkProbe)) {
+			auto cached = LinkInfo::load (peer_link_key ());
+			if (probe_mode == ProbeAlways || !cached.is_valid ()) {
+				start_probe (); // Continues in on_probe_completed
+				return;
+			}
+			set_link_info (cached);
+		}
+		start_offer ();
+	}
+	void on_probe_completed (void) Q_DECL_OVERRIDE {
+		Q_ASSERT (status == Starting);
+		start_offer ();
+	}
+	void start_offer (void) {
+		// Tune the sender to the link (defaults if not measured)
+		auto & info = get_link_info ();
+		send_window = info.send_window ();
+		payload.set_chunk_size (qMin (info.chunk_size (), get_capabilities ().max_frame_size));
 		if (send_offer (our_username))
 			set_status (WaitingForPeerAnswer);
 	}
 	bool on_receive_accept (void) Q_DECL_OVERRIDE {
-		if (status != WaitingForPeerAnswer) {
+		if (!(status == WaitingForPeerAnswer || (status == Transfering && copied_by_peer))) {
 			protocol_error ("Accept when not WaitingForPeerAnswer");
 			return false;
 		}
+		copied_by_peer = false; // Fallback from same host copy
+		queue_position = 0;
 		payload.start_transfer (Payload::Manager::Sending);
+		// Shared chunks must fit in the frames the peer accepts
+		if (shared_state == SharedExpected &&
+		    get_capabilities ().max_frame_size >= Const::fanout_chunk_size && shared->join (this))
+			shared_state = SharedJoined;
+		else
+			leave_shared_stream (); // Sends on its own
 		notifier.transfer_start ();
-		set_status (Transfering);
-		return refill_send_buffer ();
+		if (status != Transfering)
+			set_status (Transfering);
+		return resume_sending ();
 	}
 	bool on_receive_reject (void) Q_DECL_OVERRIDE {
 		if (status != WaitingForPeerAnswer) {
 			protocol_error ("Reject when not WaitingForPeerAnswer");
 			return false;
 		}
+		leave_shared_stream ();
 		close_connection ();
 		set_status (Rejected);
 		return false;
@@ -657,15 +1828,31 @@ private:
 			protocol_error ("Completed when not Transfering");
 			return false;
 		}
+		if (copied_by_peer)
+			payload.set_copied_by_peer ();
 		if (!payload.is_transfer_complete ()) {
 			protocol_error ("Transfer not complete on sender");
 			return false;
 		}
+		notifier.set_acknowledged (payload.get_total_size ());
 		notifier.transfer_end ();
 		close_connection ();
 		set_status (Completed);
 		return true;
 	}
+	bool on_receive_local_accept (void) Q_DECL_OVERRIDE {
+		if (status != WaitingForPeerAnswer || !payload.is_manifest_complete ()) {
+			protocol_error ("LocalAccept when not WaitingForPeerAnswer or with incomplete manifest");
+			return false;
+		}
+		if (!send_local_source ())
+			return false;
+		leave_shared_stream (); // A fallback to Accept sends on its own
+		copied_by_peer = true;
+		notifier.transfer_start ();
+		set_status (Transfering);
+		return true;
+	}
 	bool on_receive_offer (void) Q_DECL_OVERRIDE {
 		protocol_error ("Offer in Upload");
 		return false;
@@ -678,6 +1865,65 @@ private:
 		protocol_error ("Checksums in Upload");
 		return false;
 	}
+	bool on_receive_local_source (void) Q_DECL_OVERRIDE {
+		protocol_error ("LocalSource in Upload");
+		return false;
+	}
+	bool on_receive_retry (void) Q_DECL_OVERRIDE {
+		if (status != Transfering || copied_by_peer) {
+			protocol_error ("Retry when not Transfering");
+			return false;
+		}
+		return receive_retry () && resume_sending ();
+	}
+	bool on_receive_resend (void) Q_DECL_OVERRIDE {
+		protocol_error ("Resend in Upload");
+		return false;
+	}
+	bool on_receive_ack (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Ack while not Transfering");
+			return false;
+		}
+		return receive_ack ();
+	}
+	bool on_receive_manifest (void) Q_DECL_OVERRIDE {
+		protocol_error ("Manifest in Upload");
+		return false;
+	}
+	bool on_receive_manifest_end (void) Q_DECL_OVERRIDE {
+		protocol_error ("ManifestEnd in Upload");
+		return false;
+	}
+	bool on_receive_pull_request (void) Q_DECL_OVERRIDE {
+		protocol_error ("PullRequest in Upload");
+		return false;
+	}
+	bool on_receive_range_request (void) Q_DECL_OVERRIDE {
+		protocol_error ("RangeRequest in Upload");
+		return false;
+	}
+	bool on_receive_range (void) Q_DECL_OVERRIDE {
+		protocol_error ("Range in Upload");
+		return false;
+	}
+	bool on_receive_inline_batch (void) Q_DECL_OVERRIDE {
+		protocol_error ("InlineBatch in Upload");
+		return false;
+	}
+	bool on_receive_queued (void) Q_DECL_OVERRIDE {
+		if (status != WaitingForPeerAnswer) {
+			protocol_error ("Queued when not WaitingForPeerAnswer");
+			return false;
+		}
+		quint32 position;
+		stream >> position;
+		if (!check_stream ())
+			return false;
+		queue_position = int(position);
+		emit queue_position_changed (queue_position);
+		return true;
+	}
 };
 
 /* Download class.
@@ -694,6 +1940,7 @@ public:
 		Starting,
 		WaitingForOffer,
 		WaitingForUserChoice,
+		Queued, // Accepted, waiting for the target disk (see ReceiveScheduler)
 		Transfering,
 		Completed,
 		Rejected
@@ -702,9 +1949,12 @@ public:
 
 private:
 	Status status;
+	bool same_host_copy{true};
+	int queue_position{0}; // While Queued
 
 signals:
 	void status_changed (Status new_status, Status old_status);
+	void queue_position_changed (int position);
 
 public:
 	Download (QAbstractSocket * socket, QObject * parent = nullptr)
@@ -714,19 +1964,26 @@ public:
 	}
 
 	Status get_status (void) const { return status; }
+	int get_queue_position (void) const { return queue_position; }
 
 	void set_target_dir (const QString & path) {
 		Q_ASSERT (status == WaitingForUserChoice);
 		payload.set_root_dir (path);
 	}
+	void set_same_host_copy (bool enabled) {
+		// Copy files directly from the sender disk if it is on the same host (default)
+		Q_ASSERT (status == WaitingForUserChoice);
+		same_host_copy = enabled;
+	}
 	void give_user_choice (UserChoice choice) {
 		Q_ASSERT (status == WaitingForUserChoice);
 		if (choice == Accept) {
-			if (!send_code_message (Message::Accept))
-				return;
-			payload.start_transfer (Payload::Manager::Receiving);
-			notifier.transfer_start ();
-			set_status (Transfering);
+			// Starts when admitted by the scheduler (maybe now). Until then Accept is not sent,
+			// so the peer does not read or send anything.
+			ReceiveScheduler::instance ().enqueue (
+			    this, payload.get_root_dir ().path (),
+			    [this] { return payload.get_total_transfered_size (); },
+			    [this](int position) { set_queue_position (position); });
 		} else {
 			send_code_message (Message::Reject);
 			close_connection ();
@@ -734,12 +1991,69 @@ public:
 		}
 	}
 
+private slots:
+	void copy_local_files (void) {
+		if (status != Transfering)
+			return; // Failed in between
+		QElapsedTimer timer;
+		timer.start ();
+		while (!payload.is_transfer_complete ()) {
+			if (!payload.receive_local_copy ()) {
+				failure (tr ("Local copy error: %1").arg (payload.get_last_error ()));
+				return;
+			}
+			notifier.may_progress ();
+			if (!may_send_ack ())
+				return;
+			if (timer.elapsed () > Const::max_work_msec) {
+				QTimer::singleShot (0, this, SLOT (copy_local_files ()));
+				return;
+			}
+		}
+		complete_transfer ();
+	}
+
 private:
 	void set_status (Status new_status) {
 		auto old = status;
+		EventLog::record (EventLog::DownloadStatus, get_transfer_id (), new_status, old);
 		status = new_status;
+		if (new_status == Completed || new_status == Error || new_status == Rejected)
+			ReceiveScheduler::instance ().release (this); // Queued downloads may start
 		emit status_changed (new_status, old);
 	}
+	void set_queue_position (int position) {
+		if (position == 0) {
+			start_receiving ();
+			return;
+		}
+		queue_position = position;
+		if (status != Queued)
+			set_status (Queued);
+		emit queue_position_changed (position);
+		if (get_capabilities ().has (Capabilities::QueueNotice))
+			send_content_message (Message::Queued, quint32 (position));
+	}
+	void start_receiving (void) {
+		queue_position = 0;
+		// Same host copies need the full file list
+		auto local = same_host_copy && get_capabilities ().has (Capabilities::LocalCopy) &&
+		             is_peer_on_same_host () && payload.is_manifest_complete ();
+		auto code = local ? Message::LocalAccept : Message::Accept;
+		if (!send_code_message (code))
+			return;
+		payload.start_transfer (Payload::Manager::Receiving);
+		notifier.transfer_start ();
+		set_status (Transfering);
+	}
+	bool complete_transfer (void) {
+		if (!send_code_message (Message::Completed))
+			return false;
+		notifier.transfer_end ();
+		close_connection ();
+		set_status (Completed);
+		return true;
+	}
 
 	void on_handshake_completed (void) Q_DECL_OVERRIDE {
 		Q_ASSERT (status == Starting);
@@ -754,7 +2068,17 @@ private:
 		return false;
 	}
 	bool on_receive_completed (void) Q_DECL_OVERRIDE {
-		protocol_error ("Completed in Download");
+		if (status != WaitingForOffer) {
+			protocol_error ("Completed in Download");
+			return false;
+		}
+		// Connection of a link probe only (see Prober)
+		close_connection ();
+		set_status (Completed);
+		return false;
+	}
+	bool on_receive_local_accept (void) Q_DECL_OVERRIDE {
+		protocol_error ("LocalAccept in Download");
 		return false;
 	}
 	bool on_receive_offer (void) Q_DECL_OVERRIDE {
@@ -781,15 +2105,86 @@ private:
 		}
 		if (!receive_checksums ())
 			return false;
-		if (payload.is_transfer_complete ()) {
-			if (!send_code_message (Message::Completed))
-				return false;
-			notifier.transfer_end ();
-			close_connection ();
-			set_status (Completed);
+		if (payload.is_transfer_complete ())
+			return complete_transfer ();
+		return true;
+	}
+	bool on_receive_local_source (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("LocalSource while not Transfering");
+			return false;
+		}
+		bool is_usable = false;
+		if (!receive_local_source (is_usable))
+			return false;
+		if (!is_usable) {
+			qDebug ("Download[%p]: same host copy not possible, falling back to network", this);
+			return send_code_message (Message::Accept);
 		}
+		QTimer::singleShot (0, this, SLOT (copy_local_files ()));
 		return true;
 	}
+	bool on_receive_retry (void) Q_DECL_OVERRIDE {
+		protocol_error ("Retry in Download");
+		return false;
+	}
+	bool on_receive_resend (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Resend while not Transfering");
+			return false;
+		}
+		return receive_resend ();
+	}
+	bool on_receive_ack (void) Q_DECL_OVERRIDE {
+		protocol_error ("Ack in Download");
+		return false;
+	}
+	bool on_receive_manifest (void) Q_DECL_OVERRIDE {
+		if (!(status == WaitingForUserChoice || status == Queued || status == Transfering)) {
+			protocol_error ("Manifest while not WaitingForUserChoice, Queued or Transfering");
+			return false;
+		}
+		return receive_manifest ();
+	}
+	bool on_receive_manifest_end (void) Q_DECL_OVERRIDE {
+		if (!(status == WaitingForUserChoice || status == Queued || status == Transfering)) {
+			protocol_error ("ManifestEnd while not WaitingForUserChoice, Queued or Transfering");
+			return false;
+		}
+		if (!receive_manifest_end ())
+			return false;
+		if (status == Transfering && payload.is_transfer_complete ())
+			return complete_transfer ();
+		return true;
+	}
+	bool on_receive_pull_request (void) Q_DECL_OVERRIDE {
+		protocol_error ("PullRequest in Download");
+		return false;
+	}
+	bool on_receive_range_request (void) Q_DECL_OVERRIDE {
+		protocol_error ("RangeRequest in Download");
+		return false;
+	}
+	bool on_receive_range (void) Q_DECL_OVERRIDE {
+		protocol_error ("Range in Download");
+		return false;
+	}
+	bool on_receive_inline_batch (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("InlineBatch while not Transfering");
+			return false;
+		}
+		if (payload.is_resending ()) {
+			// Resent files always come as chunks
+			protocol_error ("InlineBatch while a file is resent");
+			return false;
+		}
+		return receive_inline_batch (); // Completion comes with the checksums of its files
+	}
+	bool on_receive_queued (void) Q_DECL_OVERRIDE {
+		protocol_error ("Queued in Download");
+		return false;
+	}
 };
 }
 
@@ -0,0 +1,191 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_WATCHDOG_H
+#define CORE_WATCHDOG_H
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QString>
+#include <QTimer>
+#include <array>
+
+#include "core_eventlog.h"
+#include "core_localshare.h"
+
+/* Event loop stall monitoring.
+ *
+ * Every handler that runs in the event loop blocks all others (transfers, GUI) while it runs.
+ * They should return within Const::max_work_msec, which this measures:
+ * - handlers are timed by a Scope object, and durations go to the histogram of their probe,
+ * - the dispatch latency is measured by a periodic timer (delay of its timeouts).
+ * Durations over Const::stall_warning_msec are logged with qWarning, with the probe name.
+ *
+ * The overhead of a Scope is two reads of the monotonic clock.
+ * The dispatch probe is only started on request (verbose mode).
+ * Everything runs in the main thread: no locking.
+ */
+namespace Watchdog {
+
+enum Probe {
+	DispatchLatency, // Delay of a timer: time during which the loop could not dispatch events
+	DataReceived,    // Parsing of received frames
+	RefillSendBuffer,
+	PayloadScan, // Payload directory scan, in one piece or by slices
+	PayloadHash, // Slices of hashing from disk (seed, pull verification)
+	Discovery,   // Zeroconf callbacks
+	NbProbes
+};
+inline const char * probe_name (Probe probe) {
+	switch (probe) {
+	case DispatchLatency:
+		return "dispatch latency";
+	case DataReceived:
+		return "data received";
+	case RefillSendBuffer:
+		return "refill send buffer";
+	case PayloadScan:
+		return "payload scan";
+	case PayloadHash:
+		return "payload hash";
+	case Discovery:
+		return "discovery";
+	default:
+		Q_UNREACHABLE ();
+		return "";
+	}
+}
+
+/* Histogram of durations, by power of 2 of microseconds.
+ * Bucket 0 counts durations under 1us, and bucket i those in [2^(i-1), 2^i) us.
+ * Percentiles are given as the upper bound of their bucket.
+ */
+class Histogram {
+public:
+	static constexpr int nb_buckets = 32;
+
+private:
+	std::array<quint64, nb_buckets> buckets{{}};
+	quint64 count{0};
+	qint64 total_usec{0};
+	qint64 max_usec{0};
+
+public:
+	void add (qint64 usec) {
+		int bucket = 0;
+		while (bucket < nb_buckets - 1 && (qint64 (1) << bucket) <= usec)
+			++bucket;
+		++buckets[bucket];
+		++count;
+		total_usec += usec;
+		max_usec = qMax (max_usec, usec);
+	}
+
+	quint64 get_count (void) const { return count; }
+	qint64 get_max_usec (void) const { return max_usec; }
+	qint64 get_mean_usec (void) const { return count > 0 ? total_usec / qint64 (count) : 0; }
+	qint64 get_percentile_usec (double fraction) const {
+		auto threshold = quint64 (fraction * double(count));
+		quint64 seen = 0;
+		for (int bucket = 0; bucket < nb_buckets; ++bucket) {
+			seen += buckets[bucket];
+			if (seen > threshold || seen == count)
+				return qMin (qint64 (1) << bucket, max_usec);
+		}
+		return max_usec;
+	}
+
+	QString summary (void) const {
+		auto msec = [](qint64 usec) { return QString::number (double(usec) / 1000., 'f', 2); };
+		return QStringLiteral ("n=%1 mean=%2ms p50<=%3ms p99<=%4ms max=%5ms")
+		    .arg (count)
+		    .arg (msec (get_mean_usec ()))
+		    .arg (msec (get_percentile_usec (0.5)))
+		    .arg (msec (get_percentile_usec (0.99)))
+		    .arg (msec (max_usec));
+	}
+};
+
+class Monitor {
+private:
+	std::array<Histogram, NbProbes> histograms;
+	QTimer * dispatch_timer{nullptr};
+	QElapsedTimer last_tick;
+
+public:
+	static Monitor & instance (void) {
+		static Monitor monitor;
+		return monitor;
+	}
+
+	void start_dispatch_probe (void) {
+		if (dispatch_timer != nullptr)
+			return;
+		// Owned by the application, so it is destroyed with the event loop
+		dispatch_timer = new QTimer (QCoreApplication::instance ());
+		dispatch_timer->setTimerType (Qt::PreciseTimer);
+		QObject::connect (dispatch_timer, &QTimer::timeout, [this] { on_tick (); });
+		last_tick.start ();
+		dispatch_timer->start (Const::watchdog_tick_msec);
+	}
+
+	void record (Probe probe, qint64 usec) {
+		histograms[probe].add (usec);
+		if (usec > Const::stall_warning_msec * 1000) {
+			EventLog::record (EventLog::LoopStall, 0, probe, usec);
+			qWarning ("Watchdog: %s stalled the event loop for %.1fms", probe_name (probe),
+			          double(usec) / 1000.);
+		}
+	}
+	const Histogram & get_histogram (Probe probe) const { return histograms[probe]; }
+
+	QString report (void) const {
+		// One line per probe that recorded something
+		QString text;
+		for (int i = 0; i < NbProbes; ++i) {
+			auto & h = histograms[i];
+			if (h.get_count () > 0)
+				text += QStringLiteral ("Event loop %1: %2\n")
+				            .arg (probe_name (Probe (i)), -18)
+				            .arg (h.summary ());
+		}
+		return text;
+	}
+
+private:
+	Monitor () = default;
+
+	void on_tick (void) {
+		auto late_usec = last_tick.nsecsElapsed () / 1000 - Const::watchdog_tick_msec * 1000;
+		last_tick.start ();
+		record (DispatchLatency, qMax (late_usec, qint64 (0)));
+	}
+};
+
+// Times the enclosing block
+class Scope {
+private:
+	Probe probe;
+	QElapsedTimer timer;
+
+public:
+	explicit Scope (Probe probe) : probe (probe) { timer.start (); }
+	~Scope () { Monitor::instance ().record (probe, timer.nsecsElapsed () / 1000); }
+};
+}
+
+#endif
@@ -16,7 +16,9 @@
  */
 #include <QApplication>
 
+#include "core_eventlog.h"
 #include "core_localshare.h"
+#include "core_watchdog.h"
 #include "gui_main.h"
 #include "gui_style.h"
 #include "gui_window.h"
@@ -25,10 +27,13 @@ namespace Gui {
 int start (int & argc, char **& argv) {
 	QApplication app (argc, argv);
 	Const::setup (app);
+	EventLog::Log::instance ().dump_on_crash (EventLog::default_path ());
 
 	// Set icons, start app
 	app.setWindowIcon (Icon::app ());
 	Window window;
-	return app.exec ();
+	auto code = app.exec ();
+	qDebug ("%s", qUtf8Printable (Watchdog::Monitor::instance ().report ()));
+	return code;
 }
 }
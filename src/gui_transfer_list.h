@@ -71,10 +71,14 @@ namespace TransferList {
 		QString rate;
 		Transfer::Base * base;
 		const Payload::Manager & payload;
+		const Transfer::Notifier * notifier;
 
 	public:
 		Item (Transfer::Base * transfer, QObject * parent = nullptr)
-		    : StructItem (NbFields, parent), base (transfer), payload (transfer->get_payload ()) {
+		    : StructItem (NbFields, parent),
+		      base (transfer),
+		      payload (transfer->get_payload ()),
+		      notifier (transfer->get_notifier ()) {
 			base->setParent (this);
 			connect (base->get_notifier (), &Transfer::Notifier::instant_rate, this, &Item::set_rate);
 			connect (base->get_notifier (), &Transfer::Notifier::progressed, this, &Item::progressed);
@@ -105,24 +109,40 @@ namespace TransferList {
 				case Qt::DisplayRole:
 					return size_to_string (payload.get_total_size ());
 				case Qt::StatusTipRole:
-				case Qt::ToolTipRole:
-					return tr ("%1B in %2 files")
-					    .arg (payload.get_total_size ())
-					    .arg (payload.get_nb_files ());
+				case Qt::ToolTipRole: {
+					auto text =
+					    tr ("%1B in %2 files").arg (payload.get_total_size ()).arg (payload.get_nb_files ());
+					if (payload.get_nb_links () > 0)
+						text += tr (" (%1B with %2 hard links)")
+						            .arg (payload.get_logical_size ())
+						            .arg (payload.get_nb_links ());
+					auto & skipped = payload.get_skipped ();
+					if (skipped.nb_files > 0 || skipped.nb_dirs > 0)
+						text += tr (", excluded %1 files (%2) and %3 directories")
+						            .arg (skipped.nb_files)
+						            .arg (size_to_string (skipped.size))
+						            .arg (skipped.nb_dirs);
+					return text;
+				}
 				}
 			} break;
 			case ProgressField: {
 				// Progress bar, and details.
 				switch (role) {
 				case Qt::DisplayRole:
-					return int((100 * payload.get_total_transfered_size ()) / payload.get_total_size ());
+					return int((100 * notifier->get_transfered_size ()) /
+					           qMax (payload.get_total_size (), qint64 (1)));
 				case Qt::StatusTipRole:
-				case Qt::ToolTipRole:
-					return tr ("%1/%2 (files: %3/%4)")
-					    .arg (size_to_string (payload.get_total_transfered_size ()),
-					          size_to_string (payload.get_total_size ()))
-					    .arg (payload.get_nb_files_transfered ())
-					    .arg (payload.get_nb_files ());
+				case Qt::ToolTipRole: {
+					auto text = tr ("%1/%2 (files: %3/%4)")
+					                .arg (size_to_string (notifier->get_transfered_size ()),
+					                      size_to_string (payload.get_total_size ()))
+					                .arg (payload.get_nb_files_transfered ())
+					                .arg (payload.get_nb_files ());
+					if (notifier->get_queued_size () > 0)
+						text += tr (", %1 queued").arg (size_to_string (notifier->get_queued_size ()));
+					return text;
+				}
 				}
 			} break;
 			case RateField: {
@@ -49,6 +49,9 @@ namespace TransferList {
 		Upload (Transfer::Upload * transfer, QObject * parent = nullptr)
 		    : Item (transfer, parent), upload (transfer) {
 			connect (transfer, &Transfer::Upload::status_changed, this, &Upload::status_changed);
+			connect (transfer, &Transfer::Upload::queue_position_changed, this, [this] {
+				emit data_changed (StatusField, StatusField, QVector<int>{Qt::DisplayRole});
+			});
 		}
 
 	private:
@@ -75,6 +78,8 @@ namespace TransferList {
 					case Status::Starting:
 						return tr ("Connecting");
 					case Status::WaitingForPeerAnswer:
+						if (upload->get_queue_position () > 0)
+							return tr ("Queued by peer (position %1)").arg (upload->get_queue_position ());
 						return tr ("Waiting answer");
 					case Status::Transfering:
 						return tr ("Transfering");
@@ -125,6 +130,9 @@ namespace TransferList {
 		    : Item (transfer, parent), download (transfer) {
 			transfer->set_target_dir (Settings::DownloadPath ().get ());
 			connect (transfer, &Transfer::Download::status_changed, this, &Download::status_changed);
+			connect (transfer, &Transfer::Download::queue_position_changed, this, [this] {
+				emit data_changed (StatusField, StatusField, QVector<int>{Qt::DisplayRole});
+			});
 			if (Settings::DownloadAuto ().get ())
 				transfer->give_user_choice (Transfer::Download::Accept);
 		}
@@ -161,6 +169,8 @@ namespace TransferList {
 						break;
 					case Status::WaitingForUserChoice:
 						return tr ("Accept ?");
+					case Status::Queued:
+						return tr ("Queued (position %1)").arg (download->get_queue_position ());
 					case Status::Transfering:
 						return tr ("Transfering");
 					case Status::Completed:
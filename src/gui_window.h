@@ -35,8 +35,10 @@
 #include <QAction>
 #include <QMenu>
 #include <QSplitter>
+#include <memory>
 
 #include "core_localshare.h"
+#include "core_profile.h"
 #include "core_server.h"
 #include "core_settings.h"
 #include "gui_discovery_subsystem.h"
@@ -69,6 +71,8 @@ private:
 	PeerList::Model * peer_list_model{nullptr};
 	TransferList::Model * transfer_list_model{nullptr};
 
+	QAction * action_send_background{nullptr};
+
 public:
 	Window (QWidget * parent = nullptr) : QMainWindow (parent) {
 		{
@@ -104,6 +108,11 @@ public:
 		action_send_dir->setStatusTip (tr ("Chooses a directory to send to selected peers"));
 		connect (action_send_dir, &QAction::triggered, this, &Window::action_send_dir_clicked);
 
+		action_send_background = new QAction (tr ("Send in &background"), this);
+		action_send_background->setCheckable (true);
+		action_send_background->setStatusTip (
+		    tr ("Next uploads yield to other traffic (background profile, TCP-LP and DSCP CS1)"));
+
 		auto action_add_peer = new QAction (Icon::add_peer (), tr ("&Add manual peer"), this);
 		action_add_peer->setStatusTip (tr ("Add a peer entry to fill manually"));
 		connect (action_add_peer, &QAction::triggered, this, &Window::new_manual_peer);
@@ -167,6 +176,7 @@ public:
 			auto file = menuBar ()->addMenu (tr ("&Application"));
 			file->addAction (action_send_file);
 			file->addAction (action_send_dir);
+			file->addAction (action_send_background);
 			file->addAction (action_add_peer);
 			file->addSeparator ();
 			file->addAction (action_quit);
@@ -191,6 +201,64 @@ public:
 			connect (send_hidden_files, &QAction::triggered,
 			         [=](bool checked) { Settings::UploadHidden ().set (checked); });
 
+			auto upload_filters = new QAction (tr ("Set &excluded files..."), pref);
+			upload_filters->setStatusTip (
+			    tr ("Sets patterns of files and directories not sent with a directory."));
+			connect (upload_filters, &QAction::triggered, [=](void) {
+				Settings::UploadFilters filters;
+				bool ok = false;
+				auto text = QInputDialog::getMultiLineText (
+				    this, tr ("Set excluded files"),
+				    tr ("One pattern per line, gitignore syntax ('!' to include again).\n"
+				        "Directories can also have a %1 file.")
+				        .arg (Const::ignore_file_name),
+				    filters.get ().join ('\n'), &ok);
+				if (ok)
+					filters.set (text.split ('\n', QString::SkipEmptyParts));
+			});
+
+			auto upload_profile = new QAction (tr ("Set upload network p&rofile..."), pref);
+			upload_profile->setStatusTip (
+			    tr ("Sets the congestion control and rate limit of uploads, to share the network."));
+			connect (upload_profile, &QAction::triggered, [=](void) {
+				Settings::UploadProfile profile;
+				auto names = Transfer::Profile::names ();
+				bool ok = false;
+				auto name = QInputDialog::getItem (
+				    this, tr ("Set upload network profile"),
+				    tr ("bulk: fast with short queues (BBR)\n"
+				        "background: yields to other traffic (TCP-LP, DSCP CS1)\n"
+				        "Profile:"),
+				    names, qMax (names.indexOf (profile.get ()), 0), false, &ok);
+				if (!ok)
+					return;
+				profile.set (name);
+				Settings::UploadPacingRate rate;
+				auto mbit = QInputDialog::getInt (this, tr ("Set upload network profile"),
+				                                  tr ("Rate limit in Mbit/s (0 for unlimited):"),
+				                                  rate.get (), 0, 100000, 10, &ok);
+				if (ok)
+					rate.set (mbit);
+			});
+
+			auto cache_mode = new QAction (tr ("Set page &cache use..."), pref);
+			cache_mode->setStatusTip (
+			    tr ("Sets if transfered files are kept in memory, or dropped to spare other programs."));
+			connect (cache_mode, &QAction::triggered, [=](void) {
+				Settings::CacheMode mode;
+				auto names = Payload::Manager::cache_mode_names ();
+				bool ok = false;
+				auto name = QInputDialog::getItem (
+				    this, tr ("Set page cache use"),
+				    tr ("auto: drop transfered data if larger than memory\n"
+				        "drop: always drop transfered data from the cache\n"
+				        "keep: let the system decide\n"
+				        "Mode:"),
+				    names, qMax (names.indexOf (mode.get ()), 0), false, &ok);
+				if (ok)
+					mode.set (name);
+			});
+
 			auto download_path =
 			    new QAction (Icon::change_download_path (), tr ("Set default download &path..."), pref);
 			download_path->setStatusTip (tr ("Sets the path used by default to store downloaded files."));
@@ -224,6 +292,9 @@ public:
 			pref->addAction (use_tray);
 			pref->addSeparator ();
 			pref->addAction (send_hidden_files);
+			pref->addAction (upload_filters);
+			pref->addAction (upload_profile);
+			pref->addAction (cache_mode);
 			pref->addAction (download_path);
 			pref->addAction (download_auto);
 			pref->addSeparator ();
@@ -301,9 +372,7 @@ private slots:
 		auto filepath = QFileDialog::getOpenFileName (this, tr ("Choose file to send"));
 		if (filepath.isEmpty ())
 			return;
-		auto selection = peer_list_view->selectionModel ()->selectedRows ();
-		for (auto & index : selection)
-			request_upload (peer_list_model->get_item_t<PeerList::Item *> (index)->get_peer (), filepath);
+		send_to_selection (filepath);
 	}
 
 	void action_send_dir_clicked (void) {
@@ -311,9 +380,23 @@ private slots:
 		auto dirpath = QFileDialog::getExistingDirectory (this, tr ("Choose directory to send"));
 		if (dirpath.isEmpty ())
 			return;
+		send_to_selection (dirpath);
+	}
+
+	void send_to_selection (const QString & path) {
+		// Several peers share one read of the payload (fan-out)
 		auto selection = peer_list_view->selectionModel ()->selectedRows ();
+		std::shared_ptr<Transfer::SharedStream> stream;
+		if (selection.size () > 1) {
+			stream = std::make_shared<Transfer::SharedStream> ();
+			if (!stream->set_payload (path, Settings::UploadHidden ().get (), upload_filter ())) {
+				QMessageBox::warning (this, tr ("Upload failed"), stream->get_error ());
+				return;
+			}
+		}
 		for (auto & index : selection)
-			request_upload (peer_list_model->get_item_t<PeerList::Item *> (index)->get_peer (), dirpath);
+			start_upload (peer_list_model->get_item_t<PeerList::Item *> (index)->get_peer (), path,
+			              stream);
 	}
 
 	// Peer creation
@@ -333,17 +416,37 @@ private slots:
 	// Transfer creation
 
 	void request_upload (const Peer & peer, const QString & filepath) {
+		start_upload (peer, filepath, nullptr);
+	}
+	void start_upload (const Peer & peer, const QString & filepath,
+	                   const std::shared_ptr<Transfer::SharedStream> & stream) {
 		// TODO move to a more event-like management (for file list building) ?
 		auto upload = new Transfer::Upload (peer.username, local_peer->get_username ());
+		Transfer::Profile profile;
+		Transfer::Profile::from_name (action_send_background->isChecked ()
+		                                  ? QStringLiteral ("background")
+		                                  : Settings::UploadProfile ().get (),
+		                              profile);
+		profile.pacing_rate = qint64 (Settings::UploadPacingRate ().get ()) * 1000 * 1000 / 8;
+		upload->set_profile (profile);
 		// Link to item to catch any error, then load files
 		auto item = new TransferList::Upload (upload, this);
-		if (!upload->set_payload (filepath, Settings::UploadHidden ().get ()))
+		auto loaded = stream ? upload->set_shared_payload (stream)
+		                     : upload->set_payload (filepath, Settings::UploadHidden ().get (), false,
+		                                            upload_filter ());
+		if (!loaded)
 			return;
 		// Only then connect and show the item
 		upload->connect (peer.address, peer.port);
 		transfer_list_model->append (item);
 	}
 
+	static Payload::Filter upload_filter (void) {
+		Payload::Filter filter;
+		filter.add_patterns (Settings::UploadFilters ().get ());
+		return filter;
+	}
+
 	void new_download (Transfer::Download * download) {
 		auto item = new TransferList::Download (download, this);
 		transfer_list_model->append (item);
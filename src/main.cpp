@@ -23,24 +23,41 @@
 #include "gui_main.h"
 #endif
 
-#include "core_transfer.h"
-namespace Transfer {
-Serialized serialized_info;
-}
-
 #ifdef LOCALSHARE_HAS_GUI
 /* Determine if we are in cli mode.
  * We cannot use the nice Qt parser before a Q*Application is built.
  * Thus we manually detect options that are definite clues of a cli mode.
+ * The gui has no options of its own: any cli option selects the cli mode.
  * This MUST be updated if cli options change.
+ *
+ * Long options match exactly or with a "=value".
+ * Short options match exactly, except the mode ones that also match with attached values or
+ * flags ("-ufile", "-dy"). Others could be confused with Qt gui options (-platform, -style).
  */
 static bool is_console_mode (int argc, const char * const * argv) {
-	static const char * trigger_console_mode[] = {
-	    "-d", "--download", "-u", "--upload", "-l", "--list", "-h", "--help", "-V", "--version", nullptr};
-	for (int i = 1; i < argc; ++i)
-		for (int j = 0; trigger_console_mode[j] != nullptr; ++j)
-			if (qstrncmp (argv[i], trigger_console_mode[j], qstrlen (trigger_console_mode[j])) == 0)
+	static const char * long_options[] = {
+	    "--download", "--upload",       "--list",    "--seed",       "--pull",       "--probe",
+	    "--help",     "--version",      "--name",    "--peer",       "--target-dir", "--yes",
+	    "--verbose",  "--quiet",        "--hidden",  "--exclude",    "--include",    "--pipeline",
+	    "--timeout",  "--network-only", "--connect", "--no-probe",   "--port",       "--profile",
+	    "--pace",     "--congestion",   "--cache",   "--background", "--timing",     "--event-log",
+	    nullptr};
+	static const char * mode_short_options[] = {"-d", "-u", "-l", "-h", "-V", nullptr};
+	static const char * short_options[] = {"-n", "-p", "-t", "-y", "-v", "-q", nullptr};
+	for (int i = 1; i < argc; ++i) {
+		for (int j = 0; long_options[j] != nullptr; ++j) {
+			auto size = qstrlen (long_options[j]);
+			if (qstrncmp (argv[i], long_options[j], size) == 0 &&
+			    (argv[i][size] == '\0' || argv[i][size] == '='))
+				return true;
+		}
+		for (int j = 0; mode_short_options[j] != nullptr; ++j)
+			if (qstrncmp (argv[i], mode_short_options[j], 2) == 0)
+				return true;
+		for (int j = 0; short_options[j] != nullptr; ++j)
+			if (qstrcmp (argv[i], short_options[j]) == 0)
 				return true;
+	}
 	return false;
 }
 #endif
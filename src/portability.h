@@ -20,16 +20,36 @@
 
 // Abstracts os specific stuff in a portable way
 
-// Terminal size
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <QSysInfo>
+#include <QtGlobal>
+
 #ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <cerrno>
 #include <unistd.h>
 #endif
+#ifdef Q_OS_LINUX
+#include <linux/fs.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 #ifdef Q_OS_WIN
 #include <windows.h>
 #endif
 
-int terminal_width (void) {
+// Terminal size
+inline int terminal_width (void) {
 	int size = 80; // Default
 #ifdef Q_OS_UNIX
 	struct winsize sz;
@@ -44,4 +64,367 @@ int terminal_width (void) {
 	return size;
 }
 
+/* Tune TCP keepalive of a connected socket, to detect dead peers faster than the OS default.
+ * Also bounds the time sent data can stay unacknowledged (TCP_USER_TIMEOUT, Linux only).
+ */
+inline void set_socket_keepalive (qintptr fd, int idle_sec, int interval_sec, int count,
+                                  int user_timeout_msec) {
+#ifdef Q_OS_UNIX
+	int enabled = 1;
+	setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof (enabled));
+#if defined(TCP_KEEPIDLE)
+	setsockopt (fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle_sec, sizeof (idle_sec));
+#elif defined(TCP_KEEPALIVE)
+	setsockopt (fd, IPPROTO_TCP, TCP_KEEPALIVE, &idle_sec, sizeof (idle_sec)); // Mac
+#endif
+#ifdef TCP_KEEPINTVL
+	setsockopt (fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval_sec, sizeof (interval_sec));
+#endif
+#ifdef TCP_KEEPCNT
+	setsockopt (fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof (count));
+#endif
+#ifdef TCP_USER_TIMEOUT
+	setsockopt (fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout_msec, sizeof (user_timeout_msec));
+#endif
+#endif
+	Q_UNUSED (fd);
+	Q_UNUSED (idle_sec);
+	Q_UNUSED (interval_sec);
+	Q_UNUSED (count);
+	Q_UNUSED (user_timeout_msec);
+}
+
+/* Pacing of sent data by the kernel (Linux SO_MAX_PACING_RATE, in bytes per second).
+ * TCP paces itself since Linux 4.13, or the fq qdisc does it. Returns false if unsupported.
+ */
+inline bool set_socket_pacing_rate (qintptr fd, qint64 bytes_per_sec) {
+#if defined(Q_OS_LINUX) && defined(SO_MAX_PACING_RATE)
+	// 32 bits value: ~34 Gbit/s max, and ~0u for unlimited
+	unsigned int rate = bytes_per_sec > 0 ? unsigned(qMin (bytes_per_sec, qint64 (~0u - 1))) : ~0u;
+	return setsockopt (fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof (rate)) == 0;
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (bytes_per_sec);
+	return false;
+#endif
+}
+
+/* TCP congestion control algorithm of a socket (Linux TCP_CONGESTION).
+ * The algorithm must be available (see /proc/sys/net/ipv4/tcp_allowed_congestion_control).
+ * get returns an empty string if unknown.
+ */
+inline bool set_socket_congestion_control (qintptr fd, const QByteArray & algorithm) {
+#if defined(Q_OS_LINUX) && defined(TCP_CONGESTION)
+	return setsockopt (fd, IPPROTO_TCP, TCP_CONGESTION, algorithm.constData (),
+	                   socklen_t (algorithm.size ())) == 0;
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (algorithm);
+	return false;
+#endif
+}
+inline QByteArray get_socket_congestion_control (qintptr fd) {
+#if defined(Q_OS_LINUX) && defined(TCP_CONGESTION)
+	char name[16] = {}; // TCP_CA_NAME_MAX
+	socklen_t len = sizeof (name);
+	if (getsockopt (fd, IPPROTO_TCP, TCP_CONGESTION, name, &len) == 0)
+		return QByteArray (name, int(qstrnlen (name, len)));
+#else
+	Q_UNUSED (fd);
+#endif
+	return QByteArray ();
+}
+
+// Physical memory of the host in bytes (0 if unknown)
+inline qint64 physical_memory_size (void) {
+#if defined(Q_OS_UNIX) && defined(_SC_PHYS_PAGES)
+	auto nb_pages = sysconf (_SC_PHYS_PAGES);
+	auto page_size = sysconf (_SC_PAGESIZE);
+	if (nb_pages > 0 && page_size > 0)
+		return qint64 (nb_pages) * qint64 (page_size);
+#elif defined(Q_OS_WIN)
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof (status);
+	if (GlobalMemoryStatusEx (&status))
+		return qint64 (status.ullTotalPhys);
+#endif
+	return 0;
+}
+
+/* Page cache control of a mapped file, streamed in order (fd and its mapping at offset 0).
+ * advise_sequential asks for a larger read ahead.
+ * start_writeback starts writing dirty data of a range to disk, without waiting.
+ * release_cached_range drops a range from the page cache, waiting for write back if written.
+ * release_written_range does the same without a mapping (on a file opened again after close).
+ * Offsets must be multiples of the page size. These are hints: errors are ignored.
+ */
+inline void advise_sequential (int fd, char * mapping, qint64 len) {
+#ifdef Q_OS_UNIX
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise (fd, 0, off_t (len), POSIX_FADV_SEQUENTIAL);
+#endif
+	madvise (mapping, size_t (len), MADV_SEQUENTIAL);
+#endif
+	Q_UNUSED (fd);
+	Q_UNUSED (mapping);
+	Q_UNUSED (len);
+}
+inline void start_writeback (int fd, char * mapping, qint64 offset, qint64 len) {
+#if defined(Q_OS_LINUX) && defined(SYNC_FILE_RANGE_WRITE)
+	Q_UNUSED (mapping);
+	sync_file_range (fd, off_t (offset), off_t (len), SYNC_FILE_RANGE_WRITE);
+#elif defined(Q_OS_UNIX)
+	Q_UNUSED (fd);
+	msync (mapping + offset, size_t (len), MS_ASYNC);
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (mapping);
+	Q_UNUSED (offset);
+	Q_UNUSED (len);
+#endif
+}
+inline void release_cached_range (int fd, char * mapping, qint64 offset, qint64 len, bool written) {
+#ifdef Q_OS_UNIX
+	if (written) {
+		// Dirty pages cannot be dropped
+#if defined(Q_OS_LINUX) && defined(SYNC_FILE_RANGE_WRITE)
+		sync_file_range (fd, off_t (offset), off_t (len),
+		                 SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		                     SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+		msync (mapping + offset, size_t (len), MS_SYNC);
+#endif
+	}
+	madvise (mapping + offset, size_t (len), MADV_DONTNEED); // Unmaps pages from our process
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise (fd, off_t (offset), off_t (len), POSIX_FADV_DONTNEED); // Drops them
+#endif
+#endif
+	Q_UNUSED (fd);
+	Q_UNUSED (mapping);
+	Q_UNUSED (offset);
+	Q_UNUSED (len);
+	Q_UNUSED (written);
+}
+inline void release_written_range (int fd, qint64 offset, qint64 len) {
+#if defined(Q_OS_LINUX) && defined(SYNC_FILE_RANGE_WRITE) && defined(POSIX_FADV_DONTNEED)
+	sync_file_range (fd, off_t (offset), off_t (len),
+	                 SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+	                     SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise (fd, off_t (offset), off_t (len), POSIX_FADV_DONTNEED);
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (offset);
+	Q_UNUSED (len);
+#endif
+}
+
+/* DiffServ code point of sent packets (IPv4 TOS or IPv6 traffic class, the socket may be both).
+ * Returns false if neither could be set.
+ */
+inline bool set_socket_dscp (qintptr fd, int dscp) {
+#ifdef Q_OS_UNIX
+	int tos = dscp << 2; // ECN bits are left to the kernel
+	auto v4 = setsockopt (fd, IPPROTO_IP, IP_TOS, &tos, sizeof (tos)) == 0;
+	auto v6 = false;
+#ifdef IPV6_TCLASS
+	v6 = setsockopt (fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof (tos)) == 0;
+#endif
+	return v4 || v6;
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (dscp);
+	return false;
+#endif
+}
+
+/* Lowest CPU and disk priority for the whole process (threads created later inherit it).
+ * Linux: SCHED_IDLE runs only on otherwise idle CPUs, and the idle I/O class only uses an idle
+ * disk (with the CFQ, BFQ schedulers). Elsewhere, nice 19 and the OS background mode.
+ * Returns false if it could only be partially applied.
+ */
+inline bool set_process_background (void) {
+#if defined(Q_OS_LINUX)
+	struct sched_param param;
+	param.sched_priority = 0;
+	auto cpu = sched_setscheduler (0, SCHED_IDLE, &param) == 0 ||
+	           setpriority (PRIO_PROCESS, 0, 19) == 0;
+	auto io = false;
+#ifdef SYS_ioprio_set
+	const int ioprio_who_process = 1;
+	const int ioprio_class_idle = 3;
+	const int ioprio_class_shift = 13;
+	io = syscall (SYS_ioprio_set, ioprio_who_process, 0,
+	              ioprio_class_idle << ioprio_class_shift) == 0;
+#endif
+	return cpu && io;
+#elif defined(Q_OS_MAC)
+	auto cpu = setpriority (PRIO_PROCESS, 0, 19) == 0;
+	auto io = setiopolicy_np (IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE) == 0;
+	return cpu && io;
+#elif defined(Q_OS_UNIX)
+	return setpriority (PRIO_PROCESS, 0, 19) == 0;
+#elif defined(Q_OS_WIN)
+	// Lowers CPU, I/O and memory priorities
+	return SetPriorityClass (GetCurrentProcess (), PROCESS_MODE_BACKGROUND_BEGIN) != 0;
+#else
+	return false;
+#endif
+}
+
+/* Hook on fatal signals (segfault, abort...): handler is called once, then the signal has its
+ * default effect (core dump included). It runs in a signal handler, so it must only use async
+ * signal safe calls, like the raw_* file functions. Unix only.
+ */
+inline void set_crash_handler (void (*handler) (void)) {
+#ifdef Q_OS_UNIX
+	static void (*crash_handler) (void) = nullptr;
+	crash_handler = handler;
+	struct sigaction action;
+	sigemptyset (&action.sa_mask);
+	action.sa_flags = SA_RESETHAND; // Default effect for the signal raised again
+	action.sa_handler = [](int sig) {
+		crash_handler ();
+		raise (sig); // Pending until the handler returns
+	};
+	for (auto sig : {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT})
+		sigaction (sig, &action, nullptr);
+#else
+	Q_UNUSED (handler);
+#endif
+}
+// Unbuffered file output, usable in a crash handler (Unix only, -1 or false on failure)
+inline void raw_make_parent_dirs (char * path) {
+	// Missing parents of path are created. path is changed during the call, and restored.
+#ifdef Q_OS_UNIX
+	for (auto p = path + 1; *p != '\0'; ++p) {
+		if (*p == '/') {
+			*p = '\0';
+			mkdir (path, 0755); // Fails if it exists
+			*p = '/';
+		}
+	}
+#else
+	Q_UNUSED (path);
+#endif
+}
+inline int raw_create_file (const char * path) {
+#ifdef Q_OS_UNIX
+	return open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#else
+	Q_UNUSED (path);
+	return -1;
+#endif
+}
+inline bool raw_write (int fd, const char * data, qint64 size) {
+#ifdef Q_OS_UNIX
+	while (size > 0) {
+		auto written = write (fd, data, static_cast<size_t> (size));
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written;
+		size -= written;
+	}
+	return true;
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (data);
+	Q_UNUSED (size);
+	return false;
+#endif
+}
+inline void raw_close (int fd) {
+#ifdef Q_OS_UNIX
+	close (fd);
+#else
+	Q_UNUSED (fd);
+#endif
+}
+
+// Identifier of the machine, to detect peers on the same host (empty if unknown)
+inline QByteArray host_id (void) {
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 11, 0))
+	return QSysInfo::machineUniqueId ();
+#else
+	for (auto path : {"/etc/machine-id", "/var/lib/dbus/machine-id"}) {
+		QFile f (path);
+		if (f.open (QIODevice::ReadOnly))
+			return f.readAll ().trimmed ();
+	}
+	return QByteArray ();
+#endif
+}
+
+// Identity of a file in the file system (device, inode), to check two paths are the same file
+struct FileIdentity {
+	quint64 device{0};
+	quint64 inode{0};
+	quint64 nb_links{0}; // Not part of the identity
+	bool is_valid (void) const { return inode != 0; }
+	bool operator== (const FileIdentity & other) const {
+		return device == other.device && inode == other.inode;
+	}
+};
+inline FileIdentity file_identity (const QString & path) {
+	FileIdentity id;
+#ifdef Q_OS_UNIX
+	struct stat st;
+	if (stat (QFile::encodeName (path).constData (), &st) == 0) {
+		id.device = st.st_dev;
+		id.inode = st.st_ino;
+		id.nb_links = st.st_nlink;
+	}
+#else
+	Q_UNUSED (path);
+#endif
+	return id;
+}
+
+// Create a new hard link to target. Fails if not supported by the file system.
+inline bool make_hard_link (const QString & target, const QString & link_path) {
+#if defined(Q_OS_UNIX)
+	auto target_name = QFile::encodeName (target);
+	auto link_name = QFile::encodeName (link_path);
+	return link (target_name.constData (), link_name.constData ()) == 0;
+#elif defined(Q_OS_WIN)
+	return CreateHardLinkW (reinterpret_cast<const wchar_t *> (link_path.utf16 ()),
+	                        reinterpret_cast<const wchar_t *> (target.utf16 ()), nullptr) != 0;
+#else
+	Q_UNUSED (target);
+	Q_UNUSED (link_path);
+	return false;
+#endif
+}
+
+/* In kernel file copies, between file descriptors.
+ * clone_file shares the data blocks (reflink), and only works on some file systems.
+ * copy_file_data copies len bytes at offset, and returns the number of bytes copied or -1.
+ * Both fail if not supported, and the caller should use a normal copy instead.
+ */
+inline bool clone_file (int source_fd, int target_fd) {
+#if defined(Q_OS_LINUX) && defined(FICLONE)
+	return ioctl (target_fd, FICLONE, source_fd) == 0;
+#else
+	Q_UNUSED (source_fd);
+	Q_UNUSED (target_fd);
+	return false;
+#endif
+}
+inline qint64 copy_file_data (int source_fd, int target_fd, qint64 offset, qint64 len) {
+#if defined(Q_OS_LINUX) && defined(SYS_copy_file_range)
+	loff_t in_offset = offset;
+	loff_t out_offset = offset;
+	return syscall (SYS_copy_file_range, source_fd, &in_offset, target_fd, &out_offset,
+	                static_cast<size_t> (len), 0u);
+#else
+	Q_UNUSED (source_fd);
+	Q_UNUSED (target_fd);
+	Q_UNUSED (offset);
+	Q_UNUSED (len);
+	return -1;
+#endif
+}
+
 #endif
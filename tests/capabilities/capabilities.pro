@@ -0,0 +1,12 @@
+# Capabilities: serialization, negotiation, and handshakes with peers of other versions
+
+TEMPLATE = app
+CONFIG += console c++11 testcase
+CONFIG -= app_bundle
+QT += core network testlib
+QT -= gui
+
+INCLUDEPATH += ../../src ..
+TARGET = tst_capabilities
+HEADERS += ../../src/core_scheduler.h ../../src/core_transfer.h ../test_common.h
+SOURCES += tst_capabilities.cpp
@@ -0,0 +1,205 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QPair>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTemporaryDir>
+#include <QVector>
+#include <QtTest>
+#include <memory>
+
+#include "core_transfer.h"
+#include "test_common.h"
+
+using Transfer::Capabilities;
+using Keys = QVector<QPair<quint16, quint64>>;
+
+static QByteArray serialize (const Capabilities & c) {
+	QByteArray data;
+	QDataStream out (&data, QIODevice::WriteOnly);
+	out.setVersion (Const::serializer_version);
+	out << c;
+	return data;
+}
+// Capabilities as another version may send them: any keys, in any order
+static QByteArray serialize (const Keys & keys) {
+	QByteArray data;
+	QDataStream out (&data, QIODevice::WriteOnly);
+	out.setVersion (Const::serializer_version);
+	out << quint16 (keys.size ());
+	for (auto & key : keys)
+		out << key.first << key.second;
+	return data;
+}
+static Capabilities parse (const QByteArray & data, QDataStream::Status * status = nullptr) {
+	QDataStream in (data);
+	in.setVersion (Const::serializer_version);
+	Capabilities c;
+	in >> c;
+	if (status != nullptr)
+		*status = in.status ();
+	return c;
+}
+
+/* Handshakes of a Download with a peer of another version, written by hand on a socket.
+ * The peer sends magic, version, then capabilities (a version 8 peer sends none).
+ */
+class TestCapabilities : public QObject {
+	Q_OBJECT
+
+private:
+	QTemporaryDir settings;
+	QTcpServer server;
+	std::unique_ptr<QTcpSocket> peer;
+	std::unique_ptr<Transfer::Download> download;
+
+	bool connect_peer (void) {
+		peer.reset (new QTcpSocket);
+		peer->connectToHost (QHostAddress::LocalHost, server.serverPort ());
+		if (!peer->waitForConnected (5000) || !server.waitForNewConnection (5000))
+			return false;
+		download.reset (new Transfer::Download (server.nextPendingConnection ()));
+		return true;
+	}
+	void send_handshake (quint16 version, const QByteArray & capabilities) {
+		QDataStream out (peer.get ());
+		out.setVersion (Const::serializer_version);
+		out << Const::protocol_magic << version;
+		if (!capabilities.isNull ())
+			out << Transfer::Message::SizePrefixType (capabilities.size ());
+		out.writeRawData (capabilities.constData (), capabilities.size ());
+	}
+	void wait_handshake_end (void) {
+		QTRY_VERIFY_WITH_TIMEOUT (download->get_status () != Transfer::Download::Starting, 5000);
+	}
+
+private slots:
+	void initTestCase (void) {
+		QVERIFY (settings.isValid ());
+		Test::isolate_settings (settings.path ());
+		QVERIFY (server.listen (QHostAddress::LocalHost));
+	}
+	void cleanup (void) {
+		download.reset ();
+		peer.reset ();
+	}
+
+	void stream_round_trip (void) {
+		auto ours = Capabilities::ours ();
+		auto read = parse (serialize (ours));
+		QCOMPARE (read.features, ours.features);
+		QCOMPARE (read.max_frame_size, ours.max_frame_size);
+		QCOMPARE (read.hashes, ours.hashes);
+		QCOMPARE (read.codecs, ours.codecs);
+	}
+
+	void missing_keys_take_baselines (void) {
+		auto read = parse (serialize (Keys{{Capabilities::FeaturesKey, Capabilities::LinkProbe}}));
+		QCOMPARE (read.features, quint64 (Capabilities::LinkProbe));
+		QCOMPARE (read.max_frame_size, Transfer::Message::max_size);
+		QCOMPARE (read.hashes, quint64 (Capabilities::HashMd5));
+		QCOMPARE (read.codecs, quint64 (Capabilities::CodecNone));
+	}
+
+	void unknown_keys_are_ignored (void) {
+		// Keys of a newer version, before and after known ones
+		QDataStream::Status status;
+		auto read = parse (serialize (Keys{{77, 1},
+		                                   {Capabilities::MaxFrameSizeKey, 1 << 20},
+		                                   {78, quint64 (-1)},
+		                                   {Capabilities::HashesKey, 0xFF}}),
+		                   &status);
+		QCOMPARE (status, QDataStream::Ok);
+		QCOMPARE (read.features, quint64 (0));
+		QCOMPARE (read.max_frame_size, qint64 (1 << 20));
+		QCOMPARE (read.hashes, quint64 (0xFF));
+	}
+
+	void max_frame_size_is_bounded (void) {
+		auto read = parse (serialize (Keys{{Capabilities::MaxFrameSizeKey, quint64 (-1)}}));
+		QCOMPARE (read.max_frame_size, Transfer::Message::max_size);
+	}
+
+	void negotiate_common_subset (void) {
+		auto ours = Capabilities::ours ();
+		Capabilities peer;
+		peer.features = Capabilities::LinkProbe | (quint64 (1) << 40);
+		peer.max_frame_size = 4096;
+		peer.hashes = Capabilities::HashMd5 | (1 << 5);
+		peer.codecs = Capabilities::CodecNone | (1 << 3);
+		auto common = Capabilities::negotiate (ours, peer);
+		QCOMPARE (common.features, quint64 (Capabilities::LinkProbe));
+		QVERIFY (common.has (Capabilities::LinkProbe));
+		QVERIFY (!common.has (Capabilities::LocalCopy));
+		QCOMPARE (common.max_frame_size, qint64 (4096));
+		QCOMPARE (common.hashes, quint64 (Capabilities::HashMd5));
+		QCOMPARE (common.codecs, quint64 (Capabilities::CodecNone));
+	}
+
+	void older_version_is_refused (void) {
+		QVERIFY (connect_peer ());
+		send_handshake (Const::min_protocol_version - 1, QByteArray ());
+		wait_handshake_end ();
+		QCOMPARE (download->get_status (), Transfer::Download::Error);
+		QVERIFY2 (download->get_error ().contains ("version"), qPrintable (download->get_error ()));
+	}
+
+	void same_version_with_fewer_features (void) {
+		QVERIFY (connect_peer ());
+		send_handshake (Const::protocol_version,
+		                serialize (Keys{{Capabilities::FeaturesKey, Capabilities::LinkProbe}}));
+		wait_handshake_end ();
+		QCOMPARE (download->get_status (), Transfer::Download::WaitingForOffer);
+		auto & common = download->get_capabilities ();
+		QCOMPARE (common.features, quint64 (Capabilities::LinkProbe));
+		QCOMPARE (common.max_frame_size, Transfer::Message::max_size);
+		QCOMPARE (common.hashes, quint64 (Capabilities::HashMd5));
+	}
+
+	void newer_version_with_unknown_keys (void) {
+		// The stream stays in sync after the handshake: an Error message is read as such
+		QVERIFY (connect_peer ());
+		send_handshake (Const::protocol_version + 1,
+		                serialize (Keys{{Capabilities::FeaturesKey, quint64 (-1)},
+		                                {99, 42},
+		                                {Capabilities::MaxFrameSizeKey, 1 << 20}}));
+		wait_handshake_end ();
+		QCOMPARE (download->get_status (), Transfer::Download::WaitingForOffer);
+		auto & common = download->get_capabilities ();
+		QCOMPARE (common.features, Capabilities::ours ().features);
+		QCOMPARE (common.max_frame_size, qint64 (1 << 20));
+
+		QString text ("from the future");
+		QDataStream out (peer.get ());
+		out.setVersion (Const::serializer_version);
+		out << Transfer::Message::CodeType (Transfer::Message::Error)
+		    << Transfer::Message::SizePrefixType (Transfer::Serialized::compute_size (text)) << text;
+		QTRY_COMPARE_WITH_TIMEOUT (download->get_status (), Transfer::Download::Error, 5000);
+		QVERIFY2 (download->get_error ().contains (text), qPrintable (download->get_error ()));
+	}
+
+	void no_common_hash (void) {
+		QVERIFY (connect_peer ());
+		send_handshake (Const::protocol_version + 1,
+		                serialize (Keys{{Capabilities::HashesKey, quint64 (1) << 7}}));
+		wait_handshake_end ();
+		QCOMPARE (download->get_status (), Transfer::Download::Error);
+	}
+};
+
+QTEST_GUILESS_MAIN (TestCapabilities)
+#include "tst_capabilities.moc"
@@ -0,0 +1,12 @@
+# Payload streams without sockets: inline batches, grouped checksums, retries and resends
+
+TEMPLATE = app
+CONFIG += console c++11 testcase
+CONFIG -= app_bundle
+QT += core network testlib
+QT -= gui
+
+INCLUDEPATH += ../../src ..
+TARGET = tst_payload
+HEADERS += ../../src/core_scheduler.h ../../src/core_transfer.h ../test_common.h
+SOURCES += tst_payload.cpp
@@ -0,0 +1,506 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QTemporaryDir>
+#include <QtTest>
+#include <functional>
+#include <limits>
+#include <vector>
+
+#include "core_transfer.h"
+#include "test_common.h"
+
+using Transfer::Message::CodeType;
+using Transfer::Message::SizePrefixType;
+namespace Message = Transfer::Message;
+using ChecksumList = Payload::Manager::ChecksumList;
+
+/* Main stream and retries of a payload, without sockets.
+ * The sender writes frames like Upload (Base::write_next_frames, then resends).
+ * The receiver handles them like Download, and its retry requests go back at once.
+ * Frames selected by damage have a data byte flipped on their way.
+ */
+class Link {
+public:
+	struct Frame {
+		CodeType code;
+		QByteArray content;
+	};
+
+	Payload::Manager sender;
+	Payload::Manager receiver;
+	std::function<bool(const Frame &)> damage;
+	std::vector<Frame> delivered; // In order, as received
+	int nb_retries{0};
+	QString error;
+
+private:
+	ChecksumList checksums;
+
+public:
+	bool setup (const QString & source_path, const QString & target_dir) {
+		if (!sender.from_source_path (source_path, false)) {
+			error = sender.get_last_error ();
+			return false;
+		}
+		// Offer
+		QByteArray offer;
+		{
+			QDataStream out (&offer, QIODevice::WriteOnly);
+			out.setVersion (Const::serializer_version);
+			out << sender;
+		}
+		QDataStream in (offer);
+		in.setVersion (Const::serializer_version);
+		in >> receiver;
+		if (in.status () != QDataStream::Ok || !receiver.validate ()) {
+			error = QStringLiteral ("bad offer");
+			return false;
+		}
+		receiver.set_root_dir (target_dir);
+		sender.start_transfer (Payload::Manager::Sending);
+		receiver.start_transfer (Payload::Manager::Receiving);
+		return true;
+	}
+
+	// Sends the next frames: main stream first, then resends
+	bool step (void) {
+		QByteArray data;
+		{
+			QDataStream out (&data, QIODevice::WriteOnly);
+			out.setVersion (Const::serializer_version);
+			if (!sender.is_resending () && sender.has_unsent_files ()) {
+				if (!Transfer::Base::write_next_frames (out, sender, checksums, error))
+					return false;
+			} else if (!write_resend_frames (out)) {
+				return false;
+			}
+		}
+		for (auto & frame : split_frames (data)) {
+			if (damage && damage (frame))
+				flip_data_byte (frame);
+			delivered.push_back (frame);
+			if (!receive (frame))
+				return false;
+		}
+		return true;
+	}
+	bool run (void) {
+		while (sender.has_unsent_files () || sender.has_pending_resend ())
+			if (!step ())
+				return false;
+		return true;
+	}
+
+	std::vector<Frame> frames_of (CodeType code) const {
+		std::vector<Frame> frames;
+		for (auto & frame : delivered)
+			if (frame.code == code)
+				frames.push_back (frame);
+		return frames;
+	}
+	static ChecksumList parse_checksums (const Frame & frame) {
+		ChecksumList list;
+		QDataStream in (frame.content);
+		in.setVersion (Const::serializer_version);
+		in >> list;
+		return list;
+	}
+	static qint64 inline_batch_data_size (const Frame & frame) {
+		return frame.content.size () - Transfer::Serialized::inline_batch_size (0);
+	}
+	static quint32 inline_batch_nb_files (const Frame & frame) {
+		QDataStream in (frame.content);
+		in.setVersion (Const::serializer_version);
+		quint32 nb_files = 0;
+		in >> nb_files;
+		return nb_files;
+	}
+
+private:
+	bool write_resend_frames (QDataStream & out) {
+		// Like Base::send_next_resend_chunk
+		if (!sender.is_resending ()) {
+			quint32 index;
+			if (!sender.start_resend (index)) {
+				error = sender.get_last_error ();
+				return false;
+			}
+			out << CodeType (Message::Resend) << SizePrefixType (sizeof (index)) << index;
+			return true;
+		}
+		auto size = sender.next_resend_chunk_size ();
+		if (size == 0) {
+			sender.take_resend_checksum (checksums);
+			out << CodeType (Message::Checksums)
+			    << SizePrefixType (Transfer::Serialized::compute_size (checksums)) << checksums;
+			return true;
+		}
+		out << CodeType (Message::Chunk) << SizePrefixType (size);
+		if (!sender.send_resend_chunk (out)) {
+			error = sender.get_last_error ();
+			return false;
+		}
+		return true;
+	}
+
+	static std::vector<Frame> split_frames (const QByteArray & data) {
+		std::vector<Frame> frames;
+		QDataStream in (data);
+		in.setVersion (Const::serializer_version);
+		while (!in.atEnd ()) {
+			Frame frame;
+			in >> frame.code;
+			if (Message::has_content (frame.code)) {
+				SizePrefixType size;
+				in >> size;
+				frame.content.resize (int(size));
+				in.readRawData (frame.content.data (), int(size));
+			}
+			frames.push_back (frame);
+		}
+		return frames;
+	}
+	static void flip_data_byte (Frame & frame) {
+		// Chunks are raw data. Batches end with their checksum: damage its last byte.
+		int i;
+		if (frame.code == Message::Chunk)
+			i = 0;
+		else if (frame.code == Message::InlineBatch)
+			i = frame.content.size () - 1;
+		else
+			return;
+		frame.content[i] = char(frame.content.at (i) ^ 1);
+	}
+
+	bool receive (const Frame & frame) {
+		// Like the handlers of Base
+		QDataStream in (frame.content);
+		in.setVersion (Const::serializer_version);
+		bool ok = false;
+		switch (frame.code) {
+		case Message::Chunk:
+			ok = receiver.receive_chunk (in, frame.content.size ());
+			break;
+		case Message::InlineBatch: {
+			quint32 nb_files;
+			in >> nb_files;
+			if (!receiver.skip_links ())
+				break;
+			auto data_size = receiver.inline_batch_data_size (nb_files);
+			if (data_size < 0 ||
+			    Transfer::Serialized::inline_batch_size (data_size) != frame.content.size ()) {
+				error = QStringLiteral ("inline batch does not match the manifest");
+				return false;
+			}
+			ok = receiver.receive_inline_batch (in, nb_files, data_size);
+			break;
+		}
+		case Message::Checksums: {
+			ChecksumList list;
+			in >> list;
+			ok = in.status () == QDataStream::Ok && receiver.test_checksums (list);
+			break;
+		}
+		case Message::Resend: {
+			quint32 index;
+			in >> index;
+			ok = receiver.receive_again (index);
+			break;
+		}
+		default:
+			error = QStringLiteral ("unexpected frame %1").arg (frame.code, 0, 16);
+			return false;
+		}
+		if (!ok) {
+			error = receiver.get_last_error ();
+			return false;
+		}
+		for (auto index : receiver.take_retry_requests ()) {
+			++nb_retries;
+			if (!sender.queue_resend (index)) {
+				error = sender.get_last_error ();
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+class TestPayload : public QObject {
+	Q_OBJECT
+
+private:
+	QTemporaryDir source;
+	QTemporaryDir target;
+
+	QString source_dir (void) const { return source.path () + "/data"; }
+	QString target_dir (void) const { return target.path () + "/data"; }
+
+	void complete_and_compare (const Link & link) {
+		QVERIFY (link.sender.is_transfer_complete ());
+		QVERIFY2 (link.receiver.is_transfer_complete (), qPrintable (link.receiver.get_last_error ()));
+		auto diff = Test::compare_trees (source_dir (), target_dir ());
+		QVERIFY2 (diff.isEmpty (), qPrintable (diff));
+	}
+
+private slots:
+	void init (void) {
+		QVERIFY (source.isValid ());
+		QVERIFY (target.isValid ());
+		QDir (source_dir ()).removeRecursively ();
+		QDir (target_dir ()).removeRecursively ();
+	}
+
+	void chunk_file_retry (void) {
+		// First chunk damaged: its file fails its checksum, and is resent alone
+		QVERIFY (Test::write_file (source_dir () + "/big", 3 * Const::chunk_size + 17, 1));
+		QVERIFY (Test::write_file (source_dir () + "/small", 100, 2));
+		Link link;
+		QVERIFY2 (link.setup (source_dir (), target.path ()), qPrintable (link.error));
+		int nb_chunks = 0;
+		link.damage = [&nb_chunks](const Link::Frame & f) {
+			return f.code == Message::Chunk && nb_chunks++ == 0;
+		};
+		QVERIFY2 (link.run (), qPrintable (link.error));
+		QCOMPARE (link.nb_retries, 1);
+		QCOMPARE (int(link.frames_of (Message::Resend).size ()), 1);
+		complete_and_compare (link);
+	}
+
+	void inline_batch_retry (void) {
+		// A damaged batch fails all its files: each is resent alone, with its own digest
+		const int nb_files = 20;
+		for (int i = 0; i < nb_files; ++i)
+			QVERIFY (Test::write_file (source_dir () + QString ("/f%1").arg (i), 10 + i, i));
+		Link link;
+		QVERIFY2 (link.setup (source_dir (), target.path ()), qPrintable (link.error));
+		int nb_batches = 0;
+		link.damage = [&nb_batches](const Link::Frame & f) {
+			return f.code == Message::InlineBatch && nb_batches++ == 0;
+		};
+		QVERIFY2 (link.run (), qPrintable (link.error));
+		QCOMPARE (link.nb_retries, nb_files);
+		QCOMPARE (int(link.frames_of (Message::Resend).size ()), nb_files);
+		// Main stream: one list for all files, without digests. Then one per resent file.
+		auto lists = link.frames_of (Message::Checksums);
+		QCOMPARE (int(lists.size ()), 1 + nb_files);
+		QCOMPARE (Link::parse_checksums (lists[0]).size (), 0);
+		for (std::size_t i = 1; i < lists.size (); ++i) {
+			auto list = Link::parse_checksums (lists[i]);
+			QCOMPARE (list.get_nb_files (), quint32 (1));
+			QCOMPARE (list.size (), 1);
+		}
+		complete_and_compare (link);
+	}
+
+	void retry_limit (void) {
+		// Always damaged: fails after Const::max_file_retries resends
+		QVERIFY (Test::write_file (source_dir () + "/big", Const::chunk_size + 1, 3));
+		Link link;
+		QVERIFY2 (link.setup (source_dir (), target.path ()), qPrintable (link.error));
+		link.damage = [](const Link::Frame & f) { return f.code == Message::Chunk; };
+		QVERIFY (!link.run ());
+		QCOMPARE (link.nb_retries, Const::max_file_retries);
+		QVERIFY2 (link.error.contains ("retries"), qPrintable (link.error));
+		QVERIFY (!link.receiver.is_transfer_complete ());
+	}
+
+	void retry_of_unsent_file (void) {
+		// Checksums are grouped: sent files can be retried before their checksum, others cannot
+		for (int i = 0; i < 10; ++i)
+			QVERIFY (Test::write_file (source_dir () + QString ("/f%1").arg (i), 1000, i));
+		QVERIFY (Test::write_file (source_dir () + "/big", 4 * Const::chunk_size, 10));
+		Link link;
+		QVERIFY2 (link.setup (source_dir (), target.path ()), qPrintable (link.error));
+		QVERIFY (!link.sender.queue_resend (0));
+		while (link.sender.get_current_index () == 0)
+			QVERIFY2 (link.step (), qPrintable (link.error));
+		auto sent = link.sender.get_current_index ();
+		QVERIFY (link.sender.queue_resend (sent - 1));
+		QVERIFY (!link.sender.queue_resend (sent));
+		QVERIFY (!link.sender.queue_resend (quint32 (link.sender.get_nb_files ())));
+	}
+
+	void inline_batches (void) {
+		// Batches are bounded in files and data, and cover all small files
+		int nb_inline = 0;
+		for (int i = 0; i < 1500; ++i, ++nb_inline)
+			QVERIFY (Test::write_file (source_dir () + QString ("/sized/f%1").arg (i),
+			                           (i * 37) % (Const::inline_max_file_size + 1), i));
+		for (int i = 0; i < Const::inline_batch_max_files + 100; ++i, ++nb_inline)
+			QVERIFY (Test::write_file (source_dir () + QString ("/tiny/f%1").arg (i), 1, i));
+		QVERIFY (Test::write_file (source_dir () + "/large/a", Const::inline_max_file_size + 1, 1));
+		QVERIFY (Test::write_file (source_dir () + "/large/b", 2 * Const::chunk_size + 5, 2));
+		Link link;
+		QVERIFY2 (link.setup (source_dir (), target.path ()), qPrintable (link.error));
+		QVERIFY2 (link.run (), qPrintable (link.error));
+		QCOMPARE (link.nb_retries, 0);
+
+		quint32 nb_batched = 0;
+		qint64 data_size = 0;
+		for (auto & frame : link.frames_of (Message::InlineBatch)) {
+			auto nb_files = Link::inline_batch_nb_files (frame);
+			auto size = Link::inline_batch_data_size (frame);
+			QVERIFY (0 < nb_files && nb_files <= quint32 (Const::inline_batch_max_files));
+			QVERIFY (size <= Const::inline_batch_size);
+			nb_batched += nb_files;
+			data_size += size;
+		}
+		QCOMPARE (nb_batched, quint32 (nb_inline));
+		for (auto & frame : link.frames_of (Message::Chunk))
+			data_size += frame.content.size ();
+		QCOMPARE (data_size, link.sender.get_total_size ());
+		complete_and_compare (link);
+	}
+
+	void inline_batch_checks (void) {
+		// The receiver only accepts batches that match its manifest
+		for (int i = 0; i < 3; ++i)
+			QVERIFY (Test::write_file (source_dir () + QString ("/f%1").arg (i), 100, i));
+		Link link;
+		QVERIFY2 (link.setup (source_dir (), target.path ()), qPrintable (link.error));
+		QCOMPARE (link.receiver.inline_batch_data_size (0), qint64 (-1));
+		QCOMPARE (link.receiver.inline_batch_data_size (3), qint64 (300));
+		QCOMPARE (link.receiver.inline_batch_data_size (4), qint64 (-1));
+		QCOMPARE (link.receiver.inline_batch_data_size (Const::inline_batch_max_files + 1),
+		          qint64 (-1));
+		// Inline files are never in chunks
+		QByteArray data (10, 'x');
+		QDataStream in (data);
+		QVERIFY (!link.receiver.receive_chunk (in, data.size ()));
+	}
+
+	void range_out_of_payload (void) {
+		// Ranges come from the network: offset + length could overflow
+		QVERIFY (Test::write_file (source_dir () + "/a", 1000, 1));
+		Payload::Manager seed;
+		QVERIFY2 (seed.from_source_path (source_dir (), false), qPrintable (seed.get_last_error ()));
+		seed.start_random_access (Payload::Manager::Sending);
+		QByteArray data;
+		QDataStream out (&data, QIODevice::WriteOnly);
+		out.setVersion (Const::serializer_version);
+		QVERIFY (!seed.transfer_range (out, std::numeric_limits<qint64>::max () - 10, 100));
+		QVERIFY (!seed.transfer_range (out, 900, 101));
+		QVERIFY (!seed.transfer_range (out, -1, 10));
+		QVERIFY (data.isEmpty ());
+		QVERIFY (seed.transfer_range (out, 900, 100));
+		QCOMPARE (data, Test::read_file (source_dir () + "/a").mid (900));
+	}
+
+	void local_copy_needs_readable_sources (void) {
+		// A private file of the sender refuses the same host copy (network is used instead)
+		QVERIFY (Test::write_file (source_dir () + "/a", 100, 1));
+		QVERIFY (Test::write_file (source_dir () + "/sub/private", 100, 2));
+		Link link;
+		QVERIFY2 (link.setup (source_dir (), target.path ()), qPrintable (link.error));
+		QDir sender_dir (link.sender.get_payload_dir_path ());
+		QVERIFY (link.receiver.set_copy_source (sender_dir, link.sender.get_source_identities ()));
+
+		auto path = source_dir () + "/sub/private";
+		auto permissions = QFile::permissions (path);
+		QVERIFY (QFile::setPermissions (path, QFileDevice::WriteOwner));
+		auto still_readable = QFileInfo (path).isReadable ();
+		auto usable = link.receiver.set_copy_source (sender_dir, link.sender.get_source_identities ());
+		QVERIFY (QFile::setPermissions (path, permissions));
+		if (still_readable)
+			QSKIP ("Permissions are not enforced for this user");
+		QVERIFY (!usable);
+	}
+
+	void grouped_checksums (void) {
+		// Lists of Const::checksums_per_frame files or more, with digests of large files only
+		const int nb_small = Const::checksums_per_frame + 4;
+		for (int i = 0; i < nb_small; ++i)
+			QVERIFY (Test::write_file (source_dir () + QString ("/small/f%1").arg (i), 16, i));
+		QVERIFY (Test::write_file (source_dir () + "/large/a", Const::chunk_size + 3, 1));
+		QVERIFY (Test::write_file (source_dir () + "/large/b", 2 * Const::chunk_size, 2));
+		Link link;
+		QVERIFY2 (link.setup (source_dir (), target.path ()), qPrintable (link.error));
+		QVERIFY2 (link.run (), qPrintable (link.error));
+
+		auto lists = link.frames_of (Message::Checksums);
+		QVERIFY (lists.size () >= 2);
+		quint32 next_file = 0;
+		int nb_digests = 0;
+		for (auto & frame : lists) {
+			auto list = Link::parse_checksums (frame);
+			QCOMPARE (list.get_first_file (), next_file);
+			QVERIFY (list.size () <= int(list.get_nb_files ()));
+			next_file += list.get_nb_files ();
+			nb_digests += list.size ();
+		}
+		QCOMPARE (next_file, quint32 (link.sender.get_nb_files ()));
+		QCOMPARE (nb_digests, 2);
+		complete_and_compare (link);
+	}
+
+	void md5_stream (void) {
+		// Same digests as QCryptographicHash, for any sizes and pieces
+		for (int size : {0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 5000}) {
+			auto data = Test::pattern (size, size);
+			Md5::Stream stream;
+			for (int i = 0; i < size; i += 1 + i % 70)
+				stream.add_data (data.constData () + i, qMin (1 + i % 70, size - i));
+			QByteArray digest (Md5::digest_size, Qt::Uninitialized);
+			stream.result (digest.data ());
+			QCOMPARE (digest, QCryptographicHash::hash (data, QCryptographicHash::Md5));
+		}
+	}
+
+	void checksum_list_stream (void) {
+		ChecksumList list;
+		list.reset_all (3);
+		for (int i = 0; i < 3; ++i)
+			list.set (i, QCryptographicHash::hash (QByteArray (1, char(i)), Const::hash_algorithm)
+			                 .constData ());
+		QByteArray data;
+		{
+			QDataStream out (&data, QIODevice::WriteOnly);
+			out.setVersion (Const::serializer_version);
+			out << list;
+		}
+		{
+			QDataStream in (data);
+			in.setVersion (Const::serializer_version);
+			ChecksumList read;
+			in >> read;
+			QCOMPARE (in.status (), QDataStream::Ok);
+			QVERIFY (read == list);
+		}
+		// More digests than files, and digests that are not there
+		auto corrupt = [](quint32 nb_files, quint32 nb_digests) {
+			QByteArray bad;
+			{
+				QDataStream out (&bad, QIODevice::WriteOnly);
+				out.setVersion (Const::serializer_version);
+				out << quint32 (0) << nb_files << nb_digests;
+			}
+			bad.append (QByteArray (Const::hash_size, '\0'));
+			QDataStream in (bad);
+			in.setVersion (Const::serializer_version);
+			ChecksumList read;
+			in >> read;
+			return in.status ();
+		};
+		QCOMPARE (corrupt (1, 1), QDataStream::Ok);
+		QCOMPARE (corrupt (1, 2), QDataStream::ReadCorruptData);
+		QCOMPARE (corrupt (1000, 1000), QDataStream::ReadCorruptData);
+	}
+};
+
+QTEST_GUILESS_MAIN (TestPayload)
+#include "tst_payload.moc"
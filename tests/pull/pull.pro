@@ -0,0 +1,17 @@
+# Multi-source pull from a local seed server: block scheduling, failing sources, retries
+
+TEMPLATE = app
+CONFIG += console c++11 testcase
+CONFIG -= app_bundle
+QT += core network testlib
+QT -= gui
+
+INCLUDEPATH += ../../src ..
+TARGET = tst_pull
+HEADERS += \
+	../../src/core_pull.h \
+	../../src/core_scheduler.h \
+	../../src/core_server.h \
+	../../src/core_transfer.h \
+	../test_common.h
+SOURCES += tst_pull.cpp
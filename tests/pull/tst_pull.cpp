@@ -0,0 +1,199 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QSignalSpy>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTemporaryDir>
+#include <QtTest>
+#include <memory>
+#include <vector>
+
+#include "core_pull.h"
+#include "core_server.h"
+#include "test_common.h"
+
+using Transfer::Pull;
+
+/* TCP relay to the seed server, that can damage what the seed sends.
+ * Positions count the bytes relayed from the seed, over all connections.
+ * flip_at flips one byte, cut_after aborts the connection after that many bytes (once each).
+ * Deleting the relay closes its connections.
+ */
+class Relay {
+public:
+	qint64 flip_at{-1};
+	qint64 cut_after{-1};
+	qint64 relayed{0};
+
+private:
+	QTcpServer server;
+	const quint16 seed_port;
+
+public:
+	explicit Relay (quint16 seed_port) : seed_port (seed_port) {
+		QObject::connect (&server, &QTcpServer::newConnection, [this] {
+			while (server.hasPendingConnections ())
+				relay (server.nextPendingConnection ());
+		});
+		server.listen (QHostAddress::LocalHost);
+	}
+	quint16 port (void) const { return server.serverPort (); }
+
+private:
+	void relay (QTcpSocket * puller) {
+		auto seed = new QTcpSocket (puller);
+		QObject::connect (puller, &QTcpSocket::readyRead, seed,
+		                  [puller, seed] { seed->write (puller->readAll ()); });
+		QObject::connect (seed, &QTcpSocket::readyRead, puller,
+		                  [this, puller, seed] { from_seed (puller, seed->readAll ()); });
+		QObject::connect (seed, &QTcpSocket::disconnected, puller, &QTcpSocket::disconnectFromHost);
+		QObject::connect (puller, &QTcpSocket::disconnected, puller, &QObject::deleteLater);
+		seed->connectToHost (QHostAddress::LocalHost, seed_port); // Writes are buffered until then
+	}
+	void from_seed (QTcpSocket * puller, QByteArray data) {
+		if (relayed <= flip_at && flip_at < relayed + data.size ()) {
+			auto i = int(flip_at - relayed);
+			data[i] = char(data.at (i) ^ 1);
+			flip_at = -1;
+		}
+		if (relayed <= cut_after && cut_after < relayed + data.size ()) {
+			puller->write (data.left (int(cut_after - relayed)));
+			relayed = cut_after;
+			cut_after = -1;
+			puller->flush ();
+			puller->abort ();
+			return;
+		}
+		relayed += data.size ();
+		puller->write (data);
+	}
+};
+
+/* Pulls of a payload of a few blocks, from one seed server (each source is a connection).
+ * Sources go through relays when they must fail or send bad data.
+ */
+class TestPull : public QObject {
+	Q_OBJECT
+
+private:
+	QTemporaryDir settings;
+	QTemporaryDir source;
+	QTemporaryDir target;
+	std::unique_ptr<Transfer::SeedServer> seed_server;
+
+	QString source_dir (void) const { return source.path () + "/data"; }
+	QString target_dir (void) const { return target.path () + "/data"; }
+	quint16 seed_port (void) const { return seed_server->port (); }
+
+	static void add_sources (Pull & pull, quint16 port, int nb) {
+		for (int i = 0; i < nb; ++i)
+			pull.add_source ("seed", QHostAddress::LocalHost, port);
+	}
+	static bool is_finished (const Pull & pull) {
+		return pull.get_status () == Pull::Completed || pull.get_status () == Pull::Error;
+	}
+	void check_completed (const Pull & pull) {
+		QTRY_VERIFY_WITH_TIMEOUT (is_finished (pull), 30000);
+		QVERIFY2 (pull.get_status () == Pull::Completed, qPrintable (pull.get_error ()));
+		QVERIFY (pull.get_payload ().is_transfer_complete ());
+		auto diff = Test::compare_trees (source_dir (), target_dir ());
+		QVERIFY2 (diff.isEmpty (), qPrintable (diff));
+	}
+
+private slots:
+	void initTestCase (void) {
+		QVERIFY (settings.isValid ());
+		QVERIFY (source.isValid ());
+		QVERIFY (target.isValid ());
+		Test::isolate_settings (settings.path ());
+		// Blocks cover several files, and files several blocks
+		QVERIFY (Test::write_file (source_dir () + "/big1", 5 * Const::pull_block_size + 123, 1));
+		QVERIFY (Test::write_file (source_dir () + "/big2", 3 * Const::pull_block_size, 2));
+		for (int i = 0; i < 20; ++i)
+			QVERIFY (Test::write_file (source_dir () + QString ("/sub/s%1").arg (i), 3000, 10 + i));
+		QVERIFY (Test::write_file (source_dir () + "/empty", QByteArray ()));
+
+		seed_server.reset (new Transfer::SeedServer ("seed"));
+		QSignalSpy ready (seed_server.get (), SIGNAL (ready ()));
+		seed_server->set_payload (source_dir (), false);
+		QVERIFY (ready.wait (30000));
+	}
+	void init (void) { QDir (target_dir ()).removeRecursively (); }
+
+	void several_sources (void) {
+		// More sources than Const::pull_max_sources: some wait in standby
+		Pull pull (target.path ());
+		add_sources (pull, seed_port (), Const::pull_max_sources + 1);
+		check_completed (pull);
+	}
+
+	void failed_source_is_replaced (void) {
+		// The first source dies with blocks in flight: they are requested from others
+		Relay relay (seed_port ());
+		relay.cut_after = Const::pull_range_piece_size;
+		Pull pull (target.path ());
+		connect (&pull, &Pull::status_changed, [&pull, this](Pull::Status status) {
+			if (status == Pull::Transfering)
+				add_sources (pull, seed_port (), Const::pull_max_sources + 1);
+		});
+		pull.add_source ("seed", QHostAddress::LocalHost, relay.port ());
+		check_completed (pull);
+		QCOMPARE (relay.cut_after, qint64 (-1));
+	}
+
+	void bad_block_is_requested_again (void) {
+		// Data damaged by the first source fails verification, and its file is pulled again
+		Relay relay (seed_port ());
+		relay.flip_at = Const::pull_range_piece_size / 2;
+		Pull pull (target.path ());
+		QVector<Pull::Status> statuses;
+		connect (&pull, &Pull::status_changed, [&](Pull::Status status) {
+			statuses.append (status);
+			if (status == Pull::Transfering && statuses.count (Pull::Transfering) == 1)
+				add_sources (pull, seed_port (), 1);
+		});
+		pull.add_source ("seed", QHostAddress::LocalHost, relay.port ());
+		check_completed (pull);
+		QCOMPARE (relay.flip_at, qint64 (-1));
+		QCOMPARE (statuses, (QVector<Pull::Status>{Pull::Transfering, Pull::Verifying,
+		                                            Pull::Transfering, Pull::Verifying,
+		                                            Pull::Completed}));
+	}
+
+	void sources_gone_while_verifying (void) {
+		// All blocks are on disk: losing the sources does not fail the verification.
+		// Ready sources fail when hashing starts, as if their connections were lost.
+		Pull pull (target.path ());
+		int nb_failed = 0;
+		connect (&pull, &Pull::status_changed, [&pull, &nb_failed](Pull::Status status) {
+			if (status != Pull::Verifying)
+				return;
+			for (auto source : pull.findChildren<Transfer::PullSource *> ()) {
+				if (source->get_status () == Transfer::PullSource::Ready) {
+					emit source->failed ();
+					++nb_failed;
+				}
+			}
+		});
+		add_sources (pull, seed_port (), 2);
+		check_completed (pull);
+		QVERIFY (nb_failed > 0);
+	}
+};
+
+QTEST_GUILESS_MAIN (TestPull)
+#include "tst_pull.moc"
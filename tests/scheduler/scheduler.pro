@@ -0,0 +1,12 @@
+# Receive scheduler: admission per disk, and changes of the writer limit
+
+TEMPLATE = app
+CONFIG += console c++11 testcase
+CONFIG -= app_bundle
+QT += core network testlib
+QT -= gui
+
+INCLUDEPATH += ../../src
+TARGET = tst_scheduler
+HEADERS += ../../src/core_scheduler.h
+SOURCES += tst_scheduler.cpp
@@ -0,0 +1,133 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QTemporaryDir>
+#include <QtTest>
+#include <functional>
+#include <memory>
+
+#include "core_scheduler.h"
+
+using Transfer::ReceiveScheduler;
+
+/* The scheduler is a singleton: all writers of a test are released at its end (owner destroyed).
+ * Targets are in one temporary dir, so all writers are in the same disk group.
+ * Limit changes are driven by the bytes written that writers report at each period.
+ */
+class TestScheduler : public QObject {
+	Q_OBJECT
+
+private:
+	QTemporaryDir dir;
+
+	struct Writer {
+		std::unique_ptr<QObject> owner{new QObject};
+		std::function<qint64 (void)> bytes_written{[] { return qint64 (0); }};
+		int position{-1};
+	};
+	void enqueue (Writer & writer, const QString & target_dir) {
+		ReceiveScheduler::instance ().enqueue (writer.owner.get (), target_dir,
+		                                       [&writer] { return writer.bytes_written (); },
+		                                       [&writer](int position) { writer.position = position; });
+	}
+	void release (Writer & writer) { ReceiveScheduler::instance ().release (writer.owner.get ()); }
+
+	static void wait_idle_scheduler (void) {
+		// Disks without writers are forgotten at the next period, with their limit
+		QTest::qWait (2 * Const::receive_scheduler_interval_msec);
+	}
+
+private slots:
+	void initTestCase (void) { QVERIFY (dir.isValid ()); }
+
+	void admission_in_order (void) {
+		Writer writers[4];
+		for (auto & w : writers)
+			enqueue (w, dir.path ());
+		QCOMPARE (writers[0].position, 0);
+		QCOMPARE (writers[1].position, 0);
+		QCOMPARE (writers[2].position, 1);
+		QCOMPARE (writers[3].position, 2);
+		release (writers[0]);
+		QCOMPARE (writers[2].position, 0);
+		QCOMPARE (writers[3].position, 1);
+		release (writers[3]);
+		release (writers[1]);
+		QCOMPARE (writers[2].position, 0);
+	}
+
+	void destroyed_owner_is_released (void) {
+		Writer writers[3];
+		for (auto & w : writers)
+			enqueue (w, dir.path ());
+		QCOMPARE (writers[2].position, 1);
+		writers[0].owner.reset ();
+		QCOMPARE (writers[2].position, 0);
+	}
+
+	void missing_target_dir_groups_with_parent (void) {
+		// Created later, on the device of the nearest existing parent
+		Writer writers[3];
+		enqueue (writers[0], dir.path ());
+		enqueue (writers[1], dir.path () + "/not/created/yet");
+		enqueue (writers[2], dir.path ());
+		QCOMPARE (writers[1].position, 0);
+		QCOMPARE (writers[2].position, 1);
+	}
+
+	void raise_kept_with_throughput (void) {
+		// Throughput grows with each admitted writer: the limit keeps rising while writers wait
+		wait_idle_scheduler ();
+		Writer writers[4];
+		qint64 calls = 0;
+		writers[0].bytes_written = [&calls] {
+			++calls;
+			return calls * calls * 1000000;
+		};
+		for (auto & w : writers)
+			enqueue (w, dir.path ());
+		QCOMPARE (writers[2].position, 1);
+		// Raised after a period, kept after the next one, and raised again
+		QTRY_COMPARE_WITH_TIMEOUT (writers[2].position, 0,
+		                           3 * Const::receive_scheduler_interval_msec);
+		QCOMPARE (writers[3].position, 1);
+		QTRY_COMPARE_WITH_TIMEOUT (writers[3].position, 0,
+		                           4 * Const::receive_scheduler_interval_msec);
+	}
+
+	void raise_dropped_without_throughput (void) {
+		// Same throughput with one more writer: the limit goes back, without evicting anyone
+		wait_idle_scheduler ();
+		Writer writers[4];
+		qint64 calls = 0;
+		writers[0].bytes_written = [&calls] { return ++calls * 1000000; };
+		for (auto & w : writers)
+			enqueue (w, dir.path ());
+		QTRY_COMPARE_WITH_TIMEOUT (writers[2].position, 0,
+		                           3 * Const::receive_scheduler_interval_msec);
+		QCOMPARE (writers[3].position, 1);
+		// Admission, then one call per period: the raise has been evaluated after the third
+		QTRY_VERIFY_WITH_TIMEOUT (calls >= 3, 3 * Const::receive_scheduler_interval_msec);
+		QCOMPARE (writers[2].position, 0);
+		release (writers[2]);
+		QCOMPARE (writers[3].position, 1);
+		release (writers[1]);
+		QCOMPARE (writers[3].position, 0);
+	}
+};
+
+QTEST_GUILESS_MAIN (TestScheduler)
+#include "tst_scheduler.moc"
@@ -0,0 +1,91 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include <QByteArray>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
+#include <QString>
+#include <QStringList>
+
+/* Helpers shared by the tests.
+ * Files are filled with a pattern that depends on their seed, so that files of the same size
+ * differ, and a misplaced block shows up in compare_trees.
+ */
+namespace Test {
+
+// Settings are read by transfers (Settings::Element writes defaults): keep them out of $HOME
+inline void isolate_settings (const QString & dir) {
+	QSettings::setDefaultFormat (QSettings::IniFormat);
+	QSettings::setPath (QSettings::IniFormat, QSettings::UserScope, dir);
+}
+
+inline QByteArray pattern (qint64 size, int seed) {
+	QByteArray data (int(size), Qt::Uninitialized);
+	quint32 state = quint32 (seed) * 2654435761u + 1;
+	for (int i = 0; i < data.size (); ++i) {
+		state = state * 1103515245u + 12345u;
+		data[i] = char(state >> 16);
+	}
+	return data;
+}
+
+inline bool write_file (const QString & path, const QByteArray & data) {
+	QDir ().mkpath (QFileInfo (path).path ());
+	QFile file (path);
+	return file.open (QIODevice::WriteOnly | QIODevice::Truncate) &&
+	       file.write (data) == data.size ();
+}
+inline bool write_file (const QString & path, qint64 size, int seed) {
+	return write_file (path, pattern (size, seed));
+}
+
+inline QByteArray read_file (const QString & path) {
+	QFile file (path);
+	if (!file.open (QIODevice::ReadOnly))
+		return QByteArray ();
+	return file.readAll ();
+}
+
+// Relative paths of files under dir, sorted
+inline QStringList list_files (const QString & dir) {
+	QStringList paths;
+	QDirIterator it (dir, QDir::Files | QDir::Hidden, QDirIterator::Subdirectories);
+	while (it.hasNext ())
+		paths.append (QDir (dir).relativeFilePath (it.next ()));
+	paths.sort ();
+	return paths;
+}
+
+// Empty if both trees have the same files with the same content, else what differs
+inline QString compare_trees (const QString & expected, const QString & actual) {
+	auto files = list_files (expected);
+	if (files != list_files (actual))
+		return QStringLiteral ("different file lists");
+	for (auto & path : files)
+		if (read_file (QDir (expected).filePath (path)) != read_file (QDir (actual).filePath (path)))
+			return QStringLiteral ("different content: %1").arg (path);
+	return QString ();
+}
+}
+
+#endif
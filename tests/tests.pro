@@ -0,0 +1,5 @@
+# Behavior tests (Qt Test), one program per area
+# Run: qmake tests/tests.pro -o tests/Makefile && make -C tests check
+
+TEMPLATE = subdirs
+SUBDIRS = payload capabilities pull scheduler
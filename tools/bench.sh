@@ -0,0 +1,72 @@
+#!/usr/bin/env bash
+# Localshare protocol benchmarks on simulated network links.
+#
+# Usage: tools/bench.sh <payload> [scenario...]
+# Env: LOCALSHARE (default ./localshare), NETSIM (default tools/netsim/netsim), PORT (default 24500)
+#
+# Each scenario starts a receiver, a netsim proxy in front of it, and times an upload through the
+# proxy. It prints the time to completion and throughput of each scenario.
+# Transfers use --network-only, as the proxy is on the same host as the receiver.
+# Each scenario has its own settings (XDG_CONFIG_HOME), so the upload measures its link again
+# instead of reusing the measurement of a previous scenario.
+set -ue
+
+LOCALSHARE="${LOCALSHARE:-./localshare}"
+NETSIM="${NETSIM:-tools/netsim/netsim}"
+PORT="${PORT:-24500}"
+
+declare -A SCENARIOS=(
+	[lan]="--rtt 0.2"
+	[wifi]="--rate 100 --rtt 5 --jitter 2"
+	[wan]="--rate 100 --rtt 50"
+	[lossy]="--rate 100 --rtt 50 --loss 1"
+	[reorder]="--rate 100 --rtt 20 --reorder 5 --reorder-delay 5"
+	[slow]="--rate 10 --rtt 100 --jitter 10 --loss 0.5"
+)
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 <payload> [scenario...]" >&2
+	echo "Scenarios: ${!SCENARIOS[*]}" >&2
+	exit 1
+fi
+payload="$1"
+shift
+if [ $# -eq 0 ]; then
+	set -- lan wifi wan lossy reorder slow
+fi
+
+payload_bytes=$(du -sb "$payload" | cut -f1)
+work_dir=$(mktemp -d)
+pids=()
+cleanup() {
+	for pid in "${pids[@]}"; do kill "$pid" 2>/dev/null || true; done
+	rm -rf "$work_dir"
+}
+trap cleanup EXIT
+
+printf "%-10s %10s %12s  %s\n" scenario "time (s)" "Mbit/s" "link"
+for scenario in "$@"; do
+	options="${SCENARIOS[$scenario]:?unknown scenario $scenario}"
+	target="$work_dir/$scenario"
+	mkdir -p "$target"
+	export XDG_CONFIG_HOME="$work_dir/config-$scenario"
+
+	"$LOCALSHARE" -d -y -q --network-only --port "$PORT" -t "$target" &
+	receiver=$!
+	# shellcheck disable=SC2086
+	"$NETSIM" --listen $((PORT + 1)) --target "127.0.0.1:$PORT" $options 2>"$work_dir/netsim.log" &
+	proxy=$!
+	pids=("$receiver" "$proxy")
+	sleep 0.5
+
+	start=$(date +%s.%N)
+	"$LOCALSHARE" -u "$payload" --connect "127.0.0.1:$((PORT + 1))" -q
+	wait "$receiver"
+	end=$(date +%s.%N)
+	kill "$proxy" 2>/dev/null || true
+	wait "$proxy" 2>/dev/null || true
+
+	awk -v s="$scenario" -v t0="$start" -v t1="$end" -v b="$payload_bytes" -v o="$options" \
+		'BEGIN { t = t1 - t0; printf "%-10s %10.2f %12.1f  %s\n", s, t, b * 8 / t / 1e6, o }'
+	rm -rf "$target"
+done
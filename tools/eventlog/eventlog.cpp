@@ -0,0 +1,98 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QByteArray>
+#include <QFile>
+#include <QTextStream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "core_eventlog.h"
+
+/* Eventlog: decodes an event log file (see core_eventlog.h) to text.
+ * Records of all threads are merged in time order, one line each.
+ *
+ * $ eventlog <file> [transfer_id]
+ * With a transfer id, only prints the records of this transfer.
+ */
+
+namespace {
+template <typename T> bool read_struct (QFile & file, T & t) {
+	return file.read (reinterpret_cast<char *> (&t), sizeof (T)) == qint64 (sizeof (T));
+}
+}
+
+int main (int argc, char * argv[]) {
+	if (argc < 2 || argc > 3) {
+		std::fprintf (stderr, "Usage: %s <file> [transfer_id]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	bool filter = argc == 3;
+	auto transfer = filter ? QByteArray (argv[2]).toUInt () : 0u;
+
+	QFile file (QFile::decodeName (argv[1]));
+	if (!file.open (QIODevice::ReadOnly)) {
+		std::fprintf (stderr, "Cannot open %s: %s\n", argv[1], qPrintable (file.errorString ()));
+		return EXIT_FAILURE;
+	}
+	EventLog::FileHeader header;
+	if (!read_struct (file, header) ||
+	    std::memcmp (header.magic, EventLog::file_magic, sizeof (header.magic)) != 0) {
+		std::fprintf (stderr, "%s is not an event log\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (header.version != EventLog::file_version ||
+	    header.record_size != sizeof (EventLog::Record)) {
+		std::fprintf (stderr, "Unsupported event log version %u (record size %u)\n",
+		              header.version, header.record_size);
+		return EXIT_FAILURE;
+	}
+
+	std::vector<EventLog::Record> records;
+	bool truncated = false;
+	for (quint32 i = 0; i < header.nb_rings && !truncated; ++i) {
+		EventLog::RingHeader ring;
+		if (!read_struct (file, ring)) {
+			truncated = true;
+			break;
+		}
+		for (quint32 j = 0; j < ring.nb_records; ++j) {
+			EventLog::Record r;
+			if (!read_struct (file, r)) {
+				truncated = true;
+				break;
+			}
+			if (!filter || r.transfer == transfer)
+				records.push_back (r);
+		}
+	}
+	std::stable_sort (records.begin (), records.end (),
+	                  [](const EventLog::Record & a, const EventLog::Record & b) {
+		                  return a.time_nsec < b.time_nsec;
+	                  });
+
+	QTextStream out (stdout);
+	for (auto & r : records)
+		out << EventLog::format (r, header.start_msecs) << '\n';
+	out.flush ();
+	if (truncated) {
+		std::fprintf (stderr, "Event log is truncated\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
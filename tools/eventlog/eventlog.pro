@@ -0,0 +1,13 @@
+# Event log decoder: prints files written by EventLog::Log::dump as text
+# Build: qmake tools/eventlog/eventlog.pro && make
+
+TEMPLATE = app
+CONFIG += console c++11 release
+CONFIG -= app_bundle
+QT += core network
+QT -= gui
+
+INCLUDEPATH += ../../src
+TARGET = eventlog
+HEADERS += ../../src/core_eventlog.h
+SOURCES += eventlog.cpp
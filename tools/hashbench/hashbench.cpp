@@ -0,0 +1,112 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "core_md5.h"
+
+/* Hashbench: MD5 throughput on in-memory files of several sizes.
+ * Compares the stream path (Md5::Stream, one file at a time) to Md5::hash_many.
+ * Digests of both paths are compared to QCryptographicHash, and a mismatch is an error.
+ *
+ * $ hashbench [total_mb]
+ * Each size hashes about total_mb of data (default 256).
+ */
+
+namespace {
+struct Result {
+	double stream_mbps;
+	double multi_mbps;
+	bool same_digests;
+};
+
+Result run (qint64 file_size, qint64 total_size) {
+	auto nb_files = int(qMax (total_size / file_size, qint64 (1)));
+	std::mt19937 rng (42);
+	std::vector<QByteArray> files (nb_files);
+	for (auto & f : files) {
+		f.resize (int(file_size));
+		for (auto & c : f)
+			c = char(rng ());
+	}
+	auto mbps = [&](qint64 nsec) { return double(file_size) * nb_files * 1e3 / double(nsec); };
+
+	QByteArray reference;
+	for (auto & f : files)
+		reference += QCryptographicHash::hash (f, QCryptographicHash::Md5);
+
+	QByteArray stream_digests (nb_files * Md5::digest_size, Qt::Uninitialized);
+	QElapsedTimer timer;
+	timer.start ();
+	Md5::Stream stream;
+	for (int i = 0; i < nb_files; ++i) {
+		stream.reset ();
+		stream.add_data (files[i].constData (), files[i].size ());
+		stream.result (stream_digests.data () + i * Md5::digest_size);
+	}
+	auto stream_nsec = timer.nsecsElapsed ();
+
+	std::vector<const char *> data;
+	std::vector<qint64> sizes;
+	for (auto & f : files) {
+		data.push_back (f.constData ());
+		sizes.push_back (f.size ());
+	}
+	QByteArray multi_digests (nb_files * Md5::digest_size, Qt::Uninitialized);
+	timer.start ();
+	Md5::hash_many (data.data (), sizes.data (), nb_files, multi_digests.data ());
+	auto multi_nsec = timer.nsecsElapsed ();
+
+	return {mbps (stream_nsec), mbps (multi_nsec),
+	        stream_digests == reference && multi_digests == reference};
+}
+}
+
+int main (int argc, char * argv[]) {
+	qint64 total_mb = 256;
+	if (argc > 1)
+		total_mb = QByteArray (argv[1]).toLongLong ();
+	if (total_mb <= 0) {
+		std::fprintf (stderr, "Usage: %s [total_mb]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	QTextStream out (stdout);
+	out << QStringLiteral ("multi-buffer lanes: %1\n").arg (Md5::nb_lanes ());
+	out << QStringLiteral ("%1 %2 %3 %4\n")
+	           .arg ("file size", -10)
+	           .arg ("stream MB/s", 12)
+	           .arg ("multi MB/s", 12)
+	           .arg ("speedup", 8);
+	bool ok = true;
+	for (auto size : {qint64 (4 * 1024), qint64 (64 * 1024), qint64 (1024 * 1024)}) {
+		auto r = run (size, total_mb * 1024 * 1024);
+		out << QStringLiteral ("%1 %2 %3 %4x%5\n")
+		           .arg (QStringLiteral ("%1 KB").arg (size / 1024), -10)
+		           .arg (r.stream_mbps, 12, 'f', 1)
+		           .arg (r.multi_mbps, 12, 'f', 1)
+		           .arg (r.multi_mbps / r.stream_mbps, 7, 'f', 2)
+		           .arg (r.same_digests ? QString () : QStringLiteral ("  DIGEST MISMATCH"));
+		ok = ok && r.same_digests;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
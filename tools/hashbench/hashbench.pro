@@ -0,0 +1,13 @@
+# MD5 benchmark: Md5::Stream one file at a time, against multi-buffer Md5::hash_many
+# Build: qmake tools/hashbench/hashbench.pro && make
+
+TEMPLATE = app
+CONFIG += console c++11 release
+CONFIG -= app_bundle
+QT += core
+QT -= gui
+
+INCLUDEPATH += ../../src
+TARGET = hashbench
+HEADERS += ../../src/core_md5.h
+SOURCES += hashbench.cpp
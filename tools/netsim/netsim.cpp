@@ -0,0 +1,315 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QByteArray>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTextStream>
+#include <QTimer>
+#include <cstdio>
+#include <deque>
+#include <random>
+
+/* Netsim: TCP proxy that simulates a bad network link, for reproducible benchmarks.
+ * It runs in userspace, so it needs no root access (unlike netem).
+ *
+ * $ netsim --listen 4000 --target 127.0.0.1:5000 --rate 100 --rtt 50 --loss 1
+ * Connections to port 4000 are forwarded to 127.0.0.1:5000 through the simulated link.
+ * A summary of each connection is printed to stderr when it closes.
+ */
+
+namespace {
+QElapsedTimer clock_since_start;
+qint64 now_usec (void) {
+	return clock_since_start.nsecsElapsed () / 1000;
+}
+
+constexpr qint64 segment_size = 1448;       // Typical TCP payload in an ethernet frame
+constexpr qint64 min_in_flight = 256 * 1024; // Data buffered by a pipe (the rest waits in sockets)
+constexpr qint64 min_rto_usec = 200 * 1000;  // Linux minimum retransmission timeout
+
+struct Impairment {
+	qint64 rate{0}; // Bytes per second, 0 for unlimited
+	qint64 delay_usec{0};  // One way
+	qint64 jitter_usec{0}; // Uniform in [0, jitter]
+	double loss{0.};       // Probability per segment
+	double reorder{0.};    // Probability per segment
+	qint64 reorder_delay_usec{0};
+
+	qint64 rto_usec (void) const { return min_rto_usec + 2 * delay_usec; }
+	qint64 max_in_flight (void) const {
+		// Twice the bandwidth delay product, to not limit the rate
+		return qMax (min_in_flight, rate * 4 * delay_usec / 1000000);
+	}
+};
+
+/* One direction of a connection.
+ * Data read from the source is cut in segments, each with a delivery time:
+ * - serialization at the link rate (segments queue behind each other),
+ * - propagation delay, plus jitter,
+ * - a lost segment is delivered after a retransmission timeout,
+ * - a reordered segment is held for the reorder delay.
+ * The proxy carries a byte stream, so later segments wait behind delayed ones.
+ * This is what an application sees of a TCP connection on such a link.
+ * Reading stops when too much data is in flight, which gives backpressure to the sender.
+ */
+class Pipe {
+private:
+	struct Segment {
+		qint64 deliver_at_usec;
+		QByteArray data;
+	};
+
+	QTcpSocket * source;
+	QTcpSocket * target;
+	const Impairment & impairment;
+	std::mt19937 & random;
+
+	std::deque<Segment> queue;
+	qint64 queued_bytes{0};
+	qint64 link_free_usec{0};  // End of serialization of the last segment
+	qint64 last_delivery_usec{0}; // Delivery is in order
+	QTimer timer;
+	bool source_closed{false};
+
+public:
+	qint64 bytes_delivered{0};
+	int nb_lost{0};
+	int nb_reordered{0};
+
+	Pipe (QTcpSocket * source, QTcpSocket * target, const Impairment & impairment,
+	      std::mt19937 & random)
+	    : source (source), target (target), impairment (impairment), random (random) {
+		timer.setSingleShot (true);
+		timer.setTimerType (Qt::PreciseTimer);
+		// Connections use the timer as context: they are removed when the pipe is destroyed
+		QObject::connect (&timer, &QTimer::timeout, [this] { deliver (); });
+		QObject::connect (source, &QTcpSocket::readyRead, &timer, [this] { read_source (); });
+		QObject::connect (target, &QTcpSocket::bytesWritten, &timer, [this] { deliver (); });
+	}
+
+	void start (void) { read_source (); }
+	void close_source (void) {
+		// Deliver what remains, then close
+		source_closed = true;
+		read_source ();
+	}
+	bool is_done (void) const { return source_closed && queue.empty (); }
+
+private:
+	void read_source (void) {
+		while (queued_bytes < impairment.max_in_flight () && source->bytesAvailable () > 0)
+			schedule (source->read (segment_size));
+		deliver ();
+	}
+
+	void schedule (const QByteArray & data) {
+		std::uniform_real_distribution<double> uniform (0., 1.);
+		auto now = now_usec ();
+		auto sent_at = qMax (now, link_free_usec);
+		if (impairment.rate > 0)
+			sent_at += data.size () * qint64 (1000000) / impairment.rate;
+		link_free_usec = sent_at;
+		auto deliver_at = sent_at + impairment.delay_usec;
+		if (impairment.jitter_usec > 0)
+			deliver_at += qint64 (uniform (random) * double(impairment.jitter_usec));
+		if (uniform (random) < impairment.loss) {
+			deliver_at += impairment.rto_usec ();
+			++nb_lost;
+		} else if (uniform (random) < impairment.reorder) {
+			deliver_at += impairment.reorder_delay_usec;
+			++nb_reordered;
+		}
+		deliver_at = qMax (deliver_at, last_delivery_usec);
+		last_delivery_usec = deliver_at;
+		queue.push_back ({deliver_at, data});
+		queued_bytes += data.size ();
+	}
+
+	void deliver (void) {
+		auto now = now_usec ();
+		bool delivered = false;
+		while (!queue.empty () && queue.front ().deliver_at_usec <= now &&
+		       target->bytesToWrite () < impairment.max_in_flight ()) {
+			auto & segment = queue.front ();
+			target->write (segment.data);
+			bytes_delivered += segment.data.size ();
+			queued_bytes -= segment.data.size ();
+			queue.pop_front ();
+			delivered = true;
+		}
+		if (delivered && source->bytesAvailable () > 0)
+			QTimer::singleShot (0, &timer, [this] { read_source (); }); // Room in the queue
+		if (!queue.empty () && !timer.isActive ()) {
+			auto wait_usec = queue.front ().deliver_at_usec - now;
+			timer.start (int(qMax (wait_usec, qint64 (0)) / 1000));
+		}
+		if (is_done () && target->state () == QAbstractSocket::ConnectedState)
+			target->disconnectFromHost (); // Waits for written data
+	}
+};
+
+/* Client connection and its connection to the target, with a pipe each way.
+ * Deletes itself when both sides are closed.
+ */
+class Connection : public QObject {
+private:
+	QTcpSocket * client;
+	QTcpSocket * server;
+	Pipe upstream;
+	Pipe downstream;
+	qint64 started_usec{now_usec ()};
+	int nb_closed{0};
+
+public:
+	Connection (QTcpSocket * client_socket, const QHostAddress & address, quint16 port,
+	            const Impairment & impairment, std::mt19937 & random)
+	    : client (client_socket),
+	      server (new QTcpSocket (this)),
+	      upstream (client, server, impairment, random),
+	      downstream (server, client, impairment, random) {
+		client->setParent (this);
+		for (auto socket : {client, server}) {
+			socket->setSocketOption (QAbstractSocket::LowDelayOption, 1);
+			QObject::connect (socket, &QTcpSocket::disconnected, this,
+			                  [this, socket] { closed (socket); });
+		}
+		QObject::connect (server, &QTcpSocket::connected, this, [this] {
+			upstream.start ();
+			downstream.start ();
+		});
+		QObject::connect (
+		    server,
+		    static_cast<void (QAbstractSocket::*) (QAbstractSocket::SocketError)> (
+		        &QAbstractSocket::error),
+		    this, [this] {
+			    QTextStream (stderr) << QStringLiteral ("netsim: target error: %1\n")
+			                                .arg (server->errorString ());
+			    client->abort ();
+			    deleteLater ();
+		    });
+		server->connectToHost (address, port);
+	}
+
+private:
+	void closed (QTcpSocket * socket) {
+		if (socket == client)
+			upstream.close_source ();
+		else
+			downstream.close_source ();
+		if (++nb_closed < 2)
+			return;
+		auto duration = qMax (now_usec () - started_usec, qint64 (1));
+		auto mbit = [duration](qint64 bytes) { return double(bytes) * 8. / double(duration); };
+		QTextStream (stderr)
+		    << QStringLiteral ("netsim: connection closed after %1s: up %2 bytes (%3 Mbit/s, "
+		                       "%4 lost, %5 reordered), down %6 bytes (%7 Mbit/s)\n")
+		           .arg (double(duration) / 1e6, 0, 'f', 3)
+		           .arg (upstream.bytes_delivered)
+		           .arg (mbit (upstream.bytes_delivered), 0, 'f', 1)
+		           .arg (upstream.nb_lost)
+		           .arg (upstream.nb_reordered)
+		           .arg (downstream.bytes_delivered)
+		           .arg (mbit (downstream.bytes_delivered), 0, 'f', 1);
+		deleteLater ();
+	}
+};
+}
+
+int main (int argc, char * argv[]) {
+	QCoreApplication app (argc, argv);
+	app.setApplicationName ("netsim");
+	clock_since_start.start ();
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription (
+	    "TCP proxy simulating a network link (bandwidth, latency, jitter, loss, reordering).\n"
+	    "Loss and reordering are applied per segment, as seen through a TCP stream:\n"
+	    "a lost segment is delayed by a retransmission timeout, and later data waits behind it.");
+	parser.addHelpOption ();
+	QCommandLineOption listen_opt ("listen", "Port to listen on.", "port");
+	QCommandLineOption target_opt ("target", "Address to forward connections to.", "address:port");
+	QCommandLineOption rate_opt ("rate", "Link rate in Mbit/s (default: unlimited).", "mbit");
+	QCommandLineOption rtt_opt ("rtt", "Round trip time in ms (default: 0).", "ms");
+	QCommandLineOption jitter_opt ("jitter", "Jitter of each way in ms (default: 0).", "ms");
+	QCommandLineOption loss_opt ("loss", "Segment loss in percent (default: 0).", "percent");
+	QCommandLineOption reorder_opt ("reorder", "Segment reordering in percent (default: 0).",
+	                                "percent");
+	QCommandLineOption reorder_delay_opt ("reorder-delay",
+	                                      "Delay of reordered segments in ms (default: 10).", "ms");
+	QCommandLineOption seed_opt ("seed", "Random seed (default: 1).", "n");
+	for (auto opt : {listen_opt, target_opt, rate_opt, rtt_opt, jitter_opt, loss_opt, reorder_opt,
+	                 reorder_delay_opt, seed_opt})
+		parser.addOption (opt);
+	parser.process (app);
+
+	auto fail = [](const QString & msg) {
+		QTextStream (stderr) << QStringLiteral ("netsim: %1\n").arg (msg);
+		return EXIT_FAILURE;
+	};
+	auto number = [&](const QCommandLineOption & opt, double default_value, bool & ok) {
+		ok = true;
+		return parser.isSet (opt) ? parser.value (opt).toDouble (&ok) : default_value;
+	};
+
+	bool ok = false;
+	auto listen_port = parser.value (listen_opt).toUShort (&ok);
+	if (!ok)
+		return fail ("--listen expects a port");
+	auto target = parser.value (target_opt);
+	auto sep = target.lastIndexOf (':');
+	QHostAddress target_address;
+	auto target_port = target.mid (sep + 1).toUShort (&ok);
+	if (sep == -1 || !ok || !target_address.setAddress (target.left (sep)))
+		return fail ("--target expects an address:port value");
+
+	Impairment impairment;
+	bool all_ok = true;
+	impairment.rate = qint64 (number (rate_opt, 0., ok) * 1e6 / 8.);
+	all_ok &= ok;
+	impairment.delay_usec = qint64 (number (rtt_opt, 0., ok) * 1000. / 2.);
+	all_ok &= ok;
+	impairment.jitter_usec = qint64 (number (jitter_opt, 0., ok) * 1000.);
+	all_ok &= ok;
+	impairment.loss = number (loss_opt, 0., ok) / 100.;
+	all_ok &= ok;
+	impairment.reorder = number (reorder_opt, 0., ok) / 100.;
+	all_ok &= ok;
+	impairment.reorder_delay_usec = qint64 (number (reorder_delay_opt, 10., ok) * 1000.);
+	all_ok &= ok;
+	auto seed = number (seed_opt, 1., ok);
+	all_ok &= ok;
+	if (!all_ok)
+		return fail ("invalid numeric option");
+	std::mt19937 random (static_cast<std::mt19937::result_type> (seed));
+
+	QTcpServer server;
+	if (!server.listen (QHostAddress::Any, listen_port))
+		return fail (QStringLiteral ("cannot listen: %1").arg (server.errorString ()));
+	QObject::connect (&server, &QTcpServer::newConnection, [&] {
+		while (server.hasPendingConnections ())
+			new Connection (server.nextPendingConnection (), target_address, target_port, impairment,
+			                random);
+	});
+	QTextStream (stderr) << QStringLiteral ("netsim: forwarding port %1 to %2\n")
+	                            .arg (server.serverPort ())
+	                            .arg (target);
+	return app.exec ();
+}
@@ -0,0 +1,11 @@
+# Network impairment simulator, used by tools/bench.sh
+# Build: qmake tools/netsim/netsim.pro && make
+
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+QT += core network
+QT -= gui
+
+TARGET = netsim
+SOURCES += netsim.cpp